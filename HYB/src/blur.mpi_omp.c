@@ -5,6 +5,8 @@
 #include "ut.h"
 
 
+static int filter_bank(int args, char **argv, int rank, int size);
+
 int main(int args, char** argv)
 {	
 	int rank, size;
@@ -34,6 +36,14 @@ int main(int args, char** argv)
 	#define MAX_ARGS 7
 	#define MIN_ARGS 4
 	
+	//several kernels at once
+	if(args > 1 && !strcmp(argv[1],"bank"))
+	{
+		int ret = filter_bank(args,argv,rank,size);
+		MPI_Finalize();
+		return ret;
+	}
+	
 	if(args<MIN_ARGS) 
 	{
 		if(!rank) printf("Too few arguments in function blur. %s\n",usage);
@@ -49,12 +59,12 @@ int main(int args, char** argv)
 	
 	int arg_counter = 0;
 	int xkernel,ykernel;
-	KTYPE f, *kernel;
+	KTYPE f = 0, *kernel;
 
 	int ktype = atoi(argv[++arg_counter]);
 	  
 	/************************************************************************************	
-	 kernel choice: 0->"uniform" 1->"weighted" 2->"gaussian" 3->"imported from pgm file"
+	 kernel choice: 0->"uniform" 1->"weighted" 2->"gaussian" 3->"imported from pgm file" 4->"recursive gaussian"
 	*************************************************************************************/
   
 	switch(ktype)
@@ -129,17 +139,61 @@ int main(int args, char** argv)
 			void *kimage;
 			
 			read_pgm_image(&kimage, &kmaxval, &xkernel, &ykernel, argv[++arg_counter]);
-			kernel = normalize(kimage,xkernel,ykernel,kmaxval);
+			if(kmaxval < 0)
+			{
+				if(!rank) printf("Could not read kernel \"%s\".\n",argv[arg_counter]);
+				MPI_Finalize();
+				return 4;
+			}
+			kernel = normalize(kimage,xkernel,ykernel,kmaxval,&f);
 			free(kimage);
 
 		break;
 
+		case 4:
+			if(args > MAX_ARGS-2)
+			{
+				if(!rank) printf("Too many arguments in function blur. Only sigma needed for the recursive gaussian kernel.\n %s\n",usage);
+				MPI_Finalize();
+				return 1;
+			}
+			
+			f = atof(argv[++arg_counter]);
+			if(f < 0.5)
+			{
+				if(!rank) printf("Sigma of the recursive gaussian kernel must be at least 0.5. Given sigma was %f\n",f);
+				MPI_Finalize();
+				return 3;
+			}
+			
+			//no matrix is built: the nominal dimensions are just the support, used for halos and file names
+			xkernel = ykernel = 2*(int)ceil(IIR_SUPPORT*f)+1;
+			kernel = NULL;
+			if(!rank) printf("Using Recursive Gaussian Kernel with sigma = %f (support %dx%d)\n",f,xkernel,ykernel);
+		break;
+
 		default:
-			if(!rank) printf("Kernel id must be either 0,1,2 for automatic generation or 3 for pgm file. Given id was %d",ktype);
+			if(!rank) printf("Kernel id must be either 0,1,2 for automatic generation, 3 for pgm file or 4 for recursive gaussian. Given id was %d",ktype);
 			MPI_Finalize();
 			return 2;
 	}
 	
+	/********************
+	 engine choice 
+	********************/
+	
+	kernel_plan plan;
+	if(plan_kernel(&plan, kernel, xkernel, ykernel, ktype, f) && !rank) printf("Requested engine \"%s\" not available for this kernel.\n",getenv("BLUR_ENGINE"));
+
+	//the engine swaps the pixels itself where it can, the image is swapped in memory otherwise (before the report: the row kernels change)
+	plan_byteswap(&plan);
+	
+	if(!rank) printf("Convolution engine: %s\n",engine_name(plan.engine));
+	if(!rank && (plan.engine == ENGINE_DIRECT || plan.engine == ENGINE_TILED)) printf("Interior vectorized with: %s%s%s%s\n",simd_name(plan.simd),plan.unroll_y ? " (unrolled kernel size)" : plan.unroll_x ? " (unrolled kernel width)" : "",(const char *[]){"", ", folded along x", ", folded along y", ", folded along x and y"}[plan.symmetry],plan.row_block ? ", rows in blocks" : "");
+	if(!rank && plan.engine == ENGINE_FIXED) printf("Fixed point weights: shift %d, quantization error below %.3g grey levels\n",plan.shift,plan.qerror);
+	if(!rank && plan.engine == ENGINE_LOWRANK) printf("Low-rank kernel: %d separable terms, approximation error below %.3g grey levels\n",plan.rank,plan.lrerror);
+	if(!rank && plan.engine == ENGINE_SPARSE) printf("Sparse kernel: %d non-zero taps out of %d\n",plan.ntaps,plan.xconv*plan.yconv);
+	
 	/********************
 	 output name setting 
 	********************/
@@ -152,6 +206,7 @@ int main(int args, char** argv)
 	{
 		if(!rank) printf("Input file name must end in \".pgm\". Given file name was %s\n",input_name);
 		free(kernel);
+		free_plan(&plan);
 		MPI_Finalize();
 		return 4; //exit
 	}
@@ -181,15 +236,20 @@ int main(int args, char** argv)
 	xsize = image_parameters[1];
 	ysize = image_parameters[2];
 	
-	//the following code is structured to work with 16bit images, so it wont work with 8 bits images (yet)
-	if(maxval<255)
+	if(maxval<0)
 	{
-		if(!rank) printf("8bit pictures not supported (yet).\n");
+		if(!rank) printf("Could not read image \"%s\".\n",input_name);
 		free(kernel);
+		free_plan(&plan);
 		MPI_Finalize();
-		return 5;
+		return 4;
 	}
 	
+	//8bit images are sent and gathered as they are (1 byte per pixel), and read as such by the direct and tiled engines (see plan_depth8);
+	//for the others they are widened to 16bit (then narrowed back) in the place of the swaps
+	int depth = 1 + (maxval > 255), widen8 = depth == 1 && !plan_depth8(&plan,maxval);
+	MPI_Datatype pixel_type = (depth == 2) ? MPI_UNSIGNED_SHORT : MPI_UNSIGNED_CHAR;
+	
 	//dimesion of the halo layer above and below the chunks (at least in non-pathological case, and before correction)
 	//expressed in terms of number of pixels
 	int halo_size = (ykernel/2)*xsize; 
@@ -199,19 +259,32 @@ int main(int args, char** argv)
 	  
 	  To ease the job of subdiving the image read from file and the reunification after the blurring, it has been decided to split
 	  it in contiguous portions of memory, that is in rows. The master process blurres the first bunch of rows of the image, the first
-	  slave the second and so on. Note that this is easier to implement but implies that the border in split unevenly between the 
-	  processes. Since working on the border requires more FLOPs (need for renormalization), the workload is also distributed in a 
-	  (possibly) uneven manner: if the total number of processes does not divide the the number of rows, the work is distributed 
-	  evenly among the "middle processes" and the remaing amount of work is divided between master and last (the least workload is 
-	  always given to the master) according to the subsequent formulas: */
-
-		#define INNER_WORKLOAD(x,y,procs)  ( ( (y%procs) ? (y+procs-y%procs) : (y) )/procs * x )
-		#define FIRST_WORKLOAD(x,y,procs)  ((y-(procs-2)*(INNER_WORKLOAD(x,y,procs)/x))/2 * x)
-		#define LAST_WORKLOAD(x,y,procs)   (FIRST_WORKLOAD(x,y,procs) + ((y-(procs-2)*(INNER_WORKLOAD(x,y,procs)/x))%2 * x))
-	
-	/*If the number of processes does divide the the number of rows on the other hand, the workload is split evenly
+	  slave the second and so on. Since working on the border requires more time (renormalization, and no vector instructions), the
+	  rows are not split evenly: partition_rows estimates the cost of each row from the size of the kernel and the part of it lying on
+	  the border, and cuts the image into bands of about the same estimated cost, so that the first and last process get fewer rows. */
+
+	//The costs depend on the instruction set and the environment of the process (see row_cost), which may differ between the nodes: the
+	//master's partition is the one used by all.
+	int *first = (int *)malloc(sizeof(int)*size), *rows = (int *)malloc(sizeof(int)*size);
+	double imbalance = 0;
+
+	if(!rank) imbalance = partition_rows(&plan, xsize, ysize, size, first, rows);
+	MPI_Bcast(first, size, MPI_INT, 0, MPI_COMM_WORLD);
+	MPI_Bcast(rows, size, MPI_INT, 0, MPI_COMM_WORLD);
+
+	if(!rank)
+	{
+		int *even_first = (int *)malloc(sizeof(int)*size), *even_rows = (int *)malloc(sizeof(int)*size), r;
+		for(r=0; r<size; r++) even_first[r] = (int)((long long)ysize*r/size), even_rows[r] = (int)((long long)ysize*(r+1)/size) - even_first[r];
+
+		printf("Rows per process:");
+		for(r=0; r<size; r++) printf(" %d",rows[r]);
+		printf(" (estimated imbalance %.1f%%, %.1f%% with equal bands)\n", 100*(imbalance-1), 100*(partition_imbalance(&plan,xsize,ysize,size,even_first,even_rows)-1));
+		free(even_first);
+		free(even_rows);
+	}
 	
-	*********************************************************************************************************************************/
+	/*********************************************************************************************************************************/
 
 	//this represents the workload of each process
 	int workload;
@@ -231,20 +304,18 @@ int main(int args, char** argv)
 		//chunk is the number of pixels that each must receive, and includes halo layers.			
 		int i, start, end, chunk;
 				
-		workload = FIRST_WORKLOAD(xsize,ysize,size);
-		int inner = INNER_WORKLOAD(xsize,ysize,size);
-		int last = LAST_WORKLOAD(xsize,ysize,size);
+		workload = xsize*rows[0];
 		
 		for(i=1;i<size;i++)
 		{			
 			//this takes into account cases where start might be negative (which will be an error) and prevents it.
 			//the same goes for the end 
-			start = max(0,workload - halo_size + inner*(i-1));
-			end = (rank != size-1)? min(xsize*ysize,workload + halo_size + inner*i) : xsize*ysize;
+			start = max(0,xsize*first[i] - halo_size);
+			end = (i != size-1)? min(xsize*ysize,xsize*(first[i]+rows[i]) + halo_size) : xsize*ysize;
 			
 			chunk = end-start;
 			
-			MPI_Isend((unsigned short int *)image + start, chunk, MPI_UNSIGNED_SHORT, i, 0, MPI_COMM_WORLD, &requests[i-1]);
+			MPI_Isend((char *)image + (size_t)depth*start, chunk, pixel_type, i, 0, MPI_COMM_WORLD, &requests[i-1]);
 		}		
 			
 		/******************************************		
@@ -254,12 +325,7 @@ int main(int args, char** argv)
 		int *recv_size = (int *)malloc(size*sizeof(int));
 		int *displs = (int *)malloc(size*sizeof(int));
 		
-		//this macro calculates the size of workload given the rank
-		#define PROPER_SIZE(rank) (!(rank))?(workload):(((rank) == size-1)?(last):(inner))
-	
-		displs[0] = 0;
-		for(i=1;i<size;i++) displs[i] = displs[i-1] + (recv_size[i-1] = PROPER_SIZE(i-1));
-		recv_size[size-1] = last;
+		for(i=0;i<size;i++) displs[i] = xsize*first[i], recv_size[i] = xsize*rows[i];
 				
 		/*****************************************/
 		
@@ -271,7 +337,7 @@ int main(int args, char** argv)
 		int space_up = 0, space_down = chunk - workload;
 		
 		//allocatetes the space for the complete blurred image to be stored (also used for the local part of the master to be stored directly)
-		void *blurred = malloc(sizeof(unsigned short int)*xsize*ysize);
+		void *blurred = malloc(widen8 ? sizeof(unsigned short int)*workload : (size_t)depth*xsize*ysize);
 		
 		//Hereafter the buffer image is used in the convolution, so we must wait that all have recevied the correct image before we can modify it.
 		MPI_Waitall(size-1, requests, MPI_STATUSES_IGNORE);
@@ -284,17 +350,28 @@ int main(int args, char** argv)
 		* BLURRING - BEGIN
 		*********************************************************/
 		
+		void *wide = widen8 ? malloc(sizeof(unsigned short int)*chunk) : image;
+		
 		#pragma omp parallel
 		{
-			if ( I_M_LITTLE_ENDIAN) OMP_swap_image(image, xsize, chunk/xsize, maxval);
+			if ( widen8 ) OMP_widen_image((unsigned short int *)wide, (unsigned char *)image, xsize, chunk/xsize, plan.bswap);
+			else if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan.bswap) OMP_swap_image(image, xsize, chunk/xsize, maxval);
 			
 			//this function does the convolution of image and stores the result in blurred. 
 			//It hadles different sizes of the two by means of the space up and down counters.
-			OMP_MPIConvolve((unsigned short int *)image, (unsigned short int *)blurred, xsize, workload/xsize, kernel, xkernel, ykernel, space_up/xsize, space_down/xsize);
+			OMP_MPIBlur(wide, blurred, xsize, workload/xsize, &plan, space_up/xsize, space_down/xsize);
 			
-			if ( I_M_LITTLE_ENDIAN) OMP_swap_image(blurred, xsize, workload/xsize, maxval);
+			//a widened 8bit result goes back to the image buffer, where the others' parts are then gathered
+			if ( widen8 ) OMP_narrow_image((unsigned char *)image, (unsigned short int *)blurred, xsize, workload/xsize, maxval, plan.bswap);
+			else if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan.bswap) OMP_swap_image(blurred, xsize, workload/xsize, maxval);
 		}	
-		free(image);
+		if ( widen8 )
+		{
+			free(wide);
+			free(blurred);
+			blurred = image;
+		}
+		else free(image);
 		/********************************************************
 		* BLURRING - END
 		*********************************************************/
@@ -303,7 +380,7 @@ int main(int args, char** argv)
      
     //recombination of the split image is done by means of Gatherv function. Here the sendbuffer is MPI_IN_PLACE since the master works already
     //in the array of the complete image by construction of the algorithm.    	
-		MPI_Gatherv(MPI_IN_PLACE, workload, MPI_UNSIGNED_SHORT, blurred, recv_size, displs, MPI_UNSIGNED_SHORT, 0, MPI_COMM_WORLD);
+		MPI_Gatherv(MPI_IN_PLACE, workload, pixel_type, blurred, recv_size, displs, pixel_type, 0, MPI_COMM_WORLD);
 		
 		tcomm2 = MPI_Wtime(); 
 		
@@ -346,19 +423,19 @@ int main(int args, char** argv)
 	
 	else
 	{
-		//the workload of each is establishe by means of the above definitions
-		workload  = (rank != size-1) ? INNER_WORKLOAD(xsize,ysize,size) : LAST_WORKLOAD(xsize,ysize,size);
+		//the workload of each is established by the partition above
+		workload  = xsize*rows[rank];
 		
 		int space_up, space_down, start, end;
 		
 		//this is totally analogous to the earlier discussion
-		start = FIRST_WORKLOAD(xsize,ysize,size) - halo_size + INNER_WORKLOAD(xsize,ysize,size)*(rank-1);  //rank specific
+		start = xsize*first[rank] - halo_size;  //rank specific
 		if(start<0)	space_up = halo_size + start, start = 0;
 		else space_up = halo_size;
 		
 		if(rank != size-1)
 		{
-			end = FIRST_WORKLOAD(xsize,ysize,size) + halo_size + INNER_WORKLOAD(xsize,ysize,size)*rank;
+			end = xsize*(first[rank]+rows[rank]) + halo_size;
 			if(end>xsize*ysize) space_down = halo_size + xsize*ysize - end, end = xsize*ysize;
 			else space_down = halo_size;
 		}
@@ -367,10 +444,10 @@ int main(int args, char** argv)
 		int chunk = end-start;
 					
 		//allocates space for the local copy of the image chunk to be stored			
-		void *local_image = malloc(sizeof(unsigned short int)*chunk);
+		void *local_image = malloc(depth*chunk);
 		
 		//waits until the image is received
-		MPI_Recv(local_image, chunk, MPI_UNSIGNED_SHORT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		MPI_Recv(local_image, chunk, pixel_type, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
 		
 		//time took to communicate
 		tcomm = MPI_Wtime();
@@ -380,17 +457,27 @@ int main(int args, char** argv)
 		*********************************************************/
 		
 		//allocates space for the blurred local copy to be stored
-		void *blurred = malloc(sizeof(unsigned short int)*workload);
+		void *blurred = malloc((size_t)(widen8 ? 2 : depth)*workload);
+		void *wide = widen8 ? malloc(sizeof(unsigned short int)*chunk) : local_image;
 		
 		#pragma omp parallel
 		{
-			if ( I_M_LITTLE_ENDIAN) OMP_swap_image(local_image, xsize, chunk/xsize, maxval);
+			if ( widen8 ) OMP_widen_image((unsigned short int *)wide, (unsigned char *)local_image, xsize, chunk/xsize, plan.bswap);
+			else if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan.bswap) OMP_swap_image(local_image, xsize, chunk/xsize, maxval);
 		
-			OMP_MPIConvolve((unsigned short int *)local_image, (unsigned short int *)blurred, xsize, workload/xsize, kernel, xkernel, ykernel, space_up/xsize, space_down/xsize);
+			OMP_MPIBlur(wide, blurred, xsize, workload/xsize, &plan, space_up/xsize, space_down/xsize);
 		
-			if ( I_M_LITTLE_ENDIAN) OMP_swap_image(blurred, xsize, workload/xsize, maxval);
+			//a widened 8bit result is sent back from the local image buffer
+			if ( widen8 ) OMP_narrow_image((unsigned char *)local_image, (unsigned short int *)blurred, xsize, workload/xsize, maxval, plan.bswap);
+			else if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan.bswap) OMP_swap_image(blurred, xsize, workload/xsize, maxval);
 		}
-		free(local_image);
+		if ( widen8 )
+		{
+			free(wide);
+			free(blurred);
+			blurred = local_image;
+		}
+		else free(local_image);
 		/********************************************************
 		* BLURRING - END
 		*********************************************************/
@@ -399,7 +486,7 @@ int main(int args, char** argv)
 		tcalc = MPI_Wtime(); 
 
 		//sends back the local copy to master		
-		MPI_Gatherv((unsigned short int *)blurred, workload, MPI_UNSIGNED_SHORT, NULL, NULL, NULL, MPI_UNSIGNED_SHORT, 0, MPI_COMM_WORLD);
+		MPI_Gatherv(blurred, workload, pixel_type, NULL, NULL, NULL, pixel_type, 0, MPI_COMM_WORLD);
 		
 		//time for the second communication
 		tcomm2 = MPI_Wtime(); 
@@ -408,9 +495,229 @@ int main(int args, char** argv)
 	
 	MPI_Barrier(MPI_COMM_WORLD);
 	printf("[%d] Walltime timings. I/0: %fs, Scattering: %fs, Calculation: %fs, Gathering: %fs. Total: %fs\n",rank,tIO-t0,tcomm-tIO,tcalc-tcomm,tcomm2-tcalc,tcomm2-t0);
+	free(first);
+	free(rows);
 	free(kernel);
+	free_plan(&plan);
 	
 
 	MPI_Finalize();
 	return 0;
 }
+
+
+static int pgm_name(const char *name)
+//1 if name ends in ".pgm"
+{
+	int namelen = strlen(name);
+	return namelen > 4 && !strcmp(&name[namelen-4],".pgm");
+}
+
+static void free_bank(kernel_plan *plans, KTYPE **kernels, KTYPE *fs, int nk)
+//frees the nk kernels of the filter bank and their plans
+{
+	int k;
+
+	for(k=0; k<nk; k++)
+	{
+		free(kernels[k]);
+		free_plan(&plans[k]);
+	}
+	free(kernels);
+	free(fs);
+	free(plans);
+}
+
+static int filter_bank(int args, char **argv, int rank, int size)
+/*
+* ./blur bank [kernel-spec] [kernel-spec] ... [input-file] {output-files}: blurs the image with several kernels (types 0 to 3, each
+* spec given as the arguments of a single kernel) in a single pass over it, see Bank_convolve. The output files are either given for
+* every kernel or all named as usual (plus the position of the kernel in the bank). The rows are split among the processes as for a
+* single kernel, with the halo of the tallest kernel.
+*/
+{
+	double t0, tIO, tcomm, tcalc, tcomm2;
+	t0 = MPI_Wtime();
+
+	char* usage = "Usage: ./blur bank [kernel-spec] [kernel-spec] ... [input-file] {output-files}, each kernel-spec being [kernel-type] {x-kernel-size} {y-kernel-size} {additional-kernel-param} (kernel types 0 to 3)";
+
+	//at most one kernel every two arguments
+	kernel_plan *plans = (kernel_plan *)malloc(sizeof(kernel_plan)*args);
+	KTYPE **kernels = (KTYPE **)malloc(sizeof(KTYPE *)*args), *fs = (KTYPE *)malloc(sizeof(KTYPE)*args);
+	int arg_counter = 1, nk = 0, k, r;
+
+	/********************
+	 kernels 
+	********************/
+
+	int ktype = 0, halo = 0, tallest = 0;
+	while(arg_counter+1 < args && !pgm_name(argv[arg_counter+1]))
+	{
+		int xkernel, ykernel;
+
+		ktype = read_kernel_spec(argv,&arg_counter,args-1,&kernels[nk],&xkernel,&ykernel,&fs[nk],!rank);
+		if(ktype < 0) break;
+
+		plan_kernel(&plans[nk],kernels[nk],xkernel,ykernel,ktype,fs[nk]);
+
+		//every kernel goes through the tiled engine, which swaps the pixels itself
+		plans[nk].engine = ENGINE_TILED;
+		plan_byteswap(&plans[nk]);
+		if(ykernel/2 > halo) halo = ykernel/2, tallest = nk;
+		nk++;
+	}
+
+	//the specs must be followed by the input file, and possibly by one output file per kernel
+	int nout = args-arg_counter-2;
+	if(ktype < 0 || !nk || arg_counter+1 >= args || (nout && nout != nk))
+	{
+		if(!rank) printf("Wrong arguments for the filter bank. %s\n",usage);
+		free_bank(plans,kernels,fs,nk);
+		return 1;
+	}
+
+	if(!rank) printf("Convolution engine: tiled filter bank of %d kernels\n",nk);
+	//each kernel has its own row kernels (see simd_select)
+	if(!rank)
+		for(k=0; k<nk; k++) printf("Kernel %d interior vectorized with: %s%s%s%s\n",k,simd_name(plans[k].simd),plans[k].unroll_y ? " (unrolled kernel size)" : plans[k].unroll_x ? " (unrolled kernel width)" : "",(const char *[]){"", ", folded along x", ", folded along y", ", folded along x and y"}[plans[k].symmetry],plans[k].row_block ? ", rows in blocks" : "");
+
+	char* input_name = argv[++arg_counter];
+	if(!rank) printf("Trying to blur image \"%s\"\n",input_name);
+
+	/**********************************************************************************************************************
+	*																			  BLURRING - MPI COMMUNICATION
+	**********************************************************************************************************************/
+
+	void *image = NULL;
+	int maxval, xsize, ysize, image_parameters[3];
+
+	if(!rank)	read_pgm_image(&image, image_parameters, image_parameters+1, image_parameters+2, input_name);
+	MPI_Bcast(image_parameters,3,MPI_INT,0,MPI_COMM_WORLD);
+
+	maxval = image_parameters[0];
+	xsize = image_parameters[1];
+	ysize = image_parameters[2];
+
+	if(maxval<0)
+	{
+		if(!rank) printf("Could not read image \"%s\".\n",input_name);
+		free_bank(plans,kernels,fs,nk);
+		return 4;
+	}
+
+	//8bit images are sent and gathered as they are, and read as such by the (tiled) engine of the bank, see main
+	int depth = 1 + (maxval > 255);
+	MPI_Datatype pixel_type = (depth == 2) ? MPI_UNSIGNED_SHORT : MPI_UNSIGNED_CHAR;
+	for(k=0; k<nk; k++) plan_depth8(&plans[k], maxval);
+
+	tIO = MPI_Wtime();
+
+	//first row, number of rows and lines of halo above and below of each process: split as for a single kernel (see main), the tallest one
+	int *first = (int *)malloc(sizeof(int)*size), *rows = (int *)malloc(sizeof(int)*size);
+	int *up = (int *)malloc(sizeof(int)*size), *down = (int *)malloc(sizeof(int)*size);
+
+	if(!rank) partition_rows(&plans[tallest], xsize, ysize, size, first, rows);
+	MPI_Bcast(first, size, MPI_INT, 0, MPI_COMM_WORLD);
+	MPI_Bcast(rows, size, MPI_INT, 0, MPI_COMM_WORLD);
+	for(r=0; r<size; r++)
+	{
+		up[r] = min(halo,first[r]);
+		down[r] = max(min(halo,ysize-first[r]-rows[r]),0);
+	}
+
+	int nlines = rows[rank]+up[rank]+down[rank];
+	void *local;
+
+	if(!rank)
+	{
+		MPI_Request *requests = (MPI_Request *)malloc(size*sizeof(MPI_Request));
+
+		for(r=1; r<size; r++)
+			MPI_Isend((char *)image + (size_t)depth*xsize*(first[r]-up[r]), xsize*(rows[r]+up[r]+down[r]), pixel_type, r, 0, MPI_COMM_WORLD, &requests[r-1]);
+
+		//the image is used (and swapped) in place, after the others have received their part
+		MPI_Waitall(size-1, requests, MPI_STATUSES_IGNORE);
+		free(requests);
+		local = image;
+	}
+	else
+	{
+		local = malloc((size_t)depth*xsize*nlines);
+		MPI_Recv(local, xsize*nlines, pixel_type, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	}
+
+	tcomm = MPI_Wtime();
+
+	//the master blurs directly into the complete images
+	void **blurred = (void **)malloc(sizeof(void *)*nk);
+	for(k=0; k<nk; k++) blurred[k] = malloc((size_t)depth*xsize*(!rank ? ysize : rows[rank]));
+
+	//in the byte order of the file (see plan_byteswap)
+	#pragma omp parallel
+	Bank_convolve(local, blurred, xsize, rows[rank], plans, nk, up[rank], down[rank]);
+
+	free(local);
+
+	tcalc = MPI_Wtime();
+
+	int *recv_size = (int *)malloc(size*sizeof(int)), *displs = (int *)malloc(size*sizeof(int));
+	for(r=0; r<size; r++)
+	{
+		recv_size[r] = xsize*rows[r];
+		displs[r] = xsize*first[r];
+	}
+
+	for(k=0; k<nk; k++)
+		MPI_Gatherv(!rank ? MPI_IN_PLACE : blurred[k], xsize*rows[rank], pixel_type, blurred[k], recv_size, displs, pixel_type, 0, MPI_COMM_WORLD);
+
+	tcomm2 = MPI_Wtime();
+
+	/********************
+	 output (master only)
+	********************/
+
+	if(!rank)
+	{
+		input_name[strlen(input_name)-4]='\0';
+		char *out = (char *)malloc(strlen(input_name)+64);
+
+		for(k=0; k<nk; k++)
+		{
+			char *output_name = out;
+
+			if(nout) output_name = argv[++arg_counter];
+			else
+			{
+				char charf[20];
+
+				sprintf(charf,"%e",fs[k]);
+				charf[1] = charf[2];
+				charf[2] = '\0';
+
+				if(plans[k].ktype-1) sprintf(out,"%s.bank%d_%d_%dx%d.mpi_omp.pgm",input_name,k,plans[k].ktype,plans[k].xconv,plans[k].yconv);
+				else                 sprintf(out,"%s.bank%d_1_%dx%d_%s.mpi_omp.pgm",input_name,k,plans[k].xconv,plans[k].yconv,charf);
+			}
+
+			write_pgm_image(blurred[k], maxval, xsize, ysize, output_name);
+			printf("Blurred image was succesfully stored in the file \"%s\"\n",output_name);
+		}
+
+		free(out);
+	}
+
+	for(k=0; k<nk; k++) free(blurred[k]);
+	free(blurred);
+	free(recv_size);
+	free(displs);
+	free(first);
+	free(rows);
+	free(up);
+	free(down);
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	printf("[%d] Walltime timings. I/0: %fs, Scattering: %fs, Calculation: %fs, Gathering: %fs. Total: %fs\n",rank,tIO-t0,tcomm-tIO,tcalc-tcomm,tcomm2-tcalc,tcomm2-t0);
+
+	free_bank(plans,kernels,fs,nk);
+
+	return 0;
+}
@@ -71,6 +71,11 @@ void read_pgm_image( void **image, int *maxval, int *xsize, int *ysize, const ch
 
   *image = NULL;
   *xsize = *ysize = *maxval = 0;
+  if ( image_file == NULL )
+    {
+      *maxval = -4;         // this is the signal that the file could not be opened
+      return;
+    }
   
   char    MagicN[2];
   char   *line = NULL;
@@ -113,8 +118,8 @@ void read_pgm_image( void **image, int *maxval, int *xsize, int *ysize, const ch
   
   if ( fread( *image, 1, size, image_file) != size )
     {
-      free( image );
-      image   = NULL;
+      free( *image );
+      *image  = NULL;
       *maxval = -3;         // this is the signal that there was an i/o error
       *xsize  = 0;
       *ysize  = 0;
@@ -221,6 +226,9 @@ void * generate_gradient( int maxval, int xsize, int ysize )
 //	*weighted_kernel
 //	*gaussian_kernel
 //	*normalize
+//	*read_kernel_spec
+//	*plan_kernel
+//	*plan_byteswap
 //
 // =============================================================
 
@@ -272,21 +280,480 @@ void gaussian_kernel(KTYPE *mat, size_t x, size_t y, KTYPE sigma_sq)
 	return;
 }
 
-KTYPE *normalize(void *kimage,size_t x,size_t y,int maxval)
+KTYPE *normalize(void *kimage,size_t x,size_t y,int maxval,KTYPE *unit)
+/*
+* Weights of the kernel read from a pgm file (x*y values up to maxval, 16bit ones in the byte order of the file, big-endian), scaled to a
+* unit sum. *unit is set to the weight of one level of the file, the step of the quantization which the weights carry.
+*/
 {
 	KTYPE norm,*ret = (KTYPE *)malloc(sizeof(KTYPE)*x*y);
 	int i,j;
 	KTYPE sum=0;
 	for(j=0;j<y;j++)
-		for(i=0;i<x;i++) sum += maxval>255 ? ((unsigned short int *)kimage)[i+x*j] : ((char *)kimage)[i+x*j];
+		for(i=0;i<x;i++) sum += maxval>255 ? pixel(((unsigned short int *)kimage)[i+x*j],I_M_LITTLE_ENDIAN) : ((unsigned char *)kimage)[i+x*j];
 		
 	norm = 1.0/sum;
+	*unit = norm;
 	
 	for(j=0;j<y;j++)
-		for(i=0;i<x;i++) ret[i+x*j] = maxval>255 ? ((unsigned short int *)kimage)[i+x*j]*norm : ((char *)kimage)[i+x*j]*norm;
+		for(i=0;i<x;i++) ret[i+x*j] = maxval>255 ? pixel(((unsigned short int *)kimage)[i+x*j],I_M_LITTLE_ENDIAN)*norm : ((unsigned char *)kimage)[i+x*j]*norm;
 	return ret;
 }
 
+int read_kernel_spec(char **argv, int *arg, int last, KTYPE **kernel, int *xkernel, int *ykernel, KTYPE *f, int verbose)
+/*
+* Builds the kernel of one spec of a filter bank, given as on the command line for a single kernel (types 0 to 3), from argv[*arg+1]
+* on without going past argv[last], and advances *arg over it. Returns the kernel type, -1 if the spec is not valid or its kernel file
+* cannot be read (a message is printed if verbose is non zero).
+*/
+{
+	int ktype = -1, need = 0;
+
+	if(*arg < last)
+	{
+		ktype = atoi(argv[++*arg]);
+		need = (ktype == 3) ? 1 : (ktype == 1) ? 3 : 2;
+	}
+	if(ktype < 0 || ktype > 3 || *arg+need > last)
+	{
+		if(verbose) printf("Invalid kernel spec: kernel id must be 0,1,2 or 3, followed by its dimensions (and f for id 1) or by a pgm file (id 3)\n");
+		return -1;
+	}
+
+	*f = 0;
+
+	if(ktype == 3)
+	{
+		int kmaxval;
+		void *kimage;
+
+		read_pgm_image(&kimage, &kmaxval, xkernel, ykernel, argv[++*arg]);
+		if(kmaxval < 0)
+		{
+			if(verbose) printf("Could not read kernel \"%s\".\n",argv[*arg]);
+			return -1;
+		}
+		*kernel = normalize(kimage,*xkernel,*ykernel,kmaxval,f);
+		free(kimage);
+		if(verbose) printf("Using Kernel imported from \"%s\" of dimension %dx%d\n",argv[*arg],*xkernel,*ykernel);
+
+		return ktype;
+	}
+
+	*xkernel = atoi(argv[++*arg]);
+	*ykernel = atoi(argv[++*arg]);
+	if(!(*xkernel%2) || !(*ykernel%2) || *xkernel < 0 || *ykernel < 0)
+	{
+		if(verbose) printf("Kernel dimensions must be odd integers. Dimensions given were %dx%d\n",*xkernel,*ykernel);
+		return -1;
+	}
+
+	*kernel = (KTYPE *)malloc(*xkernel * *ykernel * sizeof(KTYPE));
+
+	switch(ktype)
+	{
+		case 0:
+			uniform_kernel(*kernel,*xkernel,*ykernel);
+			if(verbose) printf("Using Mean Kernel of dimension %dx%d\n",*xkernel,*ykernel);
+		break;
+
+		case 1:
+			*f = atof(argv[++*arg]);
+			weighted_kernel(*kernel,*xkernel,*ykernel,*f);
+			if(verbose) printf("Using Weighted Kernel of dimension %dx%d and f = %f\n",*xkernel,*ykernel,*f);
+		break;
+
+		case 2:
+		{
+			//same sigma as for a single kernel
+			int s = max((*xkernel/2),(*ykernel/2));
+			gaussian_kernel(*kernel,*xkernel,*ykernel,s*s);
+			if(verbose) printf("Using Gaussian Kernel of dimension %dx%d (s: %d)\n",*xkernel,*ykernel,s);
+		}
+		break;
+	}
+
+	return ktype;
+}
+
+
+/*
+* KERNEL PLANNING
+*/
+
+static const char *engine_names[] = {"direct", "separable", "box", "weighted", "fft", "iir", "tiled", "fixed", "lowrank", "sparse", "winograd"};
+#define N_ENGINES (int)(sizeof(engine_names)/sizeof(engine_names[0]))
+
+const char *engine_name(int engine)
+{
+	return (engine >= 0 && engine < N_ENGINES) ? engine_names[engine] : "unknown";
+}
+
+int separable_factors(KTYPE *mat, int x, int y, KTYPE *xvec, KTYPE *yvec)
+/*
+* Tries to write mat as the outer product xvec (x) yvec. The factors are taken to be the marginals of the kernel (sums along columns and rows) divided by the total,
+* so that each of them sums to 1: this is exact whenever the kernel is separable, and the final check tells whether it is. Returns 1 if the kernel is separable, 0 otherwise.
+* Sums are done in double precision, since with big kernels the float ones would bias the (non renormalized) interior.
+*/
+{
+	int i,j;
+	double total = 0, big = 0, *xsum = (double *)calloc(x,sizeof(double)), *ysum = (double *)calloc(y,sizeof(double));
+	
+	for(j=0;j<y;j++)
+		for(i=0;i<x;i++)
+		{
+			xsum[i] += mat[i+x*j];
+			ysum[j] += mat[i+x*j];
+			total += mat[i+x*j];
+			big = max(big,fabs(mat[i+x*j]));
+		}
+	
+	for(i=0;i<x;i++) xvec[i] = xsum[i]/total;
+	for(j=0;j<y;j++) yvec[j] = ysum[j]/total;
+	
+	free(xsum);
+	free(ysum);
+	
+	for(j=0;j<y;j++)
+		for(i=0;i<x;i++) if(fabs(xvec[i]*yvec[j]-mat[i+x*j]) > 1e-4*big) return 0;
+		
+	return 1;
+}
+
+int kernel_symmetry(KTYPE *mat, int x, int y)
+/*
+* SYM_X and/or SYM_Y if the weights of mat are (exactly) equal under reflection along x and/or y, 0 if neither.
+*/
+{
+	int i,j,sym = SYM_X|SYM_Y;
+	
+	for(j=0;j<y;j++)
+		for(i=0;i<x;i++)
+		{
+			if(mat[i+x*j] != mat[(x-1-i)+x*j]) sym &= ~SYM_X;
+			if(mat[i+x*j] != mat[i+x*(y-1-j)]) sym &= ~SYM_Y;
+		}
+	
+	return sym;
+}
+
+int plan_kernel(kernel_plan *plan, KTYPE *matrix, int xconv, int yconv, int ktype, KTYPE param)
+/*
+* Fills plan with everything the engines need and chooses the engine: the fastest one applicable to the kernel type, unless the environment variable BLUR_ENGINE
+* names a different one. Returns 0 if the requested engine (if any) has been honoured, 1 if it was unknown or not applicable to this kernel.
+* param is the additional kernel parameter (sigma for the recursive gaussian, which has no matrix and can only be done by its own engine, the
+* quantization step of the file for custom kernels, see normalize).
+*/
+{
+	int e;
+	char *forced = getenv("BLUR_ENGINE");
+	
+	plan->ktype = ktype;
+	plan->xconv = xconv;
+	plan->yconv = yconv;
+	plan->matrix = matrix;
+	plan->xvec = plan->yvec = NULL;
+	plan->ksum = NULL;
+	plan->qmatrix = NULL;
+	plan->qsum = NULL;
+	plan->xterms = plan->yterms = NULL;
+	plan->rank = 0;
+	plan->kunit = ktype == 3 ? param : 0;
+	plan->tap_start = plan->tap_l = NULL;
+	plan->tap_w = NULL;
+	plan->ntaps = 0;
+	plan->wino = NULL;
+	plan->boxlike = 0;
+	plan->symmetry = matrix ? kernel_symmetry(matrix,xconv,yconv) : 0;
+	plan->bswap = 0;
+	plan->depth8 = 0;
+	plan->cols_left = plan->cols_right = 0;
+	plan->simd = simd_select(plan,0);
+	
+	//tile size ("WxH" or "N") and order of the tiled engine
+	char *tile = getenv("BLUR_TILE"), *order = getenv("BLUR_TILE_ORDER");
+	plan->tile_x = plan->tile_y = 0;
+	if(tile && sscanf(tile,"%dx%d",&plan->tile_x,&plan->tile_y) == 1) plan->tile_y = plan->tile_x;
+	plan->morton = order && !strcmp(order,"morton");
+	
+	if(ktype == 4)
+	{
+		plan->sigma = param;
+		plan->engine = ENGINE_IIR;
+		return forced && strcmp(forced,engine_names[ENGINE_IIR]);
+	}
+	
+	//weights of the clipped kernel on the borders, and list of its non-zero taps
+	plan->ksum = kernel_prefix_sums(matrix,xconv,yconv);
+	sparse_taps(plan);
+	
+	//separable factors, kept only if the kernel really is an outer product
+	plan->xvec = (KTYPE *)malloc(xconv*sizeof(KTYPE));
+	plan->yvec = (KTYPE *)malloc(yconv*sizeof(KTYPE));
+	if(!separable_factors(matrix,xconv,yconv,plan->xvec,plan->yvec))
+	{
+		free(plan->xvec);
+		free(plan->yvec);
+		plan->xvec = plan->yvec = NULL;
+	}
+	
+	//constant weights (but possibly the central one) allow the use of box sums
+	int centre = xconv/2 + xconv*(yconv/2);
+	plan->f = matrix[centre];
+	plan->w = matrix[centre ? 0 : min(1,xconv*yconv-1)];
+	plan->boxlike = 1;
+	for(e=0; e<xconv*yconv; e++) if(e != centre && matrix[e] != plan->w) plan->boxlike = 0;
+	
+	//automatic choice: mean and gaussian kernels are outer products by construction, mean and weighted ones have constant weights,
+	//anything else is done directly, in cache-sized tiles
+	plan->engine = ENGINE_TILED;
+	if(plan->xvec && (ktype == 0 || ktype == 2)) plan->engine = ENGINE_SEPARABLE;
+	if(plan->boxlike && plan->f == plan->w && ktype == 0) plan->engine = ENGINE_BOX;
+	if(plan->boxlike && ktype == 1) plan->engine = ENGINE_WEIGHTED;
+	
+	//big custom kernels are best done in the frequency domain
+	char *fft_taps = getenv("BLUR_FFT_TAPS");
+	int min_taps = fft_taps ? atoi(fft_taps) : FFT_MIN_TAPS;
+	if(ktype == 3 && xconv*yconv >= min_taps) plan->engine = ENGINE_FFT;
+	
+	//...unless they are mostly zeros (fewer non-zero taps than the FFT threshold), or (nearly) a sum of a few separable terms which is cheaper still
+	if(ktype == 3 && plan->ntaps <= SPARSE_MAX_DENSITY*xconv*yconv && plan->ntaps < min_taps) plan->engine = ENGINE_SPARSE;
+	if(ktype == 3 && max(xconv,yconv) <= LOWRANK_MAX_SIZE && lowrank_factors(plan) == 1)
+		if(plan->engine != ENGINE_SPARSE || plan->rank*(xconv+yconv) < plan->ntaps) plan->engine = ENGINE_LOWRANK;
+	
+	//without vector units, 3x3 and 5x5 kernels with no symmetry to fold take about half the time with minimal filtering
+	if(plan->engine == ENGINE_TILED && ktype == 3 && plan->simd == SIMD_SCALAR && !plan->symmetry && winograd_kernel(plan)) plan->engine = ENGINE_WINOGRAD;
+	
+	if(!forced) return 0;
+	
+	for(e=0; e<N_ENGINES; e++) if(!strcmp(forced,engine_names[e])) break;
+	
+	switch(e)
+	{
+		case ENGINE_DIRECT: case ENGINE_FFT: case ENGINE_TILED: case ENGINE_SPARSE:
+			plan->engine = e;
+		return 0;
+		
+		case ENGINE_SEPARABLE:
+			if(!plan->xvec) return 1;
+			plan->engine = e;
+		return 0;
+		
+		case ENGINE_BOX:
+			if(!plan->boxlike || plan->f != plan->w) return 1;
+			plan->engine = e;
+		return 0;
+		
+		case ENGINE_WEIGHTED:
+			if(!plan->boxlike) return 1;
+			plan->engine = e;
+		return 0;
+		
+		//opt-in only
+		case ENGINE_FIXED:
+			quantize_kernel(plan);
+			plan->engine = e;
+		return 0;
+		
+		//3x3 and 5x5 kernels only
+		case ENGINE_WINOGRAD:
+			if(!plan->wino && !winograd_kernel(plan)) return 1;
+			plan->engine = e;
+		return 0;
+		
+		//any kernel, with the rank needed for the error threshold, if that is cheaper than the dense kernel
+		case ENGINE_LOWRANK:
+			if(!plan->xterms) lowrank_factors(plan);
+			if(plan->rank*(plan->xconv+plan->yconv) >= plan->xconv*plan->yconv) return 1;
+			plan->engine = e;
+		return 0;
+	}
+	
+	return 1;
+}
+
+int plan_byteswap(kernel_plan *plan)
+/*
+* Lets the engine of plan take the pixels in the byte order of the file (big-endian) and write the result in the same order, swapping them
+* as they are loaded and stored instead of in two sweeps over the whole image and result: the input is then left untouched. Only the direct
+* and tiled engines can (their row kernels are switched too, see simd_select). Returns 1 if the engine of plan has
+* been switched, 0 if the pixels must still be swapped in memory before and after the blurring (or the machine is big-endian already).
+*/
+{
+	if(!I_M_LITTLE_ENDIAN || (plan->engine != ENGINE_DIRECT && plan->engine != ENGINE_TILED)) return 0;
+	
+	plan->bswap = 1;
+	plan->simd = simd_select(plan,1);
+	
+	return 1;
+}
+
+int plan_depth8(kernel_plan *plan, int maxval)
+/*
+* Lets the engine of plan read and write the pixels of an 8bit image (maxval < 256) as they are, widening them to floats in the row kernels
+* as they are loaded and narrowing them as they are stored, instead of widening the whole image to 16bit before and narrowing the result
+* after. Only the direct and tiled engines can, as for plan_byteswap. Returns 1 if the engine of plan takes the 8bit pixels, 0 if they must
+* still be widened (and for 16bit images, which switch the plan back). Must be called outside of parallel regions.
+*/
+{
+	int depth8 = maxval < 256 && (plan->engine == ENGINE_DIRECT || plan->engine == ENGINE_TILED);
+	
+	if(depth8 != plan->depth8)
+	{
+		plan->depth8 = depth8;
+		plan->simd = simd_select(plan,plan->bswap);
+	}
+	
+	return depth8;
+}
+
+void free_plan(kernel_plan *plan)
+{
+	free(plan->xvec);
+	free(plan->yvec);
+	free(plan->ksum);
+	free(plan->qmatrix);
+	free(plan->qsum);
+	free(plan->xterms);
+	free(plan->yterms);
+	free(plan->tap_start);
+	free(plan->tap_l);
+	free(plan->tap_w);
+	free(plan->wino);
+	plan->xvec = plan->yvec = NULL;
+	plan->tap_start = plan->tap_l = NULL;
+	plan->tap_w = NULL;
+	plan->xterms = plan->yterms = NULL;
+	plan->ksum = NULL;
+	plan->qmatrix = NULL;
+	plan->qsum = NULL;
+	plan->wino = NULL;
+}
+
+double *kernel_prefix_sums(KTYPE *mat, int x, int y)
+/*
+* 2D prefix sums of the kernel, in double precision: ksum[l+(x+1)*m] is the sum of the taps above and on the left of (l,m), excluded. The table has (x+1)*(y+1) entries.
+*/
+{
+	int l,m;
+	double *ksum = (double *)calloc((size_t)(x+1)*(y+1),sizeof(double));
+	
+	for(m=0; m<y; m++)
+		for(l=0; l<x; l++) ksum[(l+1)+(x+1)*(m+1)] = mat[l+x*m] + ksum[l+(x+1)*(m+1)] + ksum[(l+1)+(x+1)*m] - ksum[l+(x+1)*m];
+	
+	return ksum;
+}
+
+double kernel_weight(double *ksum, int xconv, int l0, int l1, int m0, int m1)
+//sum of the kernel taps with l0 <= l < l1 and m0 <= m < m1, in constant time
+{
+	return ksum[l1+(xconv+1)*m1] - ksum[l0+(xconv+1)*m1] - ksum[l1+(xconv+1)*m0] + ksum[l0+(xconv+1)*m0];
+}
+
+
+/*
+* WORK SUBDIVISION
+*/
+
+static double row_cost(kernel_plan *plan, int xsize, int ysize, int j)
+/*
+* Estimated cost of output row j of the image, in taps of Border_blur (see BORDER_PIXEL_COST): the pixels done by Border_blur (the first
+* and last sy rows, and sx pixels at both ends of the others) cost according to the taps of the kernel inside the image, the others according
+* to the taps the engine multiplies for them (folded, in blocks of rows, sparse...). The engines with no such border cost the same everywhere.
+*/
+{
+	static const double row_tap[] = ROW_TAP_COST, block_tap[] = BLOCK_TAP_COST, sparse_tap[] = SPARSE_TAP_COST, wino_tap[] = WINOGRAD_TAP_COST;
+	int xconv = plan->xconv, yconv = plan->yconv, sx = xconv/2, sy = yconv/2, simd = plan->simd, i;
+	int fx = (plan->symmetry & SYM_X) ? (xconv+1)/2 : xconv, fy = (plan->symmetry & SYM_Y) ? (yconv+1)/2 : yconv;
+	double interior, cost = 0;
+
+	switch(plan->engine)
+	{
+		//the vector kernels run in blocks by default, which do not fold along y; the scalar loop does folded single rows instead
+		case ENGINE_DIRECT: case ENGINE_TILED:
+			interior = plan->row_block && simd != SIMD_SCALAR ? block_tap[simd]*fx*yconv : row_tap[simd]*fx*fy;
+		break;
+
+		case ENGINE_SPARSE:
+			interior = sparse_tap[simd]*plan->ntaps;
+		break;
+
+		case ENGINE_FIXED:
+			interior = FIXED_TAP_COST*xconv*yconv + FIXED_ROW_COST*yconv;
+		break;
+
+		case ENGINE_WINOGRAD:
+			interior = wino_tap[simd]*xconv*yconv;
+		break;
+
+		default:
+			return xsize;
+	}
+
+	//kernel rows inside the image, then each border pixel with its own columns inside it
+	int rows = min(yconv,ysize-j+sy) - max(sy-j,0);
+	int border_row = j < sy || j >= ysize-sy || xsize <= 2*sx;
+
+	for(i=0; i<xsize; i++)
+	{
+		if(!border_row && i == sx) i = xsize-sx;
+		cost += BORDER_PIXEL_COST + BORDER_ROW_COST*rows + rows*(min(xconv,xsize-i+sx) - max(sx-i,0));
+	}
+
+	return border_row ? cost : cost + interior*(xsize-2*sx);
+}
+
+double partition_imbalance(kernel_plan *plan, int xsize, int ysize, int parts, int *first, int *rows)
+//estimated cost of the most expensive band of the partition given by first and rows, over the average one
+{
+	double total = 0, most = 0;
+	int r, j;
+
+	for(r=0; r<parts; r++)
+	{
+		double cost = 0;
+		for(j=first[r]; j<first[r]+rows[r]; j++) cost += row_cost(plan,xsize,ysize,j);
+		total += cost;
+		most = max(most,cost);
+	}
+
+	return total > 0 ? most*parts/total : 1;
+}
+
+double partition_rows(kernel_plan *plan, int xsize, int ysize, int parts, int *first, int *rows)
+/*
+* Splits the ysize rows of the image into parts contiguous bands, first[r] to first[r]+rows[r]-1 for r = 0 ... parts-1, of about the same
+* estimated cost (see row_cost) rather than the same number of rows: the bands holding the top and bottom borders get fewer rows. Every
+* band gets at least one row if there are enough of them. Returns the estimated imbalance, see partition_imbalance.
+*/
+{
+	double *cost = (double *)malloc(sizeof(double)*(ysize+1));
+	int r, j = 0;
+
+	//cost[j] is the cost of rows 0 to j-1
+	cost[0] = 0;
+	for(r=0; r<ysize; r++) cost[r+1] = cost[r] + row_cost(plan,xsize,ysize,r);
+
+	//each cut at the row boundary closest to its share of the total
+	first[0] = 0;
+	for(r=1; r<parts; r++)
+	{
+		double target = cost[ysize]*r/parts;
+
+		while(j < ysize && cost[j+1] <= target) j++;
+		if(j < ysize && cost[j+1]-target < target-cost[j]) j++;
+
+		first[r] = min(max(j,first[r-1]+1),max(ysize-(parts-r),first[r-1]));
+		first[r] = min(first[r],ysize);
+		j = first[r];
+	}
+
+	for(r=0; r<parts; r++) rows[r] = (r < parts-1 ? first[r+1] : ysize) - first[r];
+
+	free(cost);
+	return partition_imbalance(plan,xsize,ysize,parts,first,rows);
+}
+
 
 /*
 * CONVOLUTION and SWAPPING
@@ -315,55 +782,100 @@ void OMP_swap_image( void *image, int xsize, int ysize, int maxval )
   return;
 }
 
-void Border_blur(unsigned short int *image, unsigned short int *blurred ,int xsize, int ysize, int i, int j, KTYPE *convolution_matrix, int xconv, int yconv ,int sx, int sy, int lines_up, int lines_down)
+void OMP_widen_image( unsigned short int *wide, const unsigned char *image, int xsize, int ysize, int bswap )
+/*
+ * Copies the 8-bit image into the 16-bit buffer wide, which the engines
+ * work on: in the byte order of the file if bswap (see plan_byteswap),
+ * in the one of the machine otherwise
+ *
+ * !! This function contains orphaned OMP directives -> to be used in a parallel region
+ */
+{
+  size_t size = (size_t)xsize * ysize;
+  #pragma omp for
+  for ( size_t i = 0; i < size; i++ )
+    wide[i] = pixel(image[i], bswap);
+  return;
+}
+
+void OMP_narrow_image( unsigned char *image, const unsigned short int *wide, int xsize, int ysize, int maxval, int bswap )
+/*
+ * Inverse of OMP_widen_image: copies the 16-bit result wide back into
+ * the 8-bit image, clipped to maxval
+ *
+ * !! This function contains orphaned OMP directives -> to be used in a parallel region
+ */
+{
+  size_t size = (size_t)xsize * ysize;
+  #pragma omp for
+  for ( size_t i = 0; i < size; i++ )
+    image[i] = min(pixel(wide[i], bswap), maxval);
+  return;
+}
+
+void Border_blur(void *image, void *blurred ,int xsize, int ysize, int i, int j, KTYPE *convolution_matrix, double *ksum, int xconv, int yconv ,int sx, int sy, int lines_up, int lines_down, int px)
 /*
 * Does the blurring for points on the border, i.e. for the values of (i,j) such that the dimensions of the kernel centered here exceeds the dimensions of the image itself 
+* (pixels read and written in the format px, see PIX_*)
 */
 {
 
 	//indices representing the position wrt the kernel
 	int l,m; 
-		
-	//normalization constant (actually its inverse) -> it must be evaluated again since some parts of the kernel are not used here, hence the rest is not properly normalized anymore
-	KTYPE norm = 0;
 	
 	//stores the partial sums for the final value of the blurred image in (i,j) : here used instead of the natural choice of the blurred matrix itself to avoid lossy conversions from
 	//floating point to unsigned integer -> this loss is minimized by doing it only once at the end. 
 	KTYPE buffer = 0;
 	
-	/*here (and int the initializarion of the for loop) the limits of kernel positions are evaluated: this evaluation takes into account the presence of some additional lines of image
+	/*here the limits of kernel positions are evaluated: this evaluation takes into account the presence of some additional lines of image
 	* above and below the blurred one, to match the presence of halo layers, but at the same time makes sure that this does not yield an illegal index, in this case smaller than 0 or 
 	* bigger than the size of the image -> this could happen in the pathological case in which the halo layer is very thick (thicker than the image/chunk of image itself) or when the 
 	* image/chunk of image is very shallow (due to the presence of a lot of processors for instance).*/
 	  
-	int mlim = min(yconv,ysize+lines_down-j+sy);
-	int llim = min(xconv,xsize-i+sx);
-
-	for(m=max(sy-lines_up-j,0) ; m<mlim ; m++)
-		for(l=max(sx-i,0) ; l<llim ; l++)	
-		{	
-			//acutal convolution and renormalization	
-			//image must be shifted by the amount of lines that has more than the blurring region (+lines_up)
-			buffer += image[(i-sx+l)+xsize*(j-sy+m+lines_up)]*convolution_matrix[l+xconv*m];
-			norm+=convolution_matrix[l+xconv*m];
+	int mmin = max(sy-lines_up-j,0), mlim = min(yconv,ysize+lines_down-j+sy);
+	int lmin = max(sx-i,0), llim = min(xconv,xsize-i+sx);
+
+	for(m=mmin ; m<mlim ; m++)
+	{
+		//image must be shifted by the amount of lines that has more than the blurring region (+lines_up)
+		void *in = PIX_AT(image,(size_t)xsize*(j-sy+m+lines_up)+i-sx,px);
+		KTYPE *k = convolution_matrix + xconv*m;
+		
+		if(px == PIX_BYTE)
+		{
+			#pragma omp simd reduction(+:buffer)
+			for(l=lmin ; l<llim ; l++) buffer += ((unsigned char *)in)[l]*k[l];
 		}
-				
-	blurred[i+xsize*j]=buffer/norm + 0.5;
+		else
+		{
+			#pragma omp simd reduction(+:buffer)
+			for(l=lmin ; l<llim ; l++) buffer += pixel(((unsigned short int *)in)[l],px)*k[l];
+		}
+	}
+	
+	//normalization constant -> some parts of the kernel are not used here, hence the rest is not properly normalized anymore: its weight comes from the prefix sums of the kernel
+	double value = buffer/kernel_weight(ksum,xconv,lmin,llim,mmin,mlim) + 0.5;
+	if(px == PIX_BYTE) ((unsigned char *)blurred)[i+(size_t)xsize*j] = value;
+	else ((unsigned short int *)blurred)[i+(size_t)xsize*j] = pixel(value,px);
 }
 
-void OMP_MPIConvolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize,KTYPE *convolution_matrix, int xconv, int yconv, int lines_up, int lines_down)
+void OMP_MPIConvolve(void *image, void *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
 /*
 * Does the convolution of two matrices image and convolution_matrix and stores the results in blurred. Some upper or lower lines can be excluded from the convolution 
 * by using the lines_up and lines_down specifiers 
 */
 {
+	KTYPE *convolution_matrix = plan->matrix;
+	double *ksum = plan->ksum;
+	int xconv = plan->xconv, yconv = plan->yconv, px = PLAN_PIXELS(plan);
 	
 	//coordinates of the centre of the matrix
 	int sx = xconv/2;
 	int sy = yconv/2;
 	
-	//calculation of the bounds for i and j -> same as the comment in Border_blur();
+	//calculation of the bounds for i and j -> same as the comment in Border_blur(); the halo columns c0 and c1 on (see cols_left) are skipped
 	int y_max = max(ysize-sy+lines_down,0), y_min = min(sy-lines_up,ysize); 
+	int c0 = plan->cols_left, c1 = xsize-plan->cols_right;
 	int i,j;
 
 	//scanning of the whole image (or the part to be blurred at least): first the borders then the body 
@@ -372,42 +884,95 @@ void OMP_MPIConvolve(unsigned short int *image, unsigned short int *blurred, int
 	
 	#pragma omp for collapse(2) nowait 
 	for(j=0; j<y_min; j++)
-		for(i=0; i<xsize; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,xconv,yconv,sx,sy,lines_up,lines_down);
+		for(i=c0; i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
 
 	#pragma omp for collapse(2) nowait 
 	for(j=y_max; j<ysize; j++)
-		for(i=0; i<xsize; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,xconv,yconv,sx,sy,lines_up,lines_down);
+		for(i=c0; i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
 
 	#pragma omp for collapse(2) nowait 	
 	for(j=y_min; j<y_max; j++)
-		for(i=0; i<sx; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,xconv,yconv,sx,sy,lines_up,lines_down);
+		for(i=c0; i<sx; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
 	
 #pragma omp for collapse(2) nowait 
 	for(j=y_min; j<y_max; j++)
-		for(i=xsize-sx; i<xsize; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,xconv,yconv,sx,sy,lines_up,lines_down);
+		for(i=xsize-sx; i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
 		
 		
 
-	//NON BORDER PART, NO CHECKS ON BOUNDARY
-		
-	int l,m;
-	#pragma omp for collapse(2)
-	for(j=y_min;j<y_max;j++)
-		for(i=sx;i<xsize-sx;i++)
-		{
-			// buffere serves the same purpose as before: here is used instead of the natural choice of the blurred matrix itself to avoid lossy conversions from
-			//floating point to unsigned integer -> this loss is minimized by doing it only once at the end. 
-			KTYPE buffer = 0;
-
-			//actual convolution, here there is never the necessity of renormalization !
-			for(m=0; m<yconv; m++)						  //image must be shifted by the amount of lines that has more than the blurring region (+lines_up)
-				for(l=0; l<xconv; l++)	buffer += image[(i-sx+l)+xsize*(j-sy+m+lines_up)]*convolution_matrix[l+xconv*m];
-				
-			blurred[i+xsize*j] = buffer + 0.5;
-		}
+	//NON BORDER PART, NO CHECKS ON BOUNDARY -> blocks of ROW_BLOCK rows, vectorized (see simd.c), then the rows left over one at a time
+	//actual convolution, here there is never the necessity of renormalization ! image must be shifted by the amount of lines that has more than the blurring region (+lines_up)
+	
+	int nblocks = max(y_max-y_min,0)/ROW_BLOCK;
+	
+	#pragma omp for
+	for(j=0;j<nblocks;j++)
+		if(xsize > 2*sx) Interior_rows(PIX_AT(image,(size_t)xsize*(y_min+ROW_BLOCK*j-sy+lines_up),px),PIX_AT(blurred,sx+(size_t)xsize*(y_min+ROW_BLOCK*j),px),xsize-2*sx,xsize,plan);
+	
+	#pragma omp for
+	for(j=y_min+ROW_BLOCK*nblocks;j<y_max;j++)
+		if(xsize > 2*sx) Interior_row(PIX_AT(image,(size_t)xsize*(j-sy+lines_up),px),PIX_AT(blurred,sx+(size_t)xsize*j,px),xsize-2*sx,xsize,plan);
 
 	return;
 }
 
 
+/*
+* ENGINE DISPATCH
+*/
 
+void OMP_MPIBlur(void *image, void *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+/*
+* Same interface as OMP_MPIConvolve, but the convolution is done by the engine chosen in plan
+*
+* !! This function contains orphaned OMP directives -> to be used in a parallel region
+*/
+{
+	switch(plan->engine)
+	{
+		case ENGINE_SEPARABLE:
+			Separable_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_BOX:
+			Box_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_WEIGHTED:
+			Weighted_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_FFT:
+			FFT_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_IIR:
+			IIR_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_TILED:
+			Tiled_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_FIXED:
+			Fixed_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_LOWRANK:
+			Lowrank_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_SPARSE:
+			Sparse_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_WINOGRAD:
+			Winograd_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		default:
+			OMP_MPIConvolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+	}
+	
+	return;
+}
@@ -4,6 +4,11 @@
 #include "ut.h"
 
 
+static int filter_bank(int args, char **argv, int rank, int size);
+static void prepare_lines(void *local, void *wide, int xsize, int first, int lines, int depth, int widen8, int maxval, kernel_plan *plan);
+static int blur_mpiio(char *input_name, char *output_name, kernel_plan *plan, int halo, int rank, int size);
+static int blur_cart(const char *grid, char *input_name, char *output_name, kernel_plan *plan, int sx, int sy, int rank, int size);
+
 int main(int args, char** argv)
 {	
 	int rank, size;
@@ -14,7 +19,7 @@ int main(int args, char** argv)
 	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
 	
 	//time measurements
-	double t0, tIO, tcomm, tcalc, tcomm2;
+	double t0, tIO, tcomm, tcalc, tcomm2, thalo = 0;
 	t0 = MPI_Wtime();
 
 	/*********************************************************************************************************************
@@ -26,6 +31,14 @@ int main(int args, char** argv)
 	#define MAX_ARGS 7
 	#define MIN_ARGS 4
 	
+	//several kernels at once
+	if(args > 1 && !strcmp(argv[1],"bank"))
+	{
+		int ret = filter_bank(args,argv,rank,size);
+		MPI_Finalize();
+		return ret;
+	}
+	
 	if(args<MIN_ARGS) 
 	{
 		if(!rank) printf("Too few arguments in function blur. %s\n",usage);
@@ -41,12 +54,12 @@ int main(int args, char** argv)
 	
 	int arg_counter = 0;
 	int xkernel,ykernel;
-	KTYPE f, *kernel;
+	KTYPE f = 0, *kernel;
 
 	int ktype = atoi(argv[++arg_counter]);
 	  
 	/************************************************************************************	
-	 kernel choice: 0->"uniform" 1->"weighted" 2->"gaussian" 3->"imported from pgm file"
+	 kernel choice: 0->"uniform" 1->"weighted" 2->"gaussian" 3->"imported from pgm file" 4->"recursive gaussian"
 	*************************************************************************************/
   
 	switch(ktype)
@@ -121,17 +134,61 @@ int main(int args, char** argv)
 			void *kimage;
 			
 			read_pgm_image(&kimage, &kmaxval, &xkernel, &ykernel, argv[++arg_counter]);
-			kernel = normalize(kimage,xkernel,ykernel,kmaxval);
+			if(kmaxval < 0)
+			{
+				if(!rank) printf("Could not read kernel \"%s\".\n",argv[arg_counter]);
+				MPI_Finalize();
+				return 4;
+			}
+			kernel = normalize(kimage,xkernel,ykernel,kmaxval,&f);
 			free(kimage);
 
 		break;
 
+		case 4:
+			if(args > MAX_ARGS-2)
+			{
+				if(!rank) printf("Too many arguments in function blur. Only sigma needed for the recursive gaussian kernel.\n %s\n",usage);
+				MPI_Finalize();
+				return 1;
+			}
+			
+			f = atof(argv[++arg_counter]);
+			if(f < 0.5)
+			{
+				if(!rank) printf("Sigma of the recursive gaussian kernel must be at least 0.5. Given sigma was %f\n",f);
+				MPI_Finalize();
+				return 3;
+			}
+			
+			//no matrix is built: the nominal dimensions are just the support, used for halos and file names
+			xkernel = ykernel = 2*(int)ceil(IIR_SUPPORT*f)+1;
+			kernel = NULL;
+			if(!rank) printf("Using Recursive Gaussian Kernel with sigma = %f (support %dx%d)\n",f,xkernel,ykernel);
+		break;
+
 		default:
-			if(!rank) printf("Kernel id must be either 0,1,2 for automatic generation or 3 for pgm file. Given id was %d",ktype);
+			if(!rank) printf("Kernel id must be either 0,1,2 for automatic generation, 3 for pgm file or 4 for recursive gaussian. Given id was %d",ktype);
 			MPI_Finalize();
 			return 2;
 	}
 	
+	/********************
+	 engine choice 
+	********************/
+	
+	kernel_plan plan;
+	if(plan_kernel(&plan, kernel, xkernel, ykernel, ktype, f) && !rank) printf("Requested engine \"%s\" not available for this kernel.\n",getenv("BLUR_ENGINE"));
+
+	//the engine swaps the pixels itself where it can, the image is swapped in memory otherwise (before the report: the row kernels change)
+	plan_byteswap(&plan);
+	
+	if(!rank) printf("Convolution engine: %s\n",engine_name(plan.engine));
+	if(!rank && (plan.engine == ENGINE_DIRECT || plan.engine == ENGINE_TILED)) printf("Interior vectorized with: %s%s%s%s\n",simd_name(plan.simd),plan.unroll_y ? " (unrolled kernel size)" : plan.unroll_x ? " (unrolled kernel width)" : "",(const char *[]){"", ", folded along x", ", folded along y", ", folded along x and y"}[plan.symmetry],plan.row_block ? ", rows in blocks" : "");
+	if(!rank && plan.engine == ENGINE_FIXED) printf("Fixed point weights: shift %d, quantization error below %.3g grey levels\n",plan.shift,plan.qerror);
+	if(!rank && plan.engine == ENGINE_LOWRANK) printf("Low-rank kernel: %d separable terms, approximation error below %.3g grey levels\n",plan.rank,plan.lrerror);
+	if(!rank && plan.engine == ENGINE_SPARSE) printf("Sparse kernel: %d non-zero taps out of %d\n",plan.ntaps,plan.xconv*plan.yconv);
+	
 	/********************
 	 output name setting 
 	********************/
@@ -144,10 +201,53 @@ int main(int args, char** argv)
 	{
 		if(!rank) printf("Input file name must end in \".pgm\". Given file name was %s\n",input_name);
 		free(kernel);
+		free_plan(&plan);
 		MPI_Finalize();
 		return 4; //exit
 	}
 	
+	//output file name, known to every process (the MPI-IO mode writes it collectively)
+	char *output_name, out[FILENAME_MAX];
+	if(args > arg_counter+1) output_name = argv[++arg_counter];
+	else 
+	{
+		char charf[20];
+			
+		sprintf(charf,"%e",f);
+		charf[1] = charf[2];
+		charf[2] = '\0';
+		
+		if(ktype-1) snprintf(out,sizeof(out),"%.*s.bb_%d_%dx%d.mpi.pgm",namelen-4,input_name,ktype, xkernel, ykernel);
+		else 				snprintf(out,sizeof(out),"%.*s.bb_1_%dx%d_%s.mpi.pgm",namelen-4,input_name, xkernel, ykernel,charf);
+				
+		output_name = out;
+	}
+	
+	//every process reads and writes its own band of the file
+	char *mpiio = getenv("BLUR_MPIIO");
+	if(mpiio && atoi(mpiio))
+	{
+		int ret = blur_mpiio(input_name, output_name, &plan, ykernel/2, rank, size);
+		free(kernel);
+		free_plan(&plan);
+		MPI_Finalize();
+		return ret;
+	}
+	
+	//2D blocks instead of row bands (if any grid fits the image)
+	char *grid = getenv("BLUR_GRID");
+	if(grid && *grid)
+	{
+		int ret = blur_cart(grid, input_name, output_name, &plan, xkernel/2, ykernel/2, rank, size);
+		if(ret >= 0)
+		{
+			free(kernel);
+			free_plan(&plan);
+			MPI_Finalize();
+			return ret;
+		}
+	}
+	
 
 	/*********************************************************************************************************************
 	*																																																										 *
@@ -173,15 +273,20 @@ int main(int args, char** argv)
 	xsize = image_parameters[1];
 	ysize = image_parameters[2];
 	
-	//the following code is structured to work with 16bit images, so it wont work with 8 bits images (yet)
-	if(maxval<255)
+	if(maxval<0)
 	{
-		if(!rank) printf("8bit pictures not supported (yet).\n");
+		if(!rank) printf("Could not read image \"%s\".\n",input_name);
 		free(kernel);
+		free_plan(&plan);
 		MPI_Finalize();
-		return 5;
+		return 4;
 	}
 	
+	//8bit images are sent and gathered as they are (1 byte per pixel), and read as such by the direct and tiled engines (see plan_depth8);
+	//for the others they are widened to 16bit (then narrowed back) in the place of the swaps. edepth is the pixel size seen by the engine
+	int depth = 1 + (maxval > 255), widen8 = depth == 1 && !plan_depth8(&plan,maxval), edepth = widen8 ? 2 : depth;
+	MPI_Datatype pixel_type = (depth == 2) ? MPI_UNSIGNED_SHORT : MPI_UNSIGNED_CHAR;
+	
 	//dimesion of the halo layer above and below the chunks (at least in non-pathological case, and before correction)
 	//expressed in terms of number of pixels
 	int halo_size = (ykernel/2)*xsize; 
@@ -191,19 +296,32 @@ int main(int args, char** argv)
 	  
 	  To ease the job of subdiving the image read from file and the reunification after the blurring, it has been decided to split
 	  it in contiguous portions of memory, that is in rows. The master process blurres the first bunch of rows of the image, the first
-	  slave the second and so on. Note that this is easier to implement but implies that the border in split unevenly between the 
-	  processes. Since working on the border requires more FLOPs (need for renormalization), the workload is also distributed in a 
-	  (possibly) uneven manner: if the total number of processes does not divide the the number of rows, the work is distributed 
-	  evenly among the "middle processes" and the remaing amount of work is divided between master and last (the least workload is 
-	  always given to the master) according to the subsequent formulas: */
-
-		#define INNER_WORKLOAD(x,y,procs)  ( ( (y%procs) ? (y+procs-y%procs) : (y) )/procs * x )
-		#define FIRST_WORKLOAD(x,y,procs)  ((y-(procs-2)*(INNER_WORKLOAD(x,y,procs)/x))/2 * x)
-		#define LAST_WORKLOAD(x,y,procs)   (FIRST_WORKLOAD(x,y,procs) + ((y-(procs-2)*(INNER_WORKLOAD(x,y,procs)/x))%2 * x))
-	
-	/*If the number of processes does divide the the number of rows on the other hand, the workload is split evenly
+	  slave the second and so on. Since working on the border requires more time (renormalization, and no vector instructions), the
+	  rows are not split evenly: partition_rows estimates the cost of each row from the size of the kernel and the part of it lying on
+	  the border, and cuts the image into bands of about the same estimated cost, so that the first and last process get fewer rows. */
+
+	//The costs depend on the instruction set and the environment of the process (see row_cost), which may differ between the nodes: the
+	//master's partition is the one used by all.
+	int *first = (int *)malloc(sizeof(int)*size), *rows = (int *)malloc(sizeof(int)*size);
+	double imbalance = 0;
+
+	if(!rank) imbalance = partition_rows(&plan, xsize, ysize, size, first, rows);
+	MPI_Bcast(first, size, MPI_INT, 0, MPI_COMM_WORLD);
+	MPI_Bcast(rows, size, MPI_INT, 0, MPI_COMM_WORLD);
+
+	if(!rank)
+	{
+		int *even_first = (int *)malloc(sizeof(int)*size), *even_rows = (int *)malloc(sizeof(int)*size), r;
+		for(r=0; r<size; r++) even_first[r] = (int)((long long)ysize*r/size), even_rows[r] = (int)((long long)ysize*(r+1)/size) - even_first[r];
+
+		printf("Rows per process:");
+		for(r=0; r<size; r++) printf(" %d",rows[r]);
+		printf(" (estimated imbalance %.1f%%, %.1f%% with equal bands)\n", 100*(imbalance-1), 100*(partition_imbalance(&plan,xsize,ysize,size,even_first,even_rows)-1));
+		free(even_first);
+		free(even_rows);
+	}
 	
-	*********************************************************************************************************************************/
+	/*********************************************************************************************************************************/
 
 	//this represents the workload of each process
 	int workload;
@@ -217,26 +335,27 @@ int main(int args, char** argv)
 	if(!rank)
 	{
 		//requests for the asynchronous communication
-		MPI_Request *requests = (MPI_Request *)malloc((size-1)*sizeof(MPI_Request));
+		MPI_Request *requests = (MPI_Request *)malloc(3*(size-1)*sizeof(MPI_Request));
 		
 		//start and end position wrt the image pointer of the the chunks of memeory to be sent to each slave.
 		//chunk is the number of pixels that each must receive, and includes halo layers.			
 		int i, start, end, chunk;
 				
-		workload = FIRST_WORKLOAD(xsize,ysize,size);
-		int inner = INNER_WORKLOAD(xsize,ysize,size);
-		int last = LAST_WORKLOAD(xsize,ysize,size);
+		workload = xsize*rows[0];
 		
+		//the rows of each band are sent first, then the halo layers above and below them as separate messages: the slaves start 
+		//blurring the rows which need no halo while these arrive
 		for(i=1;i<size;i++)
 		{			
 			//this takes into account cases where start might be negative (which will be an error) and prevents it.
 			//the same goes for the end 
-			start = max(0,workload - halo_size + inner*(i-1));
-			end = (rank != size-1)? min(xsize*ysize,workload + halo_size + inner*i) : xsize*ysize;
-			
-			chunk = end-start;
+			int rows_start = xsize*first[i], rows_end = rows_start + xsize*rows[i];
+			start = max(0,rows_start - halo_size);
+			end = (i != size-1)? min(xsize*ysize,rows_end + halo_size) : xsize*ysize;
 			
-			MPI_Isend((unsigned short int *)image + start, chunk, MPI_UNSIGNED_SHORT, i, 0, MPI_COMM_WORLD, &requests[i-1]);
+			MPI_Isend((char *)image + (size_t)depth*rows_start, rows_end-rows_start, pixel_type, i, 0, MPI_COMM_WORLD, &requests[3*(i-1)]);
+			MPI_Isend((char *)image + (size_t)depth*start, rows_start-start, pixel_type, i, 1, MPI_COMM_WORLD, &requests[3*(i-1)+1]);
+			MPI_Isend((char *)image + (size_t)depth*rows_end, end-rows_end, pixel_type, i, 2, MPI_COMM_WORLD, &requests[3*(i-1)+2]);
 		}		
 			
 		/******************************************		
@@ -246,12 +365,7 @@ int main(int args, char** argv)
 		int *recv_size = (int *)malloc(size*sizeof(int));
 		int *displs = (int *)malloc(size*sizeof(int));
 		
-		//this macro calculates the size of workload given the rank
-		#define PROPER_SIZE(rank) (!(rank))?(workload):(((rank) == size-1)?(last):(inner))
-	
-		displs[0] = 0;
-		for(i=1;i<size;i++) displs[i] = displs[i-1] + (recv_size[i-1] = PROPER_SIZE(i-1));
-		recv_size[size-1] = last;
+		for(i=0;i<size;i++) displs[i] = xsize*first[i], recv_size[i] = xsize*rows[i];
 				
 		/*****************************************/
 		
@@ -263,11 +377,12 @@ int main(int args, char** argv)
 		int space_up = 0, space_down = chunk - workload;
 		
 		//allocatetes the space for the complete blurred image to be stored (also used for the local part of the master to be stored directly)
-		void *blurred = malloc(sizeof(unsigned short int)*xsize*ysize);
+		void *blurred = malloc(widen8 ? sizeof(unsigned short int)*workload : (size_t)depth*xsize*ysize);
 		
-		//Hereafter the buffer image is used in the convolution, so we must wait that all have recevied the correct image before we can modify it.
-		MPI_Waitall(size-1, requests, MPI_STATUSES_IGNORE);
-		free(requests);
+		//Hereafter the buffer image is used in the convolution, so we must wait that all have recevied the correct image before we can modify it
+		//(swapping it in place): otherwise the master blurs its own band while the messages are being sent, and waits for them afterwards.
+		int in_place = depth == 2 && I_M_LITTLE_ENDIAN && !plan.bswap;
+		if(in_place) MPI_Waitall(3*(size-1), requests, MPI_STATUSES_IGNORE);
 		
 		//time took to communicate
 		tcomm = MPI_Wtime();
@@ -276,14 +391,36 @@ int main(int args, char** argv)
 		* BLURRING - BEGIN
 		*********************************************************/
 		
-		if ( I_M_LITTLE_ENDIAN) swap_image(image, xsize, chunk/xsize, maxval);
+		void *wide = widen8 ? malloc(sizeof(unsigned short int)*chunk) : image;
+		
+		if ( widen8 ) widen_image((unsigned short int *)wide, (unsigned char *)image, xsize, chunk/xsize, plan.bswap);
+		else if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan.bswap) swap_image(image, xsize, chunk/xsize, maxval);
 		
 		//this function does the convolution of image and stores the result in blurred. 
 		//It hadles different sizes of the two by means of the space up and down counters.
-		Convolve((unsigned short int *)image, (unsigned short int *)blurred, xsize, workload/xsize, kernel, xkernel, ykernel, space_up/xsize, space_down/xsize);
+		Blur(wide, blurred, xsize, workload/xsize, &plan, space_up/xsize, space_down/xsize);
 		
-		free(image);
-		if ( I_M_LITTLE_ENDIAN) swap_image(blurred, xsize, workload/xsize, maxval);
+		if(!in_place)
+		{
+			double t = MPI_Wtime();
+			MPI_Waitall(3*(size-1), requests, MPI_STATUSES_IGNORE);
+			thalo = MPI_Wtime()-t;
+		}
+		free(requests);
+		
+		//a widened 8bit result goes back to the image buffer, where the others' parts are then gathered
+		if ( widen8 )
+		{
+			narrow_image((unsigned char *)image, (unsigned short int *)blurred, xsize, workload/xsize, maxval, plan.bswap);
+			free(wide);
+			free(blurred);
+			blurred = image;
+		}
+		else
+		{
+			free(image);
+			if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan.bswap) swap_image(blurred, xsize, workload/xsize, maxval);
+		}
 		
 		/********************************************************
 		* BLURRING - END
@@ -293,7 +430,7 @@ int main(int args, char** argv)
      
     //recombination of the split image is done by means of Gatherv function. Here the sendbuffer is MPI_IN_PLACE since the master works already
     //in the array of the complete image by construction of the algorithm.    	
-		MPI_Gatherv(MPI_IN_PLACE, workload, MPI_UNSIGNED_SHORT, blurred, recv_size, displs, MPI_UNSIGNED_SHORT, 0, MPI_COMM_WORLD);
+		MPI_Gatherv(MPI_IN_PLACE, workload, pixel_type, blurred, recv_size, displs, pixel_type, 0, MPI_COMM_WORLD);
 		
 		tcomm2 = MPI_Wtime(); 
 		
@@ -303,26 +440,8 @@ int main(int args, char** argv)
 		
 		
 		/*******************************************************************************************
-		* Here the name of the output file and printing of the image is handled (only by the master) 
+		* Here the printing of the image is handled (only by the master) 
 		********************************************************************************************/
-		
-		char *output_name;
-		if(args > arg_counter+1) output_name = argv[++arg_counter];
-		else 
-		{
-		input_name[strlen(input_name)-4]='\0';
-		char charf[20];
-		char out[50] = "";
-			
-		sprintf(charf,"%e",f);
-		charf[1] = charf[2];
-		charf[2] = '\0';
-		
-		if(ktype-1) sprintf(out,"%s.bb_%d_%dx%d.mpi.pgm",input_name,ktype, xkernel, ykernel);
-		else 				sprintf(out,"%s.bb_1_%dx%d_%s.mpi.pgm",input_name, xkernel, ykernel,charf);
-				
-		output_name = out;
-		}
 	
 		write_pgm_image(blurred, maxval, xsize, ysize, output_name);
 		printf("Blurred image was succesfully stored in the file \"%s\"\n",output_name);
@@ -336,19 +455,19 @@ int main(int args, char** argv)
 	
 	else
 	{
-		//the workload of each is establishe by means of the above definitions
-		workload  = (rank != size-1) ? INNER_WORKLOAD(xsize,ysize,size) : LAST_WORKLOAD(xsize,ysize,size);
+		//the workload of each is established by the partition above
+		workload  = xsize*rows[rank];
 		
 		int space_up, space_down, start, end;
 		
 		//this is totally analogous to the earlier discussion
-		start = FIRST_WORKLOAD(xsize,ysize,size) - halo_size + INNER_WORKLOAD(xsize,ysize,size)*(rank-1);  //rank specific
+		start = xsize*first[rank] - halo_size;  //rank specific
 		if(start<0)	space_up = halo_size + start, start = 0;
 		else space_up = halo_size;
 		
 		if(rank != size-1)
 		{
-			end = FIRST_WORKLOAD(xsize,ysize,size) + halo_size + INNER_WORKLOAD(xsize,ysize,size)*rank;
+			end = xsize*(first[rank]+rows[rank]) + halo_size;
 			if(end>xsize*ysize) space_down = halo_size + xsize*ysize - end, end = xsize*ysize;
 			else space_down = halo_size;
 		}
@@ -357,10 +476,16 @@ int main(int args, char** argv)
 		int chunk = end-start;
 					
 		//allocates space for the local copy of the image chunk to be stored			
-		void *local_image = malloc(sizeof(unsigned short int)*chunk);
+		void *local_image = malloc(depth*chunk);
+		
+		//the rows of the band and the halo layers above and below them arrive separately (see the master)
+		MPI_Request parts[3];
+		MPI_Irecv((char *)local_image + (size_t)depth*space_up, workload, pixel_type, 0, 0, MPI_COMM_WORLD, &parts[0]);
+		MPI_Irecv(local_image, space_up, pixel_type, 0, 1, MPI_COMM_WORLD, &parts[1]);
+		MPI_Irecv((char *)local_image + (size_t)depth*(space_up+workload), space_down, pixel_type, 0, 2, MPI_COMM_WORLD, &parts[2]);
 		
-		//waits until the image is received
-		MPI_Recv(local_image, chunk, MPI_UNSIGNED_SHORT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		//waits until the rows are received
+		MPI_Wait(&parts[0], MPI_STATUS_IGNORE);
 		
 		//time took to communicate
 		tcomm = MPI_Wtime();
@@ -370,13 +495,54 @@ int main(int args, char** argv)
 		*********************************************************/
 		
 		//allocates space for the blurred local copy to be stored
-		void *blurred = malloc(sizeof(unsigned short int)*workload);
-		if ( I_M_LITTLE_ENDIAN) swap_image(local_image, xsize, chunk/xsize, maxval);
+		void *blurred = malloc((size_t)edepth*workload);
+		char *wide = widen8 ? (char *)malloc(sizeof(unsigned short int)*chunk) : (char *)local_image;
+		
+		//in lines: the halo layers are up and down, the rows of the band go from up to up+rows-1, and the first and last sy of them need the halos.
+		//The recursive gaussian is not split: its response is infinite, so every row of the band depends on all the lines held, and the three
+		//pieces would each be cut (and renormalized) sy lines from their rows instead of at the ends of the halos
+		int up = space_up/xsize, down = space_down/xsize, rows = workload/xsize, sy = halo_size/xsize, part;
+		int overlap = sy > 0 && rows > 2*sy && plan.engine != ENGINE_IIR;
+		size_t line = (size_t)edepth*xsize;
 		
-		Convolve((unsigned short int *)local_image, (unsigned short int *)blurred, xsize, workload/xsize, kernel, xkernel, ykernel, space_up/xsize, space_down/xsize);
+		prepare_lines(local_image, wide, xsize, up, rows, depth, widen8, maxval, &plan);
+		if(overlap) Blur(wide + line*up, (char *)blurred + line*sy, xsize, rows-2*sy, &plan, sy, sy);
+		
+		//then the rows next to each halo layer as soon as it arrives (all the rows at once if the band is too thin)
+		for(part=0; part<2; part++)
+		{
+			int which;
+			double t = MPI_Wtime();
+			
+			MPI_Waitany(2, parts+1, &which, MPI_STATUS_IGNORE);
+			thalo += MPI_Wtime()-t;
+			
+			if(which == 0)
+			{
+				prepare_lines(local_image, wide, xsize, 0, up, depth, widen8, maxval, &plan);
+				if(overlap) Blur(wide, blurred, xsize, sy, &plan, up, sy);
+			}
+			else
+			{
+				prepare_lines(local_image, wide, xsize, up+rows, down, depth, widen8, maxval, &plan);
+				if(overlap) Blur(wide + line*(up+rows-2*sy), (char *)blurred + line*(rows-sy), xsize, sy, &plan, sy, down);
+			}
+		}
+		if(!overlap) Blur(wide, blurred, xsize, rows, &plan, up, down);
 		
-		free(local_image);
-		if ( I_M_LITTLE_ENDIAN) swap_image(blurred, xsize, workload/xsize, maxval);
+		//a widened 8bit result is sent back from the local image buffer
+		if ( widen8 )
+		{
+			narrow_image((unsigned char *)local_image, (unsigned short int *)blurred, xsize, workload/xsize, maxval, plan.bswap);
+			free(wide);
+			free(blurred);
+			blurred = local_image;
+		}
+		else
+		{
+			free(local_image);
+			if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan.bswap) swap_image(blurred, xsize, workload/xsize, maxval);
+		}
 		
 		/********************************************************
 		* BLURRING - END
@@ -386,7 +552,7 @@ int main(int args, char** argv)
 		tcalc = MPI_Wtime(); 
 
 		//sends back the local copy to master		
-		MPI_Gatherv((unsigned short int *)blurred, workload, MPI_UNSIGNED_SHORT, NULL, NULL, NULL, MPI_UNSIGNED_SHORT, 0, MPI_COMM_WORLD);
+		MPI_Gatherv(blurred, workload, pixel_type, NULL, NULL, NULL, pixel_type, 0, MPI_COMM_WORLD);
 		
 		//time for the second communication
 		tcomm2 = MPI_Wtime(); 
@@ -394,10 +560,622 @@ int main(int args, char** argv)
 	}
 	
 	MPI_Barrier(MPI_COMM_WORLD);
-	printf("[%d] Walltime timings. I/0: %fs, Scattering: %fs, Calculation: %fs, Gathering: %fs. Total: %fs\n",rank,tIO-t0,tcomm-tIO,tcalc-tcomm,tcomm2-tcalc,tcomm2-t0);
+	printf("[%d] Walltime timings. I/0: %fs, Scattering: %fs, Calculation: %fs, Halo wait: %fs, Gathering: %fs. Total: %fs\n",rank,tIO-t0,tcomm-tIO,tcalc-tcomm-thalo,thalo,tcomm2-tcalc,tcomm2-t0);
+	free(first);
+	free(rows);
 	free(kernel);
+	free_plan(&plan);
 	
 
 	MPI_Finalize();
 	return 0;
 }
+
+
+static void prepare_lines(void *local, void *wide, int xsize, int first, int lines, int depth, int widen8, int maxval, kernel_plan *plan)
+//gets lines first to first+lines-1 of the band in local ready for the engine, in wide: widened if 8bit and widen8, swapped if 16bit unless the
+//engine does it
+{
+	if ( widen8 ) widen_image((unsigned short int *)wide + (size_t)xsize*first, (unsigned char *)local + (size_t)xsize*first, xsize, lines, plan->bswap);
+	else if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan->bswap) swap_image((unsigned short int *)local + (size_t)xsize*first, xsize, lines, maxval);
+}
+
+static int pgm_name(const char *name)
+//1 if name ends in ".pgm"
+{
+	int namelen = strlen(name);
+	return namelen > 4 && !strcmp(&name[namelen-4],".pgm");
+}
+
+static void free_bank(kernel_plan *plans, KTYPE **kernels, KTYPE *fs, int nk)
+//frees the nk kernels of the filter bank and their plans
+{
+	int k;
+
+	for(k=0; k<nk; k++)
+	{
+		free(kernels[k]);
+		free_plan(&plans[k]);
+	}
+	free(kernels);
+	free(fs);
+	free(plans);
+}
+
+static int filter_bank(int args, char **argv, int rank, int size)
+/*
+* ./blur bank [kernel-spec] [kernel-spec] ... [input-file] {output-files}: blurs the image with several kernels (types 0 to 3, each
+* spec given as the arguments of a single kernel) in a single pass over it, see Bank_convolve. The output files are either given for
+* every kernel or all named as usual (plus the position of the kernel in the bank). The rows are split among the processes as for a
+* single kernel, with the halo of the tallest kernel.
+*/
+{
+	double t0, tIO, tcomm, tcalc, tcomm2;
+	t0 = MPI_Wtime();
+
+	char* usage = "Usage: ./blur bank [kernel-spec] [kernel-spec] ... [input-file] {output-files}, each kernel-spec being [kernel-type] {x-kernel-size} {y-kernel-size} {additional-kernel-param} (kernel types 0 to 3)";
+
+	//at most one kernel every two arguments
+	kernel_plan *plans = (kernel_plan *)malloc(sizeof(kernel_plan)*args);
+	KTYPE **kernels = (KTYPE **)malloc(sizeof(KTYPE *)*args), *fs = (KTYPE *)malloc(sizeof(KTYPE)*args);
+	int arg_counter = 1, nk = 0, k, r;
+
+	/********************
+	 kernels 
+	********************/
+
+	int ktype = 0, halo = 0, tallest = 0;
+	while(arg_counter+1 < args && !pgm_name(argv[arg_counter+1]))
+	{
+		int xkernel, ykernel;
+
+		ktype = read_kernel_spec(argv,&arg_counter,args-1,&kernels[nk],&xkernel,&ykernel,&fs[nk],!rank);
+		if(ktype < 0) break;
+
+		plan_kernel(&plans[nk],kernels[nk],xkernel,ykernel,ktype,fs[nk]);
+
+		//every kernel goes through the tiled engine, which swaps the pixels itself
+		plans[nk].engine = ENGINE_TILED;
+		plan_byteswap(&plans[nk]);
+		if(ykernel/2 > halo) halo = ykernel/2, tallest = nk;
+		nk++;
+	}
+
+	//the specs must be followed by the input file, and possibly by one output file per kernel
+	int nout = args-arg_counter-2;
+	if(ktype < 0 || !nk || arg_counter+1 >= args || (nout && nout != nk))
+	{
+		if(!rank) printf("Wrong arguments for the filter bank. %s\n",usage);
+		free_bank(plans,kernels,fs,nk);
+		return 1;
+	}
+
+	if(!rank) printf("Convolution engine: tiled filter bank of %d kernels\n",nk);
+	//each kernel has its own row kernels (see simd_select)
+	if(!rank)
+		for(k=0; k<nk; k++) printf("Kernel %d interior vectorized with: %s%s%s%s\n",k,simd_name(plans[k].simd),plans[k].unroll_y ? " (unrolled kernel size)" : plans[k].unroll_x ? " (unrolled kernel width)" : "",(const char *[]){"", ", folded along x", ", folded along y", ", folded along x and y"}[plans[k].symmetry],plans[k].row_block ? ", rows in blocks" : "");
+
+	char* input_name = argv[++arg_counter];
+	if(!rank) printf("Trying to blur image \"%s\"\n",input_name);
+
+	/**********************************************************************************************************************
+	*																			  BLURRING - MPI COMMUNICATION
+	**********************************************************************************************************************/
+
+	void *image = NULL;
+	int maxval, xsize, ysize, image_parameters[3];
+
+	if(!rank)	read_pgm_image(&image, image_parameters, image_parameters+1, image_parameters+2, input_name);
+	MPI_Bcast(image_parameters,3,MPI_INT,0,MPI_COMM_WORLD);
+
+	maxval = image_parameters[0];
+	xsize = image_parameters[1];
+	ysize = image_parameters[2];
+
+	if(maxval<0)
+	{
+		if(!rank) printf("Could not read image \"%s\".\n",input_name);
+		free_bank(plans,kernels,fs,nk);
+		return 4;
+	}
+
+	//8bit images are sent and gathered as they are, and read as such by the (tiled) engine of the bank, see main
+	int depth = 1 + (maxval > 255);
+	MPI_Datatype pixel_type = (depth == 2) ? MPI_UNSIGNED_SHORT : MPI_UNSIGNED_CHAR;
+	for(k=0; k<nk; k++) plan_depth8(&plans[k], maxval);
+
+	tIO = MPI_Wtime();
+
+	//first row, number of rows and lines of halo above and below of each process: split as for a single kernel (see main), the tallest one
+	int *first = (int *)malloc(sizeof(int)*size), *rows = (int *)malloc(sizeof(int)*size);
+	int *up = (int *)malloc(sizeof(int)*size), *down = (int *)malloc(sizeof(int)*size);
+
+	if(!rank) partition_rows(&plans[tallest], xsize, ysize, size, first, rows);
+	MPI_Bcast(first, size, MPI_INT, 0, MPI_COMM_WORLD);
+	MPI_Bcast(rows, size, MPI_INT, 0, MPI_COMM_WORLD);
+	for(r=0; r<size; r++)
+	{
+		up[r] = min(halo,first[r]);
+		down[r] = max(min(halo,ysize-first[r]-rows[r]),0);
+	}
+
+	int nlines = rows[rank]+up[rank]+down[rank];
+	void *local;
+
+	if(!rank)
+	{
+		MPI_Request *requests = (MPI_Request *)malloc(size*sizeof(MPI_Request));
+
+		for(r=1; r<size; r++)
+			MPI_Isend((char *)image + (size_t)depth*xsize*(first[r]-up[r]), xsize*(rows[r]+up[r]+down[r]), pixel_type, r, 0, MPI_COMM_WORLD, &requests[r-1]);
+
+		//the image is used (and swapped) in place, after the others have received their part
+		MPI_Waitall(size-1, requests, MPI_STATUSES_IGNORE);
+		free(requests);
+		local = image;
+	}
+	else
+	{
+		local = malloc((size_t)depth*xsize*nlines);
+		MPI_Recv(local, xsize*nlines, pixel_type, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	}
+
+	tcomm = MPI_Wtime();
+
+	//the master blurs directly into the complete images
+	void **blurred = (void **)malloc(sizeof(void *)*nk);
+	for(k=0; k<nk; k++) blurred[k] = malloc((size_t)depth*xsize*(!rank ? ysize : rows[rank]));
+
+	//in the byte order of the file (see plan_byteswap)
+	Bank_convolve(local, blurred, xsize, rows[rank], plans, nk, up[rank], down[rank]);
+	free(local);
+
+	tcalc = MPI_Wtime();
+
+	int *recv_size = (int *)malloc(size*sizeof(int)), *displs = (int *)malloc(size*sizeof(int));
+	for(r=0; r<size; r++)
+	{
+		recv_size[r] = xsize*rows[r];
+		displs[r] = xsize*first[r];
+	}
+
+	for(k=0; k<nk; k++)
+		MPI_Gatherv(!rank ? MPI_IN_PLACE : blurred[k], xsize*rows[rank], pixel_type, blurred[k], recv_size, displs, pixel_type, 0, MPI_COMM_WORLD);
+
+	tcomm2 = MPI_Wtime();
+
+	/********************
+	 output (master only)
+	********************/
+
+	if(!rank)
+	{
+		input_name[strlen(input_name)-4]='\0';
+		char *out = (char *)malloc(strlen(input_name)+64);
+
+		for(k=0; k<nk; k++)
+		{
+			char *output_name = out;
+
+			if(nout) output_name = argv[++arg_counter];
+			else
+			{
+				char charf[20];
+
+				sprintf(charf,"%e",fs[k]);
+				charf[1] = charf[2];
+				charf[2] = '\0';
+
+				if(plans[k].ktype-1) sprintf(out,"%s.bank%d_%d_%dx%d.mpi.pgm",input_name,k,plans[k].ktype,plans[k].xconv,plans[k].yconv);
+				else                 sprintf(out,"%s.bank%d_1_%dx%d_%s.mpi.pgm",input_name,k,plans[k].xconv,plans[k].yconv,charf);
+			}
+
+			write_pgm_image(blurred[k], maxval, xsize, ysize, output_name);
+			printf("Blurred image was succesfully stored in the file \"%s\"\n",output_name);
+		}
+
+		free(out);
+	}
+
+	for(k=0; k<nk; k++) free(blurred[k]);
+	free(blurred);
+	free(recv_size);
+	free(displs);
+	free(first);
+	free(rows);
+	free(up);
+	free(down);
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	printf("[%d] Walltime timings. I/0: %fs, Scattering: %fs, Calculation: %fs, Gathering: %fs. Total: %fs\n",rank,tIO-t0,tcomm-tIO,tcalc-tcomm,tcomm2-tcalc,tcomm2-t0);
+
+	free_bank(plans,kernels,fs,nk);
+
+	return 0;
+}
+
+static int blur_mpiio(char *input_name, char *output_name, kernel_plan *plan, int halo, int rank, int size)
+/*
+* MPI-IO mode (BLUR_MPIIO=1): the master only parses the header of the input file and writes the one of the output file, and every
+* process reads its band of rows (halo lines included) and writes its part of the result at the right offset of the files itself,
+* with collective calls: there is no scattering and gathering through the master. The bands are the same as in main.
+*/
+{
+	double t0, tread, tcalc, twrite;
+	t0 = MPI_Wtime();
+
+	//maxval, xsize, ysize and offsets of the first pixel in the input and output files, from the master
+	long long header[5] = {-4,0,0,0,-1};
+
+	if(!rank)
+	{
+		int maxval, xsize, ysize;
+		FILE *file = read_pgm_header(&maxval, &xsize, &ysize, input_name);
+
+		header[0] = maxval;
+		if(file != NULL)
+		{
+			header[1] = xsize;
+			header[2] = ysize;
+			header[3] = ftell(file);
+			fclose(file);
+
+			if((file = write_pgm_header(maxval, xsize, ysize, output_name)) != NULL)
+			{
+				header[4] = ftell(file);
+				fclose(file);
+			}
+		}
+	}
+	MPI_Bcast(header,5,MPI_LONG_LONG,0,MPI_COMM_WORLD);
+
+	int maxval = header[0], xsize = header[1], ysize = header[2];
+	MPI_Offset offset = header[3], out_offset = header[4];
+
+	if(maxval<0)
+	{
+		if(!rank) printf("Could not read image \"%s\".\n",input_name);
+		return 4;
+	}
+	if(out_offset<0)
+	{
+		if(!rank) printf("Could not create the file \"%s\".\n",output_name);
+		return 4;
+	}
+
+	int depth = 1 + (maxval > 255);
+	MPI_Datatype pixel_type = (depth == 2) ? MPI_UNSIGNED_SHORT : MPI_UNSIGNED_CHAR;
+
+	//first row, number of rows and lines of halo above and below of this process, as in main (the master's partition)
+	int *firsts = (int *)malloc(sizeof(int)*size), *counts = (int *)malloc(sizeof(int)*size);
+	if(!rank) partition_rows(plan, xsize, ysize, size, firsts, counts);
+	MPI_Bcast(firsts, size, MPI_INT, 0, MPI_COMM_WORLD);
+	MPI_Bcast(counts, size, MPI_INT, 0, MPI_COMM_WORLD);
+	int rows = counts[rank], first = firsts[rank];
+	free(firsts);
+	free(counts);
+	int up = min(halo,first), down = max(min(halo,ysize-first-rows),0), nlines = rows+up+down;
+
+	/********************
+	 reading
+	********************/
+
+	MPI_File fh;
+	MPI_Offset file_size = 0;
+
+	if(MPI_File_open(MPI_COMM_WORLD, input_name, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+	{
+		if(!rank) printf("Could not read image \"%s\".\n",input_name);
+		return 4;
+	}
+	MPI_File_get_size(fh, &file_size);
+	if(file_size < offset + (MPI_Offset)depth*xsize*ysize)
+	{
+		if(!rank) printf("Could not read image \"%s\": file too short.\n",input_name);
+		MPI_File_close(&fh);
+		return 4;
+	}
+
+	void *local = malloc((size_t)depth*xsize*nlines);
+	MPI_File_read_at_all(fh, offset + (MPI_Offset)depth*xsize*(first-up), local, xsize*nlines, pixel_type, MPI_STATUS_IGNORE);
+	MPI_File_close(&fh);
+
+	tread = MPI_Wtime();
+
+	/********************
+	 blurring
+	********************/
+
+	int widen8 = depth == 1 && !plan_depth8(plan,maxval);
+	void *blurred = malloc((size_t)(widen8 ? 2 : depth)*xsize*rows);
+	void *wide = widen8 ? malloc(sizeof(unsigned short int)*xsize*nlines) : local;
+
+	if ( widen8 ) widen_image((unsigned short int *)wide, (unsigned char *)local, xsize, nlines, plan->bswap);
+	else if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan->bswap) swap_image(local, xsize, nlines, maxval);
+
+	Blur(wide, blurred, xsize, rows, plan, up, down);
+
+	//a widened 8bit result is written from the local image buffer
+	if ( widen8 )
+	{
+		narrow_image((unsigned char *)local, (unsigned short int *)blurred, xsize, rows, maxval, plan->bswap);
+		free(wide);
+		free(blurred);
+		blurred = local;
+	}
+	else
+	{
+		free(local);
+		if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan->bswap) swap_image(blurred, xsize, rows, maxval);
+	}
+
+	tcalc = MPI_Wtime();
+
+	/********************
+	 writing
+	********************/
+
+	if(MPI_File_open(MPI_COMM_WORLD, output_name, MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+	{
+		if(!rank) printf("Could not write image \"%s\".\n",output_name);
+		free(blurred);
+		return 4;
+	}
+	MPI_File_write_at_all(fh, out_offset + (MPI_Offset)depth*xsize*first, blurred, xsize*rows, pixel_type, MPI_STATUS_IGNORE);
+	MPI_File_close(&fh);
+	free(blurred);
+
+	twrite = MPI_Wtime();
+
+	if(!rank) printf("Blurred image was succesfully stored in the file \"%s\"\n",output_name);
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	printf("[%d] Walltime timings. Reading (MPI-IO): %fs, Calculation: %fs, Writing (MPI-IO): %fs. Total: %fs\n",rank,tread-t0,tcalc-tread,twrite-tcalc,twrite-t0);
+
+	return 0;
+}
+
+static void block_range(int n, int parts, int i, int *start, int *len)
+//start and length of the i-th of parts nearly equal pieces of n pixels (the first n%parts one pixel longer)
+{
+	*len = n/parts + (i < n%parts);
+	*start = i*(n/parts) + min(i,n%parts);
+}
+
+static int choose_grid(const char *grid, int xsize, int ysize, int sx, int sy, int size, int verbose, int *dims)
+/*
+* Grid of blocks of blur_cart, dims[1] columns by dims[0] rows of them: the one given as "COLSxROWS" in grid if it fits, otherwise the one
+* moving the fewest halo pixels per block, (w+2sx)(h+2sy)-wh for blocks of w x h pixels, among the ones whose blocks are all at least sx
+* columns wide and sy rows tall (so that every halo comes from the adjacent blocks only). Row bands are preferred on ties. Returns 1 if
+* no grid fits.
+*/
+{
+	int px, py, found = 0;
+	double cost, best = 0;
+
+	if(sscanf(grid,"%dx%d",&px,&py) == 2)
+	{
+		if(px > 0 && py > 0 && px*py == size && xsize/px >= max(sx,1) && ysize/py >= max(sy,1))
+		{
+			dims[0] = py;
+			dims[1] = px;
+			return 0;
+		}
+		if(verbose) printf("Process grid \"%s\" not usable with %d processes on this image, chosen automatically\n",grid,size);
+	}
+
+	for(px=1; px<=size; px++)
+	{
+		if(size%px) continue;
+
+		py = size/px;
+		if(xsize/px < max(sx,1) || ysize/py < max(sy,1)) continue;
+
+		double w = (double)xsize/px, h = (double)ysize/py;
+		cost = (w+2*sx)*(h+2*sy)-w*h;
+		if(!found || cost < best)
+		{
+			best = cost;
+			dims[0] = py;
+			dims[1] = px;
+			found = 1;
+		}
+	}
+
+	return !found;
+}
+
+static int blur_cart(const char *grid, char *input_name, char *output_name, kernel_plan *plan, int sx, int sy, int rank, int size)
+/*
+* 2D decomposition (BLUR_GRID): the image is cut into a grid of blocks laid out on a cartesian communicator, one per process, instead of
+* row bands, so that the halo of each block grows with its perimeter rather than with the width of the image. The master sends every
+* process its block (subarray datatypes, no halo), then the halos are exchanged between neighbours: first the sx columns on the left
+* and right (vector datatypes), then the sy lines above and below over the whole width, halo columns included, which brings the corners
+* along. Each block is blurred as an image of its width plus the halo columns, with lines_up and lines_down as the bands of main, and
+* the halo columns as cols_left and cols_right of the plan: the engines skip them in their border loops, so only the real edges of the
+* image go through the renormalized loop (whatever they blur there comes out wrong, their windows being cut, and is not sent back).
+* Returns -1 if no grid fits the image.
+*/
+{
+	double t0, tIO, tcomm, thalo, tcalc, tcomm2;
+	t0 = MPI_Wtime();
+
+	void *image = NULL;
+	int maxval, xsize, ysize, image_parameters[3], r;
+
+	if(!rank)	read_pgm_image(&image, image_parameters, image_parameters+1, image_parameters+2, input_name);
+	MPI_Bcast(image_parameters,3,MPI_INT,0,MPI_COMM_WORLD);
+
+	maxval = image_parameters[0];
+	xsize = image_parameters[1];
+	ysize = image_parameters[2];
+
+	if(maxval<0)
+	{
+		if(!rank) printf("Could not read image \"%s\".\n",input_name);
+		return 4;
+	}
+
+	int dims[2], periods[2] = {0,0};
+	if(choose_grid(grid, xsize, ysize, sx, sy, size, !rank, dims))
+	{
+		if(!rank) printf("No grid of %d blocks as large as the halo fits the image, row bands used instead\n",size);
+		free(image);
+		return -1;
+	}
+	if(!rank) printf("Process grid: %dx%d blocks of about %dx%d pixels\n",dims[1],dims[0],xsize/dims[1],ysize/dims[0]);
+
+	tIO = MPI_Wtime();
+
+	MPI_Comm cart;
+	int coords[2], up_rank, down_rank, left_rank, right_rank;
+
+	MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &cart);
+	MPI_Cart_coords(cart, rank, 2, coords);
+	MPI_Cart_shift(cart, 0, 1, &up_rank, &down_rank);
+	MPI_Cart_shift(cart, 1, 1, &left_rank, &right_rank);
+
+	//8bit images are moved as they are, see main
+	int depth = 1 + (maxval > 255);
+	MPI_Datatype pixel_type = (depth == 2) ? MPI_UNSIGNED_SHORT : MPI_UNSIGNED_CHAR;
+
+	//block of this process, and halo lines and columns on the sides with a neighbour: the local image is H lines of W pixels
+	int x0, bw, y0, bh;
+	block_range(xsize, dims[1], coords[1], &x0, &bw);
+	block_range(ysize, dims[0], coords[0], &y0, &bh);
+
+	int up = (up_rank != MPI_PROC_NULL) ? sy : 0, down = (down_rank != MPI_PROC_NULL) ? sy : 0;
+	int left = (left_rank != MPI_PROC_NULL) ? sx : 0, right = (right_rank != MPI_PROC_NULL) ? sx : 0;
+	int W = left+bw+right, H = up+bh+down;
+
+	/********************
+	 blocks
+	********************/
+
+	char *local = (char *)malloc((size_t)depth*W*H);
+	MPI_Datatype local_block, *blocks = NULL;
+	MPI_Request request;
+
+	MPI_Type_create_subarray(2, (int []){H,W}, (int []){bh,bw}, (int []){up,left}, MPI_ORDER_C, pixel_type, &local_block);
+	MPI_Type_commit(&local_block);
+	MPI_Irecv(local, 1, local_block, 0, 0, cart, &request);
+
+	//the master keeps the block datatypes of everybody for the gathering, into the buffer of the image
+	if(!rank)
+	{
+		MPI_Request *requests = (MPI_Request *)malloc(size*sizeof(MPI_Request));
+		blocks = (MPI_Datatype *)malloc(size*sizeof(MPI_Datatype));
+
+		for(r=0; r<size; r++)
+		{
+			int c[2], rx0, rbw, ry0, rbh;
+
+			MPI_Cart_coords(cart, r, 2, c);
+			block_range(xsize, dims[1], c[1], &rx0, &rbw);
+			block_range(ysize, dims[0], c[0], &ry0, &rbh);
+
+			MPI_Type_create_subarray(2, (int []){ysize,xsize}, (int []){rbh,rbw}, (int []){ry0,rx0}, MPI_ORDER_C, pixel_type, &blocks[r]);
+			MPI_Type_commit(&blocks[r]);
+			MPI_Isend(image, 1, blocks[r], r, 0, cart, &requests[r]);
+		}
+
+		MPI_Waitall(size, requests, MPI_STATUSES_IGNORE);
+		free(requests);
+	}
+	MPI_Wait(&request, MPI_STATUS_IGNORE);
+
+	tcomm = MPI_Wtime();
+
+	/********************
+	 halo exchange
+	********************/
+
+	MPI_Datatype columns;
+	size_t d = depth;
+
+	MPI_Type_vector(bh, sx, W, pixel_type, &columns);
+	MPI_Type_commit(&columns);
+
+	//first interior columns to the right halo of the left neighbour, last ones to the left halo of the right neighbour
+	MPI_Sendrecv(local + d*((size_t)up*W+left), 1, columns, left_rank, 1, local + d*((size_t)up*W+left+bw), 1, columns, right_rank, 1, cart, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(local + d*((size_t)up*W+left+bw-sx), 1, columns, right_rank, 2, local + d*(size_t)up*W, 1, columns, left_rank, 2, cart, MPI_STATUS_IGNORE);
+
+	//then whole lines (the blocks above and below have the same width and halo columns), corners included
+	MPI_Sendrecv(local + d*(size_t)up*W, sy*W, pixel_type, up_rank, 3, local + d*(size_t)(up+bh)*W, sy*W, pixel_type, down_rank, 3, cart, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(local + d*(size_t)(up+bh-sy)*W, sy*W, pixel_type, down_rank, 4, local, sy*W, pixel_type, up_rank, 4, cart, MPI_STATUS_IGNORE);
+
+	MPI_Type_free(&columns);
+
+	thalo = MPI_Wtime();
+
+	/********************
+	 blurring
+	********************/
+
+	plan->cols_left = left;
+	plan->cols_right = right;
+
+	int widen8 = depth == 1 && !plan_depth8(plan,maxval);
+	void *blurred = malloc((size_t)(widen8 ? 2 : depth)*W*bh);
+	void *wide = widen8 ? malloc(sizeof(unsigned short int)*W*H) : local;
+
+	if ( widen8 ) widen_image((unsigned short int *)wide, (unsigned char *)local, W, H, plan->bswap);
+	else if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan->bswap) swap_image(local, W, H, maxval);
+
+	Blur(wide, blurred, W, bh, plan, up, down);
+
+	//a widened 8bit result is sent back from the local image buffer
+	if ( widen8 )
+	{
+		narrow_image((unsigned char *)local, (unsigned short int *)blurred, W, bh, maxval, plan->bswap);
+		free(wide);
+		free(blurred);
+		blurred = local;
+	}
+	else
+	{
+		free(local);
+		if ( depth == 2 && I_M_LITTLE_ENDIAN && !plan->bswap) swap_image(blurred, W, bh, maxval);
+	}
+
+	tcalc = MPI_Wtime();
+
+	/********************
+	 gathering
+	********************/
+
+	MPI_Datatype result;
+
+	MPI_Type_create_subarray(2, (int []){bh,W}, (int []){bh,bw}, (int []){0,left}, MPI_ORDER_C, pixel_type, &result);
+	MPI_Type_commit(&result);
+	MPI_Isend(blurred, 1, result, 0, 5, cart, &request);
+
+	if(!rank)
+		for(r=0; r<size; r++)
+		{
+			MPI_Recv(image, 1, blocks[r], r, 5, cart, MPI_STATUS_IGNORE);
+			MPI_Type_free(&blocks[r]);
+		}
+
+	MPI_Wait(&request, MPI_STATUS_IGNORE);
+	MPI_Type_free(&result);
+	MPI_Type_free(&local_block);
+	free(blurred);
+
+	tcomm2 = MPI_Wtime();
+
+	if(!rank)
+	{
+		write_pgm_image(image, maxval, xsize, ysize, output_name);
+		printf("Blurred image was succesfully stored in the file \"%s\"\n",output_name);
+		free(blocks);
+		free(image);
+	}
+
+	MPI_Comm_free(&cart);
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	printf("[%d] Walltime timings. I/0: %fs, Scattering: %fs, Halo exchange: %fs, Calculation: %fs, Gathering: %fs. Total: %fs\n",rank,tIO-t0,tcomm-tIO,thalo-tcomm,tcalc-thalo,tcomm2-tcalc,tcomm2-t0);
+
+	return 0;
+}
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 
 #define XWIDTH 256
 #define YWIDTH 256
@@ -14,6 +15,9 @@
 	#define swap(mem) (mem)
 #endif
 
+//pixel v as found in memory, swapped if bswap (images kept in the byte order of the file, see plan_byteswap)
+#define pixel(v,bswap) ((bswap) ? (unsigned short int)swap((unsigned short int)(v)) : (unsigned short int)(v))
+
 #define max(a,b) (((a)>(b))?(a):(b))
 #define min(a,b) (((a)<(b))?(a):(b))
 
@@ -21,10 +25,105 @@
 	#define KTYPE float
 #endif
 
+//convolution engines: the one to be used is chosen once per run by plan_kernel (and can be forced through the BLUR_ENGINE environment variable)
+#define ENGINE_DIRECT     0
+#define ENGINE_SEPARABLE  1
+#define ENGINE_BOX        2
+#define ENGINE_WEIGHTED   3
+#define ENGINE_FFT        4
+#define ENGINE_IIR        5
+#define ENGINE_TILED      6
+#define ENGINE_FIXED      7
+#define ENGINE_LOWRANK    8
+#define ENGINE_SPARSE     9
+#define ENGINE_WINOGRAD  10
+
+//custom kernels with at least this many taps go to the FFT engine (can be changed through the BLUR_FFT_TAPS environment variable)
+#define FFT_MIN_TAPS 225
+
+//custom kernels up to this size (per side) are also tried as a sum of a few separable terms (the decomposition costs ~size^3 per sweep)
+#define LOWRANK_MAX_SIZE 255
+
+//custom kernels with at most this fraction of non-zero taps go to the sparse engine (if it would take fewer taps than the FFT engine)
+#define SPARSE_MAX_DENSITY 0.5
+
+//the recursive gaussian (kernel type 4) has infinite support: halos and nominal kernel size extend to IIR_SUPPORT*sigma per side
+#define IIR_SUPPORT 12
+
+//instruction sets for the interior of the direct convolution, chosen once per run through cpuid (can be lowered through the BLUR_SIMD environment variable)
+#define SIMD_SCALAR  0
+#define SIMD_AVX2    1
+#define SIMD_AVX512  2
+
+//symmetries of a kernel, as bit flags: mirrored taps along x (l <-> xconv-1-l) and along y (m <-> yconv-1-m) have the same weight
+#define SYM_X  1
+#define SYM_Y  2
+
+//output rows computed together by Interior_rows (each input line loaded is used for all of them)
+#define ROW_BLOCK  4
+
+//formats of the pixels read and written by the direct and tiled engines: 16bit in the byte order of the machine, 16bit swapped (the one of
+//the file, see plan_byteswap), 8bit (see plan_depth8)
+#define PIX_NATIVE   0
+#define PIX_SWAPPED  1
+#define PIX_BYTE     2
+
+//address of pixel k of the image p, in the format px; format of the pixels of the engine of plan
+#define PIX_AT(p,k,px) ((void *)((char *)(p) + ((px) == PIX_BYTE ? 1 : 2)*(size_t)(k)))
+#define PLAN_PIXELS(plan) ((plan)->depth8 ? PIX_BYTE : (plan)->bswap)
+
+//row kernels of the interior of the direct convolution (see simd.c): n output pixels, from the window starting at in
+typedef void (*row_kernel)(void *in, void *out, int n, int xsize, KTYPE *kernel, int xconv, int yconv);
+
+//everything the convolution engines need to know about the kernel, built once per run by plan_kernel
+typedef struct
+{
+	int ktype;             //kernel type, as given on the command line
+	int engine;            //one of the ENGINE_* above
+	int xconv, yconv;      //kernel dimensions
+	KTYPE *matrix;         //dense kernel (not owned by the plan), NULL for the recursive gaussian
+	KTYPE *xvec, *yvec;    //1D factors such that matrix = xvec (x) yvec, only for separable kernels (NULL otherwise)
+	double *ksum;          //2D prefix sums of matrix, for the renormalization on the borders (see kernel_weight)
+	int boxlike;           //1 if all the weights but the central one are equal (mean and weighted kernels)
+	KTYPE w, f;            //weight of the taps and of the centre of a boxlike kernel
+	KTYPE sigma;           //standard deviation of the recursive gaussian
+	int simd;              //one of the SIMD_* above, used by the direct and tiled engines
+	int symmetry;          //SYM_X | SYM_Y flags of matrix, folded by the direct and tiled engines
+	row_kernel row, rows;  //row kernels for this kernel, a single row and ROW_BLOCK rows (see simd_select)
+	int row_block;         //1 if Interior_rows uses rows, which drops the folding along y, 0 if it calls row ROW_BLOCK times
+	int unroll_x, unroll_y;//kernel width and height they are unrolled for (0 -> any)
+	int bswap;             //1 if the engine reads and writes the pixels in the byte order of the file, swapping them on the fly (see plan_byteswap)
+	int depth8;            //1 if the engine reads and writes the pixels of 8bit images as they are, widening them on the fly (see plan_depth8)
+	int cols_left, cols_right;//columns of halo on the left and right of the lines given to the engine (blocks of BLUR_GRID, 0 otherwise): only
+	                       //read, the pixels blurred there being thrown away, so the border loops of the engines skip them
+	int tile_x, tile_y;    //tile size of the tiled engine (0 -> automatic)
+	int morton;            //1 if the tiles are walked in Morton (Z) order
+	int *qmatrix;          //kernel quantized to integers, matrix ~ qmatrix/2^shift (fixed point engine only, NULL otherwise)
+	long long *qsum;       //2D prefix sums of qmatrix
+	int shift;             //fixed point position of qmatrix
+	double qerror;         //bound on the error due to the quantization, in grey levels
+	int rank;              //number of separable terms kept by the low-rank engine
+	KTYPE kunit;           //weight of one level of the kernel file, i.e. its quantization step (custom kernels only, 0 otherwise)
+	KTYPE *xterms, *yterms;//their 1D factors, rank rows of xconv and yconv weights (custom and low-rank kernels only, NULL otherwise)
+	double lrerror;        //bound on the error due to the terms left out, in grey levels
+	int ntaps;             //number of non-zero taps of matrix
+	int *tap_start;        //the ones of kernel row m are tap_start[m] to tap_start[m+1]-1 in the lists below (yconv+1 entries, NULL for the recursive gaussian)
+	int *tap_l;            //their column in the kernel, increasing along a row
+	KTYPE *tap_w;          //their weight
+	KTYPE *wino;           //transformed kernel of the Winograd engine (3x3 and 5x5 kernels only, NULL otherwise)
+} kernel_plan;
+
 //professors routines for pgm file management 
 void write_pgm_image( void *image, int maxval, int xsize, int ysize, const char *image_name);
 void read_pgm_image( void **image, int *maxval, int *xsize, int *ysize, const char *image_name);
+FILE *read_pgm_header( int *maxval, int *xsize, int *ysize, const char *image_name);
+FILE *write_pgm_header( int maxval, int xsize, int ysize, const char *image_name);
+int read_pgm_buffer( void **image, size_t *capacity, int *maxval, int *xsize, int *ysize, const char *image_name);
+int map_pgm_image( void **map, size_t *length, void **pixels, int *maxval, int *xsize, int *ysize, const char *image_name);
+void unmap_pgm_image( void *map, size_t length );
 void OMP_swap_image( void *image, int xsize, int ysize, int maxval );
+void OMP_widen_image( unsigned short int *wide, const unsigned char *image, int xsize, int ysize, int bswap );
+void OMP_narrow_image( unsigned char *image, const unsigned short int *wide, int xsize, int ysize, int maxval, int bswap );
 void * generate_gradient( int maxval, int xsize, int ysize );
 void * generate_random( int maxval, int xsize, int ysize );
 
@@ -35,12 +134,48 @@ void * generate_random( int maxval, int xsize, int ysize );
 void uniform_kernel(KTYPE *mat, size_t x, size_t y);
 void weighted_kernel(KTYPE *mat, size_t x, size_t y, KTYPE f);
 void gaussian_kernel(KTYPE *mat, size_t x, size_t y, KTYPE sigma_sq);
-KTYPE *normalize(void *kimage,size_t xkernel,size_t ykernel,int maxval);
+KTYPE *normalize(void *kimage,size_t xkernel,size_t ykernel,int maxval,KTYPE *unit);
+int read_kernel_spec(char **argv, int *arg, int last, KTYPE **kernel, int *xkernel, int *ykernel, KTYPE *f, int verbose);
+int plan_kernel(kernel_plan *plan, KTYPE *matrix, int xconv, int yconv, int ktype, KTYPE param);
+int plan_byteswap(kernel_plan *plan);
+int plan_depth8(kernel_plan *plan, int maxval);
+void free_plan(kernel_plan *plan);
+double *kernel_prefix_sums(KTYPE *mat, int x, int y);
+double kernel_weight(double *ksum, int xconv, int l0, int l1, int m0, int m1);
+int quantize_kernel(kernel_plan *plan);
+int kernel_symmetry(KTYPE *mat, int x, int y);
+int lowrank_factors(kernel_plan *plan);
+int sparse_taps(kernel_plan *plan);
+int winograd_kernel(kernel_plan *plan);
+const char *engine_name(int engine);
+int simd_select(kernel_plan *plan, int bswap);
+const char *simd_name(int level);
 
 //Convolution
-//void Convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize,KTYPE *convolution_matrix, int xconv, int yconv, int space_up, int space_down);
-void OMP_Convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, KTYPE *convolution_matrix, int xconv, int yconv); 
+void Border_blur(void *image, void *blurred ,int xsize, int ysize, int i, int j, KTYPE *convolution_matrix, double *ksum, int xconv, int yconv ,int sx, int sy, int lines_up, int lines_down, int px);
+//void Convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize,KTYPE *convolution_matrix, double *ksum, int xconv, int yconv, int space_up, int space_down);
+void OMP_Convolve(void *image, void *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void OMP_Blur(void *image, void *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+
+//engines (!! they contain orphaned OMP directives -> to be used in a parallel region): image holds lines_up and lines_down extra (halo) lines above and below the ysize lines of xsize pixels to be blurred into
+//blurred (lines_up is 0 at the top of the image and lines_down at the bottom, where the borders are renormalized), and blurred holds ysize lines.
+//The pixels are in the byte order of the file if plan->bswap, in the one of the machine otherwise (see plan_byteswap).
+void Separable_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void Box_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void Weighted_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void FFT_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void IIR_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void Tiled_convolve(void *image, void *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void Fixed_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void Lowrank_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void Sparse_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void Winograd_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down);
+void Bank_convolve(void *image, void **blurred, int xsize, int ysize, kernel_plan *plans, int nplans, int lines_up, int lines_down);
 
+//vectorized interior of the direct convolution (one row)
+void Interior_row(void *in, void *out, int n, int xsize, kernel_plan *plan);
+void Interior_rows(void *in, void *out, int n, int xsize, kernel_plan *plan);
+void Sparse_row(unsigned short int *in, unsigned short int *out, int n, int xsize, kernel_plan *plan);
 
 
 
@@ -2,6 +2,484 @@
 #include <string.h>
 #include <time.h>
 #include <omp.h>
+#include <pthread.h>
+
+static int pgm_name(const char *name)
+//1 if name ends in ".pgm"
+{
+	int namelen = strlen(name);
+	return namelen > 4 && !strcmp(&name[namelen-4],".pgm");
+}
+
+static void free_bank(kernel_plan *plans, KTYPE **kernels, KTYPE *fs, int nk)
+//frees the nk kernels of the filter bank and their plans
+{
+	int k;
+
+	for(k=0; k<nk; k++)
+	{
+		free(kernels[k]);
+		free_plan(&plans[k]);
+	}
+	free(kernels);
+	free(fs);
+	free(plans);
+}
+
+static int filter_bank(int args, char **argv)
+/*
+* ./blur bank [kernel-spec] [kernel-spec] ... [input-file] {output-files}: blurs the image with several kernels (types 0 to 3, each
+* spec given as the arguments of a single kernel) in a single pass over it, see Bank_convolve. The output files are either given for
+* every kernel or all named as usual (plus the position of the kernel in the bank).
+*/
+{
+	clock_t t0, tIO, tcalc, twrite;
+	t0=clock();
+
+	char* usage = "Usage: ./blur bank [kernel-spec] [kernel-spec] ... [input-file] {output-files}, each kernel-spec being [kernel-type] {x-kernel-size} {y-kernel-size} {additional-kernel-param} (kernel types 0 to 3)";
+
+	//at most one kernel every two arguments
+	kernel_plan *plans = (kernel_plan *)malloc(sizeof(kernel_plan)*args);
+	KTYPE **kernels = (KTYPE **)malloc(sizeof(KTYPE *)*args), *fs = (KTYPE *)malloc(sizeof(KTYPE)*args);
+	int arg_counter = 1, nk = 0, k;
+
+	/********************
+	 kernels 
+	********************/
+
+	int ktype = 0;
+	while(arg_counter+1 < args && !pgm_name(argv[arg_counter+1]))
+	{
+		int xkernel, ykernel;
+
+		ktype = read_kernel_spec(argv,&arg_counter,args-1,&kernels[nk],&xkernel,&ykernel,&fs[nk],1);
+		if(ktype < 0) break;
+
+		plan_kernel(&plans[nk],kernels[nk],xkernel,ykernel,ktype,fs[nk]);
+
+		//every kernel goes through the tiled engine, which swaps the pixels itself
+		plans[nk].engine = ENGINE_TILED;
+		plan_byteswap(&plans[nk]);
+		nk++;
+	}
+
+	//the specs must be followed by the input file, and possibly by one output file per kernel
+	int nout = args-arg_counter-2;
+	if(ktype < 0 || !nk || arg_counter+1 >= args || (nout && nout != nk))
+	{
+		printf("Wrong arguments for the filter bank. %s\n",usage);
+		free_bank(plans,kernels,fs,nk);
+		return 1;
+	}
+
+	printf("Convolution engine: tiled filter bank of %d kernels\n",nk);
+	//each kernel has its own row kernels (see simd_select)
+	for(k=0; k<nk; k++) printf("Kernel %d interior vectorized with: %s%s%s%s\n",k,simd_name(plans[k].simd),plans[k].unroll_y ? " (unrolled kernel size)" : plans[k].unroll_x ? " (unrolled kernel width)" : "",(const char *[]){"", ", folded along x", ", folded along y", ", folded along x and y"}[plans[k].symmetry],plans[k].row_block ? ", rows in blocks" : "");
+
+	char* input_name = argv[++arg_counter];
+	printf("Trying to blur image \"%s\"\n",input_name);
+
+	/**********************************************************************************************************************
+	*																			  BLURRING - OMP COMMUNICATION
+	**********************************************************************************************************************/
+
+	void *image;
+	int maxval, xsize, ysize;
+
+	read_pgm_image(&image, &maxval, &xsize, &ysize, input_name);
+
+	if(maxval<0)
+	{
+		printf("Could not read image \"%s\".\n",input_name);
+		free_bank(plans,kernels,fs,nk);
+		return 4;
+	}
+
+	tIO = clock();
+
+	//the image is read from memory once for all the kernels, as it is in the file: 16bit pixels in its byte order (see plan_byteswap),
+	//8bit ones widened by the row kernels (see plan_depth8)
+	int depth = 1 + (maxval > 255);
+	void **blurred = (void **)malloc(sizeof(void *)*nk);
+	for(k=0; k<nk; k++)
+	{
+		plan_depth8(&plans[k], maxval);
+		blurred[k] = malloc((size_t)depth*xsize*ysize);
+	}
+
+	#pragma omp parallel
+	Bank_convolve(image, blurred, xsize, ysize, plans, nk, 0, 0);
+
+	free(image);
+
+	tcalc = clock();
+
+	/********************
+	 output 
+	********************/
+
+	input_name[strlen(input_name)-4]='\0';
+	char *out = (char *)malloc(strlen(input_name)+64);
+
+	for(k=0; k<nk; k++)
+	{
+		char *output_name = out;
+
+		if(nout) output_name = argv[++arg_counter];
+		else
+		{
+			char charf[20];
+
+			sprintf(charf,"%e",fs[k]);
+			charf[1] = charf[2];
+			charf[2] = '\0';
+
+			if(plans[k].ktype-1) sprintf(out,"%s.bank%d_%d_%dx%d.omp.pgm",input_name,k,plans[k].ktype,plans[k].xconv,plans[k].yconv);
+			else                 sprintf(out,"%s.bank%d_1_%dx%d_%s.omp.pgm",input_name,k,plans[k].xconv,plans[k].yconv,charf);
+		}
+
+		write_pgm_image(blurred[k], maxval, xsize, ysize, output_name);
+		printf("Blurred image was succesfully stored in the file \"%s\"\n",output_name);
+	}
+
+	for(k=0; k<nk; k++) free(blurred[k]);
+	free(out);
+	free(blurred);
+
+	twrite = clock();
+
+	printf("Walltime timings. Input: %lfs, Calculation (threads avg): %lfs, Output: %lfs. Total: %lfs\n",(double)(tIO-t0)/CLOCKS_PER_SEC,(double)(tcalc-tIO)/CLOCKS_PER_SEC/omp_get_max_threads(),(double)(twrite-tcalc)/CLOCKS_PER_SEC,(double)(twrite-t0)/CLOCKS_PER_SEC);
+
+	free_bank(plans,kernels,fs,nk);
+
+	return 0;
+}
+
+#define BATCH_SLOTS 3  //image buffers of the batch mode: one being read, one being blurred, one being written
+
+//an image of the batch and its buffers, recycled every BATCH_SLOTS images
+typedef struct
+{
+	void *image;                  //input pixels (and output ones of 8bit images narrowed back)
+	void *blurred;                //output pixels
+	unsigned short int *wide;     //input pixels of 8bit images, widened to 16bit for the engines which do not take them as they are
+	void *result;                 //the output pixels to be written: blurred or image
+	size_t capacity, bcapacity, wcapacity;  //bytes allocated for them
+	int maxval, xsize, ysize;
+} batch_slot;
+
+//state shared by the computing threads and the I/O thread of the batch mode
+typedef struct
+{
+	char **names;                 //input files
+	int n;
+	int ktype, xkernel, ykernel;  //for the output file names
+	KTYPE f;
+	int widen8;                   //1 if 8bit images must be widened for the engine (see plan_depth8)
+	batch_slot slot[BATCH_SLOTS];
+	int nread, nblurred;          //images read and blurred so far
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} batch_state;
+
+static void batch_wait(batch_state *b, int *count, int target)
+//waits until *count reaches target
+{
+	pthread_mutex_lock(&b->lock);
+	while(*count < target) pthread_cond_wait(&b->cond,&b->lock);
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void batch_post(batch_state *b, int *count, int value)
+{
+	pthread_mutex_lock(&b->lock);
+	*count = value;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void *batch_io(void *arg)
+/*
+* I/O thread of the batch mode: reads image i while image i-1 is being blurred, then writes image i-1 as soon as it is done. The
+* slot of image i is free by then, since image i-BATCH_SLOTS has been written already.
+*/
+{
+	batch_state *b = (batch_state *)arg;
+	int i;
+
+	for(i=0; i<=b->n; i++)
+	{
+		if(i < b->n)
+		{
+			batch_slot *s = &b->slot[i%BATCH_SLOTS];
+
+			read_pgm_buffer(&s->image, &s->capacity, &s->maxval, &s->xsize, &s->ysize, b->names[i]);
+
+			size_t bytes = sizeof(unsigned short int)*s->xsize*s->ysize;
+			if(s->maxval >= 0 && bytes > s->bcapacity)
+			{
+				free(s->blurred);
+				s->blurred = malloc(bytes);
+				s->bcapacity = bytes;
+			}
+			if(s->maxval >= 0 && s->maxval < 256 && b->widen8 && bytes > s->wcapacity)
+			{
+				free(s->wide);
+				s->wide = (unsigned short int *)malloc(bytes);
+				s->wcapacity = bytes;
+			}
+
+			batch_post(b,&b->nread,i+1);
+		}
+
+		if(i > 0)
+		{
+			batch_slot *s = &b->slot[(i-1)%BATCH_SLOTS];
+			char *input_name = b->names[i-1];
+
+			batch_wait(b,&b->nblurred,i);
+
+			if(s->maxval < 0) { printf("Could not read image \"%s\", skipped\n",input_name); continue; }
+
+			//same names as for a single image
+			char charf[20];
+			char *out = (char *)malloc(strlen(input_name)+64);
+			int namelen = strlen(input_name)-4;
+
+			sprintf(charf,"%e",b->f);
+			charf[1] = charf[2];
+			charf[2] = '\0';
+
+			if(b->ktype-1) sprintf(out,"%.*s.bb_%d_%dx%d.omp.pgm",namelen,input_name,b->ktype,b->xkernel,b->ykernel);
+			else           sprintf(out,"%.*s.bb_1_%dx%d_%s.omp.pgm",namelen,input_name,b->xkernel,b->ykernel,charf);
+
+			write_pgm_image(s->result, s->maxval, s->xsize, s->ysize, out);
+			printf("Blurred image was succesfully stored in the file \"%s\"\n",out);
+			free(out);
+		}
+	}
+
+	return NULL;
+}
+
+static int blur_batch(const char *list_name, kernel_plan *plan, int ktype, int xkernel, int ykernel, KTYPE f)
+/*
+* Batch mode: blurs every image listed in the file list_name (one name per line, each ending in .pgm) with the same kernel, the output
+* files being named as for a single image. The kernel is planned and the thread team spawned once for the whole batch, and the image
+* buffers are recycled through a pool of BATCH_SLOTS: a separate I/O thread reads image i+1 and writes image i-1 while the team blurs
+* image i.
+*/
+{
+	double t0 = omp_get_wtime(), tcalc = 0;
+	FILE *list = fopen(list_name,"r");
+	batch_state b;
+	int i;
+
+	if(list == NULL)
+	{
+		printf("Could not open the list of images \"%s\"\n",list_name);
+		return 4;
+	}
+
+	//names, one per line
+	char *line = NULL;
+	size_t len = 0, allocated = 16;
+	b.names = (char **)malloc(sizeof(char *)*allocated);
+	b.n = 0;
+
+	while(getline(&line,&len,list) > 0)
+	{
+		line[strcspn(line,"\r\n")] = '\0';
+		if(!line[0]) continue;
+
+		int namelen = strlen(line);
+		if(namelen <= 4 || strcmp(&line[namelen-4],".pgm"))
+		{
+			printf("Input file name must end in \".pgm\". Given file name was %s, skipped\n",line);
+			continue;
+		}
+
+		if(b.n == allocated) b.names = (char **)realloc(b.names,sizeof(char *)*(allocated *= 2));
+		b.names[b.n++] = strdup(line);
+	}
+	free(line);
+	fclose(list);
+
+	printf("Trying to blur %d images listed in \"%s\"\n",b.n,list_name);
+
+	b.ktype = ktype;
+	b.xkernel = xkernel;
+	b.ykernel = ykernel;
+	b.f = f;
+	b.widen8 = !plan_depth8(plan,0);
+	b.nread = b.nblurred = 0;
+	for(i=0; i<BATCH_SLOTS; i++)
+	{
+		b.slot[i].image = b.slot[i].blurred = b.slot[i].wide = NULL;
+		b.slot[i].capacity = b.slot[i].bcapacity = b.slot[i].wcapacity = 0;
+	}
+	pthread_mutex_init(&b.lock,NULL);
+	pthread_cond_init(&b.cond,NULL);
+
+	pthread_t io;
+	pthread_create(&io,NULL,batch_io,&b);
+
+	//one team for all the images, the master thread synchronizing with the I/O thread
+	#pragma omp parallel private(i)
+	for(i=0; i<b.n; i++)
+	{
+		batch_slot *s = &b.slot[i%BATCH_SLOTS];
+		double t;
+
+		#pragma omp master
+		{
+			batch_wait(&b,&b.nread,i+1);
+			t = omp_get_wtime();
+
+			//the row kernels follow the depth of each image, the other threads waiting
+			if(s->maxval >= 0) plan_depth8(plan,s->maxval);
+			s->result = s->maxval < 256 && b.widen8 ? s->image : s->blurred;
+		}
+		#pragma omp barrier
+
+		if(s->maxval > 255 || (s->maxval >= 0 && !b.widen8))
+		{
+			if ( s->maxval > 255 && I_M_LITTLE_ENDIAN && !plan->bswap ) OMP_swap_image(s->image, s->xsize, s->ysize, s->maxval);
+
+			OMP_Blur(s->image, s->blurred, s->xsize, s->ysize, plan, 0, 0);
+
+			if ( s->maxval > 255 && I_M_LITTLE_ENDIAN && !plan->bswap ) OMP_swap_image(s->blurred, s->xsize, s->ysize, s->maxval);
+		}
+		else if(s->maxval >= 0)
+		{
+			//8bit: widened for the engine, and the result narrowed back into the input buffer (see main)
+			OMP_widen_image(s->wide, (unsigned char*)s->image, s->xsize, s->ysize, plan->bswap);
+
+			OMP_Blur(s->wide, s->blurred, s->xsize, s->ysize, plan, 0, 0);
+
+			OMP_narrow_image((unsigned char*)s->image, s->blurred, s->xsize, s->ysize, s->maxval, plan->bswap);
+		}
+		#pragma omp barrier
+
+		#pragma omp master
+		{
+			tcalc += omp_get_wtime()-t;
+			batch_post(&b,&b.nblurred,i+1);
+		}
+	}
+
+	pthread_join(io,NULL);
+	pthread_mutex_destroy(&b.lock);
+	pthread_cond_destroy(&b.cond);
+
+	for(i=0; i<BATCH_SLOTS; i++)
+	{
+		free(b.slot[i].image);
+		free(b.slot[i].blurred);
+		free(b.slot[i].wide);
+	}
+	for(i=0; i<b.n; i++) free(b.names[i]);
+	free(b.names);
+
+	double ttot = omp_get_wtime()-t0;
+	printf("Walltime timings. Batch of %d images, Calculation: %lfs (%lfs per image), I/O not overlapped with it: %lfs. Total: %lfs\n",b.n,tcalc,b.n ? tcalc/b.n : 0,ttot-tcalc,ttot);
+
+	return 0;
+}
+
+static int blur_stream(const char *input_name, const char *output_name, kernel_plan *plan, int strip)
+/*
+* Streaming mode: the image is read, blurred and written strip rows at a time, so that only strip+yconv-1 input lines and strip output
+* lines are in memory at once, whatever the size of the image. Each strip is blurred together with the halo lines above and below it, as
+* the bands of the MPI versions are, and the input lines it shares with the next strip are kept in the window. The results are the same
+* as for the whole image, up to +-1 where the vector kernels cut the blocks of rows differently.
+*/
+{
+	double t0 = omp_get_wtime(), tio = 0;
+	int maxval, xsize, ysize;
+	FILE *in = read_pgm_header(&maxval, &xsize, &ysize, input_name), *out;
+
+	if(in == NULL)
+	{
+		printf("Could not read image \"%s\".\n",input_name);
+		return 4;
+	}
+	if((out = write_pgm_header(maxval, xsize, ysize, output_name)) == NULL)
+	{
+		printf("Could not create the file \"%s\".\n",output_name);
+		fclose(in);
+		return 4;
+	}
+
+	//8bit pixels are taken as they are by the direct and tiled engines (see plan_depth8), and widened to 16bit for the others
+	int sy = plan->yconv/2, r0, ok = 1, depth8 = maxval < 256, widen8 = depth8 && !plan_depth8(plan,maxval);
+	size_t line = (depth8 && !widen8 ? 1 : sizeof(unsigned short int))*xsize, fline = depth8 ? xsize : line;
+	strip = min(strip,ysize);
+
+	//input lines first to loaded-1 are in window, fresh the ones just read; the lines of widened 8bit images are read and written through staged
+	char *window = (char *)malloc(line*(strip+2*sy));
+	void *blurred = malloc(line*strip);
+	unsigned char *staged = widen8 ? (unsigned char *)malloc(fline*(strip+2*sy)) : NULL;
+	int first = 0, loaded = 0, fresh = 0;
+
+	printf("Streaming strips of %d rows: %.1f MB in memory instead of %.1f MB\n",strip,(double)(line*(2*strip+2*sy)+(widen8 ? fline*(strip+2*sy) : 0))/(1<<20),(double)(2*line+(widen8 ? fline : 0))*ysize/(1<<20));
+
+	#pragma omp parallel private(r0)
+	for(r0=0; r0<ysize && ok; r0+=strip)
+	{
+		int r1 = min(r0+strip,ysize), lo = max(r0-sy,0), hi = min(r1+sy,ysize);
+
+		#pragma omp single
+		{
+			double t = omp_get_wtime();
+
+			//lines shared with the previous strip to the top of the window, then the new ones below them
+			memmove(window,window+line*(lo-first),line*(loaded-lo));
+			fresh = loaded-lo;
+			if(fread(widen8 ? (void *)staged : (void *)(window+line*fresh),fline,hi-loaded,in) != (size_t)(hi-loaded)) ok = 0;
+			first = lo;
+			loaded = hi;
+
+			tio += omp_get_wtime()-t;
+		}
+
+		if(ok)
+		{
+			if ( widen8 ) OMP_widen_image((unsigned short int *)(window+line*fresh), staged, xsize, hi-lo-fresh, plan->bswap);
+			else if ( !depth8 && I_M_LITTLE_ENDIAN && !plan->bswap ) OMP_swap_image(window+line*fresh, xsize, hi-lo-fresh, maxval);
+
+			OMP_Blur(window, blurred, xsize, r1-r0, plan, r0-lo, hi-r1);
+
+			if ( widen8 ) OMP_narrow_image(staged, blurred, xsize, r1-r0, maxval, plan->bswap);
+			else if ( !depth8 && I_M_LITTLE_ENDIAN && !plan->bswap ) OMP_swap_image(blurred, xsize, r1-r0, maxval);
+		}
+
+		#pragma omp single
+		{
+			double t = omp_get_wtime();
+			if(ok && fwrite(widen8 ? (void *)staged : blurred,fline,r1-r0,out) != (size_t)(r1-r0)) ok = 0;
+			tio += omp_get_wtime()-t;
+		}
+	}
+
+	fclose(in);
+	fclose(out);
+	free(window);
+	free(blurred);
+	free(staged);
+
+	if(!ok)
+	{
+		printf("Could not stream image \"%s\" to \"%s\".\n",input_name,output_name);
+		return 3;
+	}
+
+	double ttot = omp_get_wtime()-t0;
+	printf("Blurred image was succesfully stored in the file \"%s\"\n",output_name);
+	printf("Walltime timings. Input and output: %lfs, Calculation: %lfs. Total: %lfs\n",tio,ttot-tio,ttot);
+
+	return 0;
+}
 
 int main(int args, char** argv)
 {
@@ -14,10 +492,13 @@ int main(int args, char** argv)
 	*																			I/0 MANAGEMENT - INITIALIZATION																								 *
 	*																																																										 *
 	**********************************************************************************************************************/
-	char* usage = "Usage: ./blur [kernel-type] {x-kernel-size} {y-kernel-size} {additional-kernel-param} [input-file] {output-file}";
+	char* usage = "Usage: ./blur [kernel-type] {x-kernel-size} {y-kernel-size} {additional-kernel-param} [input-file or @list-file] {output-file}";
 	#define MAX_ARGS 7
 	#define MIN_ARGS 4
 	
+	//several kernels at once
+	if(args > 1 && !strcmp(argv[1],"bank")) return filter_bank(args,argv);
+	
 	if(args<MIN_ARGS) 
 	{
 		printf("Too few arguments in function blur. %s\n",usage);
@@ -31,12 +512,12 @@ int main(int args, char** argv)
 	
 	int arg_counter = 0;
 	int xkernel,ykernel;
-	KTYPE f, *kernel;
+	KTYPE f = 0, *kernel;
 
 	int ktype = atoi(argv[++arg_counter]);
 	  
 	/************************************************************************************	
-	 kernel choice: 0->"uniform" 1->"weighted" 2->"gaussian" 3->"imported from pgm file"
+	 kernel choice: 0->"uniform" 1->"weighted" 2->"gaussian" 3->"imported from pgm file" 4->"recursive gaussian"
 	*************************************************************************************/
   
 	switch(ktype)
@@ -106,99 +587,182 @@ int main(int args, char** argv)
 			void *kimage;
 			
 			read_pgm_image(&kimage, &kmaxval, &xkernel, &ykernel, argv[++arg_counter]);
-			kernel = normalize(kimage,xkernel,ykernel,kmaxval);
+			if(kmaxval < 0)
+			{
+				printf("Could not read kernel \"%s\".\n",argv[arg_counter]);
+				return 4;
+			}
+			kernel = normalize(kimage,xkernel,ykernel,kmaxval,&f);
 			free(kimage);
 
 		break;
 
+		case 4:
+			if(args > MAX_ARGS-2)
+			{
+				printf("Too many arguments in function blur. Only sigma needed for the recursive gaussian kernel.\n %s\n",usage);
+				return 1;
+			}
+			
+			f = atof(argv[++arg_counter]);
+			if(f < 0.5)
+			{
+				printf("Sigma of the recursive gaussian kernel must be at least 0.5. Given sigma was %f\n",f);
+				return 3;
+			}
+			
+			//no matrix is built: the nominal dimensions are just the support, used for halos and file names
+			xkernel = ykernel = 2*(int)ceil(IIR_SUPPORT*f)+1;
+			kernel = NULL;
+			printf("Using Recursive Gaussian Kernel with sigma = %f (support %dx%d)\n",f,xkernel,ykernel);
+		break;
+
 		default:
-			printf("Kernel id must be either 0,1,2 for automatic generation or 3 for pgm file. Given id was %d",ktype);
+			printf("Kernel id must be either 0,1,2 for automatic generation, 3 for pgm file or 4 for recursive gaussian. Given id was %d",ktype);
 			return 2;
 	}
 	
+	/********************
+	 engine choice 
+	********************/
+	
+	kernel_plan plan;
+	if(plan_kernel(&plan, kernel, xkernel, ykernel, ktype, f)) printf("Requested engine \"%s\" not available for this kernel.\n",getenv("BLUR_ENGINE"));
+
+	//the engine swaps the pixels itself where it can, the image is swapped in memory otherwise (before the report: the row kernels change)
+	plan_byteswap(&plan);
+	
+	printf("Convolution engine: %s\n",engine_name(plan.engine));
+	if((plan.engine == ENGINE_DIRECT || plan.engine == ENGINE_TILED)) printf("Interior vectorized with: %s%s%s%s\n",simd_name(plan.simd),plan.unroll_y ? " (unrolled kernel size)" : plan.unroll_x ? " (unrolled kernel width)" : "",(const char *[]){"", ", folded along x", ", folded along y", ", folded along x and y"}[plan.symmetry],plan.row_block ? ", rows in blocks" : "");
+	if(plan.engine == ENGINE_FIXED) printf("Fixed point weights: shift %d, quantization error below %.3g grey levels\n",plan.shift,plan.qerror);
+	if(plan.engine == ENGINE_LOWRANK) printf("Low-rank kernel: %d separable terms, approximation error below %.3g grey levels\n",plan.rank,plan.lrerror);
+	if(plan.engine == ENGINE_SPARSE) printf("Sparse kernel: %d non-zero taps out of %d\n",plan.ntaps,plan.xconv*plan.yconv);
+	
 	/********************
 	 input name setting 
 	********************/
 	
 	char* input_name = argv[++arg_counter];
 	
+	//batch mode: "@list" stands for the images listed in the file list
+	if(input_name[0] == '@')
+	{
+		int ret = 1;
+		
+		if(args > arg_counter+1) printf("No output file can be given in batch mode, the names are chosen as for a single image.\n");
+		else ret = blur_batch(input_name+1,&plan,ktype,xkernel,ykernel,f);
+		
+		free(kernel);
+		free_plan(&plan);
+		return ret;
+	}
+	
 	int namelen = strlen(input_name);
 	if(namelen > 4 && !strcmp(&input_name[namelen-4],".pgm")) { printf("Trying to blur image \"%s\"\n",input_name); }
 	else
 	{
 		printf("Input file name must end in \".pgm\". Given file name was %s\n",input_name);
 		free(kernel);
+		free_plan(&plan);
 		return 4; //exit
 	}
 	
 	
+	/********************
+	 output name setting 
+	********************/
+
+	char *output_name, out[FILENAME_MAX];
+	if(args > arg_counter+1) output_name = argv[++arg_counter];		
+	else 
+	{
+		char charf[20];
+			
+		sprintf(charf,"%e",f);
+		charf[1] = charf[2];
+		charf[2] = '\0';
+		
+		if(ktype-1) snprintf(out,sizeof(out),"%.*s.bb_%d_%dx%d.omp.pgm",namelen-4,input_name,ktype, xkernel, ykernel);
+		else 				snprintf(out,sizeof(out),"%.*s.bb_1_%dx%d_%s.omp.pgm",namelen-4,input_name, xkernel, ykernel,charf);
+				
+		output_name = out;
+	}
+	
+	//streaming mode: strips of BLUR_STRIP rows at a time
+	char *strip = getenv("BLUR_STRIP");
+	if(strip && atoi(strip) > 0)
+	{
+		int ret = blur_stream(input_name,output_name,&plan,atoi(strip));
+		
+		free(kernel);
+		free_plan(&plan);
+		return ret;
+	}
+	
+	
 	/**********************************************************************************************************************
 	*																																																										  *
 	*																			  BLURRING - OMP COMMUNICATION																								  *
 	*																																																										  *
 	**********************************************************************************************************************/
 
-	void *image; //pointer to be used to store the image 
+	void *map, *image; //mapping of the file, and pointer to be used to store the image 
+	size_t length;
 	int maxval, xsize, ysize; //useful info about image
 	
-	read_pgm_image(&image, &maxval, &xsize, &ysize, input_name);
-	
-	//the following code is structured to work with 16bit images, so it wont work with 8 bits images (yet)
-	if(maxval<255)
+	//the file is mapped (read only), its pages being read from the page cache when first touched (by the threads below)
+	if(map_pgm_image(&map, &length, &image, &maxval, &xsize, &ysize, input_name))
 	{
-		printf("8bit pictures not supported (yet).\n");
+		printf("Could not read image \"%s\".\n",input_name);
 		free(kernel);
-		return 5;
+		free_plan(&plan);
+		return 4;
+	}
+	
+	//...unless the 16bit pixels are to be swapped in memory, or the header has an odd length so that they cannot be used in place as
+	//unsigned shorts: they are then read in a buffer (8bit ones are only read, by the engine or to be widened)
+	if(maxval > 255 && ((I_M_LITTLE_ENDIAN && !plan.bswap) || (size_t)image % sizeof(unsigned short int)))
+	{
+		unmap_pgm_image(map, length);
+		map = NULL;
+		read_pgm_image(&image, &maxval, &xsize, &ysize, input_name);
 	}
 	
 	tIO = clock();
 
-	void *blurred = malloc(xsize*ysize*sizeof(short unsigned int)); 	//piece of memory to memorize the blurred image 
+	//8bit images are read and written as they are by the direct and tiled engines, which widen them on the fly (see plan_depth8); for the
+	//others they are widened to 16bit (and the result narrowed back) in the passes which would swap the bytes of 16bit ones
+	int depth8 = maxval < 256, widen8 = depth8 && !plan_depth8(&plan,maxval);
+	unsigned short int *wide = widen8 ? (unsigned short int *)malloc(xsize*ysize*sizeof(short unsigned int)) : (unsigned short int *)image;
+	void *blurred = malloc((size_t)xsize*ysize*(depth8 && !widen8 ? 1 : sizeof(short unsigned int))); 	//piece of memory to memorize the blurred image 
 	
 	#pragma omp parallel
 	{	
-		//check endianism - eventually swap
-  	if ( I_M_LITTLE_ENDIAN ) OMP_swap_image(image, xsize, ysize, maxval);
+		//check endianism - eventually swap (unless done on the fly by the engine: the mapped file is then read in place)
+		if ( widen8 ) OMP_widen_image(wide, (unsigned char*)image, xsize, ysize, plan.bswap);
+  	else if ( !depth8 && I_M_LITTLE_ENDIAN && !plan.bswap ) OMP_swap_image(image, xsize, ysize, maxval);
 	
-  	OMP_Convolve((unsigned short int*)image, (unsigned short int*)blurred, xsize, ysize ,kernel, xkernel, ykernel);	//actual convolution
+  	OMP_Blur(wide, blurred, xsize, ysize, &plan, 0, 0);	//actual convolution
     
-  	// swap the endianism again
-  	if ( I_M_LITTLE_ENDIAN ) OMP_swap_image(blurred , xsize, ysize, maxval);
+  	// swap the endianism again (the 8bit result goes to the first half of wide, which is not needed anymore)
+		if ( widen8 ) OMP_narrow_image((unsigned char*)wide, (unsigned short int*)blurred, xsize, ysize, maxval, plan.bswap);
+  	else if ( !depth8 && I_M_LITTLE_ENDIAN && !plan.bswap ) OMP_swap_image(blurred , xsize, ysize, maxval);
 	}
 	
 	//free the matrix resources and image vector
   free(kernel);
-  free(image);
+  free_plan(&plan);
+  if(map) unmap_pgm_image(map, length);
+  else free(image);
 
 	tcalc = clock();
 
-	/********************
-	 output name setting 
-	********************/
-
-	char *output_name;
-	if(args > arg_counter+1) output_name = argv[++arg_counter];		
-	else 
-	{
-		input_name[strlen(input_name)-4]='\0';
-		char charf[20];
-		char out[50] = "";
-			
-		sprintf(charf,"%e",f);
-		charf[1] = charf[2];
-		charf[2] = '\0';
-		
-		if(ktype-1) sprintf(out,"%s.bb_%d_%dx%d.omp.pgm",input_name,ktype, xkernel, ykernel);
-		else 				sprintf(out,"%s.bb_1_%dx%d_%s.omp.pgm",input_name, xkernel, ykernel,charf);
-				
-		output_name = out;
-	}
-	
-	write_pgm_image(blurred, maxval, xsize, ysize, output_name);
+	write_pgm_image(widen8 ? (void *)wide : blurred, maxval, xsize, ysize, output_name);
 	printf("Blurred image was succesfully stored in the file \"%s\"\n",output_name);
 	
 	twrite = clock();
 	//free other resources
+	if(widen8) free(wide);
 	free(blurred);
 	
 	printf("Walltime timings. Input: %lfs, Calculation (threads avg): %lfs, Output: %lfs. Total: %lfs\n",(double)(tIO-t0)/CLOCKS_PER_SEC,(double)(tcalc-tIO)/CLOCKS_PER_SEC/omp_get_max_threads(),(double)(twrite-tcalc)/CLOCKS_PER_SEC,(double)(twrite-t0)/CLOCKS_PER_SEC);
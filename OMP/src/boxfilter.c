@@ -0,0 +1,111 @@
+#include "ut.h"
+
+// =============================================================
+//  box filter engines
+//
+//  * Box_convolve
+//  * Weighted_convolve
+//
+//  For a kernel with all the weights equal (mean kernel) the blurred value is just the sum of the pixels in a rectangle divided by
+//  their number, whatever the kernel size. The sums come from a summed-area table (integral image) of the lines held, so each pixel
+//  costs 4 lookups: sat[j][i] is the sum of all the pixels above and on the left of (i,j), excluded.
+//  The weighted kernel has a constant weight w everywhere but in the centre, where it is f: then the blurred value is
+//  w*boxsum + (f-w)*centre, and the same table serves.
+//
+//  Border effect: Border_blur divides by the sum of the weights falling inside the image. For constant weights this means dividing
+//  by the number of in-image taps n (the rectangle is simply clipped to the lines held and to the image width), for the weighted
+//  kernel by w*n + (f-w), since the centre is always inside. The table is built in integer arithmetic, hence the sums are exact.
+// =============================================================
+
+#define SAT_BLOCK 256  //columns handled together while accumulating the table along y
+
+static void Box_engine(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, int sx, int sy, KTYPE w, KTYPE f, int lines_up, int lines_down)
+/*
+* The summed-area table covers the halo lines too, so that the prefix sums of each band already account for its neighbours.
+* w is the weight of the taps, f the one of the centre (f == w for the mean kernel).
+*
+* !! This function contains orphaned OMP directives -> to be used in a parallel region
+*/
+{
+	//summed-area table (static -> shared among the threads, if any)
+	static unsigned long long int *sat;
+
+	//total number of lines held in image, and row length of the table
+	int nrows = ysize + lines_up + lines_down;
+	size_t rowlen = xsize+1;
+	int i,j,b;
+
+	#pragma omp single
+	{
+		sat = (unsigned long long int *)malloc(sizeof(unsigned long long int)*rowlen*(nrows+1));
+		for(i=0; i<=xsize; i++) sat[i] = 0;
+	}
+
+	//PREFIX SUMS ALONG X -> line j of the image goes into line j+1 of the table
+
+	#pragma omp for
+	for(j=0; j<nrows; j++)
+	{
+		unsigned short int *in = image + (size_t)xsize*j;
+		unsigned long long int *s = sat + rowlen*(j+1);
+
+		s[0] = 0;
+		for(i=0; i<xsize; i++) s[i+1] = s[i] + in[i];
+	}
+
+	//PREFIX SUMS ALONG Y -> sequential in j, so the work is split among blocks of columns
+
+	#pragma omp for
+	for(b=0; b<=xsize; b+=SAT_BLOCK)
+	{
+		int blim = min(b+SAT_BLOCK,xsize+1);
+
+		for(j=1; j<=nrows; j++)
+			for(i=b; i<blim; i++) sat[rowlen*j+i] += sat[rowlen*(j-1)+i];
+	}
+
+	//BOX SUMS -> rectangle clipped to the lines held (same limits as in Border_blur) and to the image width
+
+	#pragma omp for
+	for(j=0; j<ysize; j++)
+	{
+		int r0 = max(j+lines_up-sy,0), r1 = min(j+lines_up+sy+1,nrows);
+		unsigned long long int *top = sat + rowlen*r0, *bottom = sat + rowlen*r1;
+		unsigned short int *centre = image + (size_t)xsize*(j+lines_up);
+
+		for(i=0; i<xsize; i++)
+		{
+			int c0 = max(i-sx,0), c1 = min(i+sx+1,xsize);
+			unsigned long long int sum = bottom[c1] - bottom[c0] - top[c1] + top[c0];
+			int n = (r1-r0)*(c1-c0);
+
+			if(f == w) blurred[i+xsize*j] = (double)sum/n + 0.5;
+			else       blurred[i+xsize*j] = (w*(double)sum + (f-w)*centre[i])/((double)w*n + (f-w)) + 0.5;
+		}
+	}
+
+	#pragma omp single
+	free(sat);
+
+	return;
+}
+
+void Box_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+/*
+* mean kernel
+*
+* !! This function contains orphaned OMP directives -> to be used in a parallel region
+*/
+{
+	Box_engine(image,blurred,xsize,ysize,plan->xconv/2,plan->yconv/2,plan->w,plan->w,lines_up,lines_down);
+}
+
+void Weighted_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+/*
+* weighted kernel (constant weights but the centre)
+*
+* !! This function contains orphaned OMP directives -> to be used in a parallel region
+*/
+{
+	Box_engine(image,blurred,xsize,ysize,plan->xconv/2,plan->yconv/2,plan->w,plan->f,lines_up,lines_down);
+}
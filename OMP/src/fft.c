@@ -0,0 +1,257 @@
+#include "ut.h"
+
+// =============================================================
+//  FFT convolution engine
+//
+//  * FFT_convolve
+//
+//  The image is cut into tiles of whole rows, which are convolved in the frequency domain with the (flipped) kernel by means of
+//  an in-tree radix-2 FFT (overlap-save along y): a tile of T rows gives T-(yconv-1) output rows, the first yconv-1 being spoiled
+//  by the wrap-around. Along x the rows are padded with zeros up to a power of two W >= xsize+xconv/2, so no wrap-around occurs there.
+//  Memory is bounded by two T*W complex arrays (tile and kernel spectrum) whatever the image size.
+//
+//  The kernel is real, hence two tiles are transformed at once, one in the real and one in the imaginary part of the data.
+//  Transforms are parallelized among threads row by row and column by column.
+//
+//  Border effect: outside the lines held the tile is padded with zeros, so the result is the numerator of Border_blur; the
+//  denominator (the sum of the kernel taps falling inside the image) comes from the 2D prefix sums of the kernel in the plan. The FFT is done in
+//  double precision: its relative error is ~1e-15*log2(T*W), far below the rounding to integers, so the output matches the direct
+//  engine within +-1 grey level (only where the exact value is within ~1e-3 of a .5).
+// =============================================================
+
+#define FFT_MIN_ROWS  64   //minimum tile height
+#define FFT_COLS      8    //columns transformed together by each thread
+
+static void fft(double *a, int n, double *tw, int sign)
+/*
+* in place iterative radix-2 FFT of the n (power of 2) complex numbers stored as (re,im) pairs in a.
+* tw holds exp(-2 pi i k/n) for k<n/2; sign is 1 for the forward transform and -1 for the (unnormalized) backward one.
+*/
+{
+	int i,j,k,len,bit;
+	double t;
+
+	//bit reversal permutation
+	for(i=1, j=0; i<n; i++)
+	{
+		for(bit=n>>1; j&bit; bit>>=1) j ^= bit;
+		j ^= bit;
+
+		if(i < j)
+		{
+			t = a[2*i];   a[2*i]   = a[2*j];   a[2*j]   = t;
+			t = a[2*i+1]; a[2*i+1] = a[2*j+1]; a[2*j+1] = t;
+		}
+	}
+
+	//butterflies
+	for(len=2; len<=n; len<<=1)
+	{
+		int half = len/2, step = n/len;
+
+		for(i=0; i<n; i+=len)
+			for(k=0; k<half; k++)
+			{
+				double wr = tw[2*k*step], wi = sign*tw[2*k*step+1];
+				double *u = a + 2*(i+k), *v = a + 2*(i+k+half);
+				double vr = v[0]*wr - v[1]*wi, vi = v[0]*wi + v[1]*wr;
+
+				v[0] = u[0] - vr; v[1] = u[1] - vi;
+				u[0] += vr;       u[1] += vi;
+			}
+	}
+}
+
+static double *twiddles(int n)
+{
+	int k;
+	double *tw = (double *)malloc(sizeof(double)*n);
+
+	for(k=0; k<n/2; k++)
+	{
+		tw[2*k]   =  cos(2*M_PI*k/n);
+		tw[2*k+1] = -sin(2*M_PI*k/n);
+	}
+	return tw;
+}
+
+static int pow2(int n)
+{
+	int p = 1;
+	while(p < n) p <<= 1;
+	return p;
+}
+
+static void Fft2d_columns(double *data, double *spectrum, int T, int W, int first, double *twT)
+/*
+* Column part of the convolution of data (T x W complex) : forward transform of the columns, product by spectrum, backward transform.
+* Only the rows from first on are written back, the other ones being discarded by the overlap-save anyway.
+*
+* !! This function contains orphaned OMP directives -> to be used in a parallel region
+*/
+{
+	int b,c,t;
+	double *col = (double *)malloc(sizeof(double)*2*T*FFT_COLS);
+
+	#pragma omp for
+	for(b=0; b<W; b+=FFT_COLS)
+	{
+		int nc = min(FFT_COLS,W-b);
+
+		for(t=0; t<T; t++)
+			for(c=0; c<nc; c++)
+			{
+				col[2*(c*T+t)]   = data[2*((size_t)W*t+b+c)];
+				col[2*(c*T+t)+1] = data[2*((size_t)W*t+b+c)+1];
+			}
+
+		for(c=0; c<nc; c++)
+		{
+			double *a = col + 2*c*T;
+
+			fft(a,T,twT,1);
+
+			for(t=0; t<T; t++)
+			{
+				double *s = spectrum + 2*((size_t)W*t+b+c);
+				double re = a[2*t]*s[0] - a[2*t+1]*s[1], im = a[2*t]*s[1] + a[2*t+1]*s[0];
+
+				a[2*t] = re; a[2*t+1] = im;
+			}
+
+			fft(a,T,twT,-1);
+		}
+
+		for(t=first; t<T; t++)
+			for(c=0; c<nc; c++)
+			{
+				data[2*((size_t)W*t+b+c)]   = col[2*(c*T+t)];
+				data[2*((size_t)W*t+b+c)+1] = col[2*(c*T+t)+1];
+			}
+	}
+
+	free(col);
+}
+
+void FFT_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+//!! This function contains orphaned OMP directives -> to be used in a parallel region
+{
+	//shared among the threads (if any): tile pair being transformed, kernel spectrum, twiddle factors
+	static double *data, *spectrum, *twW, *twT;
+
+	KTYPE *kernel = plan->matrix;
+	int xconv = plan->xconv, yconv = plan->yconv;
+	int sx = xconv/2, sy = yconv/2;
+	int nrows = ysize + lines_up + lines_down;
+
+	//tile geometry: T rows in, V rows out, W columns
+	int W = pow2(xsize+sx);
+	int T = min(pow2(max(4*(yconv-1),FFT_MIN_ROWS)),pow2(max(ysize,1)+yconv-1));
+	int V = T-(yconv-1);
+	int ntiles = (ysize+V-1)/V;
+	double scale = 1.0/((double)T*W);
+
+	int i,j,t,l,m,k;
+
+	#pragma omp single
+	{
+		data = (double *)malloc(sizeof(double)*2*T*W);
+		spectrum = (double *)calloc((size_t)2*T*W,sizeof(double));
+		twW = twiddles(W);
+		twT = twiddles(T);
+
+		//flipped kernel, so that the convolution gives the correlation done by Border_blur
+		for(m=0; m<yconv; m++)
+			for(l=0; l<xconv; l++) spectrum[2*((size_t)W*m+l)] = kernel[(xconv-1-l)+xconv*(yconv-1-m)];
+	}
+
+	//KERNEL SPECTRUM -> rows, then columns
+
+	#pragma omp for
+	for(m=0; m<yconv; m++) fft(spectrum+2*(size_t)W*m,W,twW,1);
+
+	#pragma omp for
+	for(i=0; i<W; i+=FFT_COLS)
+	{
+		int c;
+		double *col = (double *)malloc(sizeof(double)*2*T);
+
+		for(c=i; c<min(i+FFT_COLS,W); c++)
+		{
+			for(t=0; t<T; t++) { col[2*t] = spectrum[2*((size_t)W*t+c)]; col[2*t+1] = spectrum[2*((size_t)W*t+c)+1]; }
+			fft(col,T,twT,1);
+			for(t=0; t<T; t++) { spectrum[2*((size_t)W*t+c)] = col[2*t]; spectrum[2*((size_t)W*t+c)+1] = col[2*t+1]; }
+		}
+		free(col);
+	}
+
+	//TILES -> two at a time, tile k in the real part and tile k+1 in the imaginary one
+
+	for(k=0; k<ntiles; k+=2)
+	{
+		//first line held (may be negative, i.e. outside) of the two tiles
+		int r0[2] = {k*V+lines_up-sy, (k+1)*V+lines_up-sy};
+
+		#pragma omp for
+		for(t=0; t<T; t++)
+		{
+			double *row = data + 2*(size_t)W*t;
+			int p;
+
+			for(i=0; i<2*W; i++) row[i] = 0;
+
+			for(p=0; p<2; p++)
+				if(k+p < ntiles && r0[p]+t >= 0 && r0[p]+t < nrows)
+				{
+					unsigned short int *in = image + (size_t)xsize*(r0[p]+t);
+					for(i=0; i<xsize; i++) row[2*i+p] = in[i];
+				}
+
+			fft(row,W,twW,1);
+		}
+
+		Fft2d_columns(data,spectrum,T,W,yconv-1,twT);
+
+		#pragma omp for
+		for(t=yconv-1; t<T; t++)
+		{
+			double *row = data + 2*(size_t)W*t;
+			int p;
+
+			fft(row,W,twW,-1);
+
+			for(p=0; p<2; p++)
+			{
+				//output line of this row of the tile
+				j = (k+p)*V + t-(yconv-1);
+				if(k+p >= ntiles || j >= ysize) continue;
+
+				//same limits as in Border_blur
+				int c = j+lines_up;
+				int m0 = max(sy-c,0), m1 = min(yconv,nrows-c+sy);
+
+				for(i=0; i<xsize; i++)
+				{
+					double value = row[2*(i+sx)+p]*scale;
+					int l0 = max(sx-i,0), l1 = min(xconv,xsize-i+sx);
+
+					//renormalization is needed only if part of the kernel has been cut away
+					if(m0 || l0 || m1 < yconv || l1 < xconv)
+						value /= kernel_weight(plan->ksum,xconv,l0,l1,m0,m1);
+
+					blurred[i+(size_t)xsize*j] = min(max(value+0.5,0),MAXVAL);
+				}
+			}
+		}
+	}
+
+	#pragma omp single
+	{
+		free(data);
+		free(spectrum);
+		free(twW);
+		free(twT);
+	}
+
+	return;
+}
@@ -0,0 +1,181 @@
+#include "ut.h"
+
+// =============================================================
+//  fixed point convolution engine
+//
+//  * quantize_kernel
+//  * Fixed_convolve
+//
+//  The kernel is quantized once per run to integer weights q = round(w/W*2^shift), W being the sum of the weights (1 up to the float
+//  rounding of the kernel generation), the residue being added to the centre so that the weights sum exactly to 2^shift: an interior pixel is then sum(q*pixel) >> shift (rounded), computed in 64-bit integers
+//  from 32-bit weights. The shift is the smallest one making the quantization error negligible, within the 32-bit range of the weights.
+//  All the arithmetic is exact, so the result does not depend on the number of threads or processes, nor on the order of the sums.
+//
+//  Error: with pixels at most MAXVAL, the interior result differs from the one with the real weights by at most
+//  qerror = MAXVAL*sum|q/2^shift - w/W| grey levels before rounding (printed at startup). Each weight is rounded to 1/2^(shift+1)
+//  and the residue on the centre is at most as much in total, so qerror <= MAXVAL*taps/2^shift <= 1/64 unless the shift had to be
+//  lowered to keep the weights in range: after rounding the result is within one grey level of the exact one, and it differs from
+//  the float engines only where the exact value is within ~1/64 of a .5. Note that 32-bit accumulators would only allow a shift of
+//  15 for 16-bit pixels, that is an error up to the number of taps: the accumulators are 64-bit for this reason (the sums stay
+//  below MAXVAL*2^shift, far from their range).
+//
+//  Border effect: as in Border_blur, the sum is divided by the weight of the taps inside the image, here the sum of the quantized
+//  ones (from their 2D prefix sums), with an integer rounding division.
+// =============================================================
+
+#define FIXED_BLOCK 64  //interior pixels accumulated together
+
+int quantize_kernel(kernel_plan *plan)
+/*
+* Fills qmatrix, qsum, shift and qerror of plan from its matrix. Returns the shift.
+*/
+{
+	int n = plan->xconv*plan->yconv, centre = plan->xconv/2 + plan->xconv*(plan->yconv/2);
+	int e,l,m;
+	double big = 0, W = 0;
+	long long total = 0;
+
+	for(e=0; e<n; e++)
+	{
+		big = max(big,fabs(plan->matrix[e]));
+		W += plan->matrix[e];
+	}
+	big /= W;
+
+	//error bound ~ MAXVAL*n/2^shift -> aim at 1/64 of a level, keeping the weights within 2^30 in absolute value
+	plan->shift = (int)ceil(log2(64.0*MAXVAL*n));
+	while(plan->shift > 0 && big*ldexp(1,plan->shift) > (1<<30)) plan->shift--;
+
+	//zeroed, or gcc cannot tell that the centre is written by the loop before the residue is added to it
+	plan->qmatrix = (int *)calloc(n,sizeof(int));
+	for(e=0; e<n; e++)
+	{
+		plan->qmatrix[e] = (int)llround(ldexp(plan->matrix[e]/W,plan->shift));
+		total += plan->qmatrix[e];
+	}
+	plan->qmatrix[centre] += (1LL << plan->shift) - total;
+
+	plan->qerror = 0;
+	for(e=0; e<n; e++) plan->qerror += fabs(ldexp(plan->qmatrix[e],-plan->shift) - plan->matrix[e]/W);
+	plan->qerror *= MAXVAL;
+
+	//same layout as kernel_prefix_sums
+	plan->qsum = (long long *)calloc((size_t)(plan->xconv+1)*(plan->yconv+1),sizeof(long long));
+	for(m=0; m<plan->yconv; m++)
+		for(l=0; l<plan->xconv; l++)
+			plan->qsum[(l+1)+(plan->xconv+1)*(m+1)] = plan->qmatrix[l+plan->xconv*m] + plan->qsum[l+(plan->xconv+1)*(m+1)]
+			                                        + plan->qsum[(l+1)+(plan->xconv+1)*m] - plan->qsum[l+(plan->xconv+1)*m];
+
+	return plan->shift;
+}
+
+static unsigned short int fixed_border(unsigned short int *image, int xsize, int i, int row, kernel_plan *plan, int l0, int l1, int m0, int m1)
+//clipped sum for the pixel (i, line row of image) with the kernel taps l0 <= l < l1, m0 <= m < m1, renormalized
+{
+	int xconv = plan->xconv, sx = xconv/2, sy = plan->yconv/2;
+	long long *qsum = plan->qsum;
+	long long acc = 0, weight = qsum[l1+(xconv+1)*m1] - qsum[l0+(xconv+1)*m1] - qsum[l1+(xconv+1)*m0] + qsum[l0+(xconv+1)*m0];
+	int l,m;
+
+	for(m=m0; m<m1; m++)
+	{
+		unsigned short int *in = image + (size_t)xsize*(row-sy+m);
+		int *q = plan->qmatrix + xconv*m;
+
+		for(l=l0; l<l1; l++) acc += (long long)in[i-sx+l]*q[l];
+	}
+
+	if(acc <= 0 || weight <= 0) return 0;
+	return min((acc + weight/2)/weight,MAXVAL);
+}
+
+static inline __attribute__((always_inline)) void fixed_block(unsigned short int *in, unsigned short int *out, int nc, int xsize, int *qmatrix, int xconv, int yconv, int shift)
+/*
+* nc <= FIXED_BLOCK interior pixels, in points to the top left corner of the window of the first one: each weight is multiplied by the
+* whole block at once (32 x 32 -> 64 bit products). Instanced below for each instruction set.
+*/
+{
+	long long acc[FIXED_BLOCK], half = (1LL << shift) >> 1;
+	int l,m,c;
+
+	for(c=0; c<nc; c++) acc[c] = 0;
+
+	for(m=0; m<yconv; m++)
+	{
+		unsigned short int *p = in + (size_t)xsize*m;
+		int *q = qmatrix + xconv*m;
+
+		for(l=0; l<xconv; l++)
+		{
+			int w = q[l];
+
+			#pragma omp simd
+			for(c=0; c<nc; c++) acc[c] += (long long)(int)p[l+c]*w;
+		}
+	}
+
+	for(c=0; c<nc; c++) out[c] = acc[c] <= 0 ? 0 : min((acc[c] + half) >> shift,MAXVAL);
+}
+
+//one instance per instruction set, chosen through the simd level of the plan (see simd_select) as the row kernels
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define FIXED_TARGET(t) __attribute__((target(t)))
+#	define FIXED_LEVELS(f) {f##_scalar, f##_avx2, f##_avx512}
+#else
+#	define FIXED_TARGET(t)
+#	define FIXED_LEVELS(f) {f##_scalar, f##_scalar, f##_scalar}
+#endif
+
+#define FIXED_BLOCK_AT(suffix,target) \
+	target static void fixed_block##suffix(unsigned short int *in, unsigned short int *out, int nc, int xsize, int *qmatrix, int xconv, int yconv, int shift) \
+	{ fixed_block(in,out,nc,xsize,qmatrix,xconv,yconv,shift); }
+
+typedef void (*fixed_kernel)(unsigned short int *in, unsigned short int *out, int nc, int xsize, int *qmatrix, int xconv, int yconv, int shift);
+
+FIXED_BLOCK_AT(_scalar,)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+FIXED_BLOCK_AT(_avx2,FIXED_TARGET("avx2"))
+FIXED_BLOCK_AT(_avx512,FIXED_TARGET("avx512f,avx512dq"))
+#endif
+
+static const fixed_kernel fixed_kernels[SIMD_AVX512+1] = FIXED_LEVELS(fixed_block);
+
+void Fixed_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+//!! This function contains orphaned OMP directives -> to be used in a parallel region
+{
+	int xconv = plan->xconv, yconv = plan->yconv;
+	int sx = xconv/2, sy = yconv/2, shift = plan->shift;
+	int nrows = ysize + lines_up + lines_down;
+	int c0 = plan->cols_left, c1 = xsize-plan->cols_right;  //the halo columns are skipped (see cols_left)
+	int level = plan->simd;
+	int i,j;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	//the AVX-512 instance wants the 64-bit multiplies of AVX512DQ, without them the AVX2 one is faster
+	if(level == SIMD_AVX512 && !__builtin_cpu_supports("avx512dq")) level = SIMD_AVX2;
+#endif
+	fixed_kernel block = fixed_kernels[level];
+
+	#pragma omp for
+	for(j=0; j<ysize; j++)
+	{
+		//line of image under the centre of the kernel, and kernel rows falling inside the lines held (same limits as in Border_blur)
+		int row = j+lines_up;
+		int m0 = max(sy-row,0), m1 = min(yconv,nrows-row+sy);
+		int i0 = sx, i1 = xsize-sx;
+
+		//the whole line is on the border if some kernel rows are cut away
+		if(m0 > 0 || m1 < yconv) i0 = i1 = xsize;
+		i0 = min(i0,xsize);
+		i1 = max(i1,i0);
+
+		for(i=c0; i<min(i0,c1); i++) blurred[i+(size_t)xsize*j] = fixed_border(image,xsize,i,row,plan,max(sx-i,0),min(xconv,xsize-i+sx),m0,m1);
+		for(i=i1; i<c1; i++) blurred[i+(size_t)xsize*j] = fixed_border(image,xsize,i,row,plan,max(sx-i,0),min(xconv,xsize-i+sx),m0,m1);
+
+		//NON BORDER PART -> FIXED_BLOCK pixels at a time
+		for(i=i0; i<i1; i+=FIXED_BLOCK)
+			block(image+(i-sx)+(size_t)xsize*(row-sy),blurred+i+(size_t)xsize*j,min(FIXED_BLOCK,i1-i),xsize,plan->qmatrix,xconv,yconv,shift);
+	}
+
+	return;
+}
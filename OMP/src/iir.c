@@ -0,0 +1,184 @@
+#include "ut.h"
+#include <complex.h>
+
+// =============================================================
+//  recursive gaussian engine
+//
+//  * IIR_convolve
+//
+//  Gaussian blur done with the recursive (IIR) filter of van Vliet, Young and Verbeek: a third order causal pass followed by an
+//  anticausal one, along x and then along y. The poles are the ones optimized for sigma = 2 (max norm), rescaled to the requested
+//  sigma so that the variance of the filter matches exactly: the impulse response is within ~2% of the peak from the true gaussian.
+//  The cost is a fixed number of operations per pixel, whatever sigma, and no kernel matrix is ever built. The horizontal pass
+//  works on independent rows, the vertical one on independent blocks of columns, walked row by row so that memory is accessed
+//  contiguously.
+//
+//  Border effect: the filter is started with zero states, i.e. as if the image were surrounded by zeros. The very same filter
+//  applied to a line of ones gives the weight of the taps falling inside the image, which is what Border_blur divides by: hence the
+//  result is renormalized by it (in the interior this also corrects the small gain error of the recursive approximation).
+//
+//  Halo policy (MPI): the impulse response has infinite support, but each band receives IIR_SUPPORT*sigma halo lines per side
+//  (the nominal kernel size is set accordingly) and is renormalized at its cut like at an image border. The weight of the
+//  response beyond 12 sigma is below 1e-6 of the total for sigma >= 1.5 (5e-6 at sigma 1, the poles being fitted for sigma 2),
+//  which bounds the difference from a single process run near the cuts to that fraction of the grey levels range: at most one
+//  level after rounding, as measured for sigma 1 to 6 on 2 to 4 bands or blocks (BLUR_GRID), where 8 sigma (~5e-5 left out) gave up to 3.
+// =============================================================
+
+#define IIR_COLS 64  //columns filtered together in the vertical pass
+
+static void yvv_coefficients(double sigma, double *B, double *b)
+/*
+* B is the gain, b[0..2] the feedback coefficients of the recursion w[n] = B*x[n] + b[0]*w[n-1] + b[1]*w[n-2] + b[2]*w[n-3].
+* The poles d are rescaled as d^(1/q), where q is found by bisection imposing that the variance of the filter, sum of 2d/(d-1)^2
+* over the poles, equals sigma^2.
+*/
+{
+	double complex d[3] = {1.40098 + 1.00236*I, 1.40098 - 1.00236*I, 1.85132};
+	double complex p[3];
+	double lo = 1e-3, hi = 1e4, q = 1, var;
+	int it,k;
+
+	for(it=0; it<100; it++)
+	{
+		q = 0.5*(lo+hi);
+		for(var=0, k=0; k<3; k++)
+		{
+			double complex dq = cpow(d[k],1.0/q);
+			var += creal(2*dq/((dq-1)*(dq-1)));
+		}
+		if(var < sigma*sigma) lo = q;
+		else hi = q;
+	}
+
+	for(k=0; k<3; k++) p[k] = 1.0/cpow(d[k],1.0/q);
+
+	//(1 - p0/z)(1 - p1/z)(1 - p2/z) = 1 - b[0]/z - b[1]/z^2 - b[2]/z^3, unit gain at zero frequency
+	b[0] = creal(p[0] + p[1] + p[2]);
+	b[1] = -creal(p[0]*p[1] + p[0]*p[2] + p[1]*p[2]);
+	b[2] = creal(p[0]*p[1]*p[2]);
+	*B = 1 - (b[0] + b[1] + b[2]);
+}
+
+static void yvv_line(KTYPE *x, int n, double B, double *b)
+//causal and anticausal pass, in place, over a contiguous line
+{
+	int k;
+	double w1 = 0, w2 = 0, w3 = 0, w;
+
+	for(k=0; k<n; k++)
+	{
+		w = B*x[k] + b[0]*w1 + b[1]*w2 + b[2]*w3;
+		w3 = w2; w2 = w1; w1 = w;
+		x[k] = w;
+	}
+
+	w1 = w2 = w3 = 0;
+	for(k=n-1; k>=0; k--)
+	{
+		w = B*x[k] + b[0]*w1 + b[1]*w2 + b[2]*w3;
+		w3 = w2; w2 = w1; w1 = w;
+		x[k] = w;
+	}
+}
+
+static double *yvv_norm(int n, double B, double *b)
+//response of the filter to a line of n ones, i.e. the weight of the in-image taps
+{
+	int k;
+	KTYPE *ones = (KTYPE *)malloc(sizeof(KTYPE)*n);
+	double *norm = (double *)malloc(sizeof(double)*n);
+
+	for(k=0; k<n; k++) ones[k] = 1;
+	yvv_line(ones,n,B,b);
+	for(k=0; k<n; k++) norm[k] = ones[k];
+
+	free(ones);
+	return norm;
+}
+
+void IIR_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+//!! This function contains orphaned OMP directives -> to be used in a parallel region
+{
+	//shared among the threads (if any): filtered image, weights of the in-image taps along x and y
+	static KTYPE *buf;
+	static double *xnorm, *ynorm;
+
+	int nrows = ysize + lines_up + lines_down;
+	double B, b[3];
+	int i,j,c,k;
+
+	yvv_coefficients(plan->sigma,&B,b);
+
+	#pragma omp single
+	{
+		buf = (KTYPE *)malloc(sizeof(KTYPE)*xsize*nrows);
+		xnorm = yvv_norm(xsize,B,b);
+		ynorm = yvv_norm(nrows,B,b);
+	}
+
+	//HORIZONTAL PASS -> independent rows, every line held is needed, halo included
+
+	#pragma omp for
+	for(j=0; j<nrows; j++)
+	{
+		KTYPE *row = buf + (size_t)xsize*j;
+		unsigned short int *in = image + (size_t)xsize*j;
+
+		for(i=0; i<xsize; i++) row[i] = in[i];
+		yvv_line(row,xsize,B,b);
+	}
+
+	//VERTICAL PASS -> independent blocks of columns, each filtered a row at a time
+
+	#pragma omp for
+	for(c=0; c<xsize; c+=IIR_COLS)
+	{
+		int nc = min(IIR_COLS,xsize-c);
+		double w1[IIR_COLS], w2[IIR_COLS], w3[IIR_COLS];
+
+		for(i=0; i<nc; i++) w1[i] = w2[i] = w3[i] = 0;
+		for(k=0; k<nrows; k++)
+		{
+			KTYPE *x = buf + (size_t)xsize*k + c;
+
+			for(i=0; i<nc; i++)
+			{
+				double w = B*x[i] + b[0]*w1[i] + b[1]*w2[i] + b[2]*w3[i];
+				w3[i] = w2[i]; w2[i] = w1[i]; w1[i] = w;
+				x[i] = w;
+			}
+		}
+
+		for(i=0; i<nc; i++) w1[i] = w2[i] = w3[i] = 0;
+		for(k=nrows-1; k>=0; k--)
+		{
+			KTYPE *x = buf + (size_t)xsize*k + c;
+
+			for(i=0; i<nc; i++)
+			{
+				double w = B*x[i] + b[0]*w1[i] + b[1]*w2[i] + b[2]*w3[i];
+				w3[i] = w2[i]; w2[i] = w1[i]; w1[i] = w;
+				x[i] = w;
+			}
+		}
+	}
+
+	//RENORMALIZATION -> only the ysize lines to be blurred
+
+	#pragma omp for
+	for(j=0; j<ysize; j++)
+	{
+		KTYPE *row = buf + (size_t)xsize*(j+lines_up);
+
+		for(i=0; i<xsize; i++) blurred[i+(size_t)xsize*j] = min(max(row[i]/(xnorm[i]*ynorm[j+lines_up]) + 0.5,0),MAXVAL);
+	}
+
+	#pragma omp single
+	{
+		free(buf);
+		free(xnorm);
+		free(ynorm);
+	}
+
+	return;
+}
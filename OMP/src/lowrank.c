@@ -0,0 +1,236 @@
+#include "ut.h"
+
+// =============================================================
+//  low-rank convolution engine
+//
+//  * lowrank_factors
+//  * Lowrank_convolve
+//
+//  Any kernel K (yconv x xconv) is a sum of rank-1 terms, K = sum_k s_k u_k v_k^T, from its singular value decomposition (done
+//  once per run by an in-tree one-sided Jacobi SVD, in double precision). Keeping the first r terms, the image is convolved with r
+//  pairs of 1D passes as in the separable engine, r*(xconv+yconv) operations per pixel instead of xconv*yconv: a nearly low-rank
+//  61x61 kernel costs a few hundred taps instead of 3721.
+//
+//  Choice of r: the truncated terms change an interior pixel by at most lrerror = MAXVAL*sum|K - K_r| grey levels. A kernel read
+//  from a file is only known to within half a level of the file per weight (kunit/2, see normalize): that rounding is full rank, and
+//  on a 16-bit 61x61 gaussian it alone puts lrerror above one grey level at any rank below the full one. r is the smallest rank with
+//  lrerror <= LOWRANK_MAX_ERROR, or whose residual is within one level of the file at every weight (rounding noise, not terms which
+//  were left out): exactly low-rank kernels, stored exactly or rounded, get their rank. The engine is chosen automatically if that is at least
+//  LOWRANK_GAIN times cheaper than the dense kernel; when requested, it is used as long as it is cheaper at all, otherwise the
+//  automatic choice is kept (a lower rank would be cheaper, but not accurate).
+//
+//  Border effect: the 1D passes are clipped to the image (zero padding), and their sum is divided by the weight of the taps of the
+//  (exact) kernel inside the image, from its prefix sums, like in Border_blur.
+// =============================================================
+
+#define LOWRANK_MAX_ERROR  1.0     //bound on the error (grey levels), unless the residual is within the rounding of the kernel file
+#define LOWRANK_GAIN       4       //minimum speed up (in operations per pixel) for the automatic choice
+#define LOWRANK_SWEEPS     60      //maximum number of Jacobi sweeps
+
+static void jacobi_svd(double *a, int m, int n, double *v, double *s)
+/*
+* One-sided Jacobi SVD of the m x n matrix a (row-major), overwritten with U*S (its columns are s[k]*u_k), v (n x n, row-major)
+* receives V, such that a = U*S*V^T on entry. Columns are rotated pairwise until they are orthogonal.
+*/
+{
+	int i,j,k,sweep;
+
+	for(i=0; i<n; i++)
+		for(j=0; j<n; j++) v[i*n+j] = (i == j);
+
+	for(sweep=0; sweep<LOWRANK_SWEEPS; sweep++)
+	{
+		int rotated = 0;
+
+		for(j=0; j<n-1; j++)
+			for(k=j+1; k<n; k++)
+			{
+				double alpha = 0, beta = 0, gamma = 0;
+
+				for(i=0; i<m; i++)
+				{
+					alpha += a[i*n+j]*a[i*n+j];
+					beta  += a[i*n+k]*a[i*n+k];
+					gamma += a[i*n+j]*a[i*n+k];
+				}
+
+				if(fabs(gamma) <= 1e-15*sqrt(alpha*beta) || gamma == 0) continue;
+				rotated = 1;
+
+				double zeta = (beta-alpha)/(2*gamma);
+				double t = (zeta >= 0 ? 1 : -1)/(fabs(zeta) + sqrt(1+zeta*zeta));
+				double c = 1/sqrt(1+t*t), sn = c*t;
+
+				for(i=0; i<m; i++)
+				{
+					double x = a[i*n+j], y = a[i*n+k];
+					a[i*n+j] = c*x - sn*y;
+					a[i*n+k] = sn*x + c*y;
+				}
+				for(i=0; i<n; i++)
+				{
+					double x = v[i*n+j], y = v[i*n+k];
+					v[i*n+j] = c*x - sn*y;
+					v[i*n+k] = sn*x + c*y;
+				}
+			}
+
+		if(!rotated) break;
+	}
+
+	for(j=0; j<n; j++)
+	{
+		for(s[j]=0, i=0; i<m; i++) s[j] += a[i*n+j]*a[i*n+j];
+		s[j] = sqrt(s[j]);
+	}
+}
+
+int lowrank_factors(kernel_plan *plan)
+/*
+* Fills rank, xterms, yterms and lrerror of plan from its matrix (see above). Returns 1 if the automatic choice conditions are met, 0 if
+* the rank found is still cheaper than the dense kernel, -1 if not.
+*/
+{
+	int xconv = plan->xconv, yconv = plan->yconv, taps = xconv*yconv;
+	double *a = (double *)malloc(sizeof(double)*taps), *v = (double *)malloc(sizeof(double)*xconv*xconv);
+	double *s = (double *)malloc(sizeof(double)*xconv), *res = (double *)malloc(sizeof(double)*taps);
+	int *order = (int *)malloc(sizeof(int)*xconv);
+	int e,k,l,m,r;
+
+	for(e=0; e<taps; e++) res[e] = a[e] = plan->matrix[e];
+	jacobi_svd(a,yconv,xconv,v,s);
+
+	//terms by decreasing singular value
+	for(k=0; k<xconv; k++) order[k] = k;
+	for(k=1; k<xconv; k++)
+		for(l=k; l>0 && s[order[l]] > s[order[l-1]]; l--) { int t = order[l]; order[l] = order[l-1]; order[l-1] = t; }
+
+	//residual K - K_r and its bound, one term at a time, up to the smallest rank meeting the error threshold (the full one at worst)
+	int r_err = xconv;
+	double *bound = (double *)malloc(sizeof(double)*xconv);
+
+	for(r=0; r<xconv && r < r_err; r++)
+	{
+		int c = order[r];
+
+		for(m=0; m<yconv; m++)
+			for(l=0; l<xconv; l++) res[l+xconv*m] -= a[m*xconv+c]*v[l*xconv+c];
+
+		double peak = 0;
+		for(bound[r]=0, e=0; e<taps; e++) { bound[r] += fabs(res[e]); peak = max(peak,fabs(res[e])); }
+		bound[r] *= MAXVAL;
+
+		if(bound[r] <= LOWRANK_MAX_ERROR || peak <= plan->kunit) r_err = r+1;
+	}
+
+	//never below the error threshold: a rank leaving out terms which matter is cheap but useless
+	r = r_err;
+	int cheap = r < xconv && LOWRANK_GAIN*r*(xconv+yconv) <= taps ? 1 : r*(xconv+yconv) < taps ? 0 : -1;
+	plan->lrerror = bound[r-1];
+	free(bound);
+
+	plan->rank = r;
+	plan->xterms = (KTYPE *)malloc(sizeof(KTYPE)*r*xconv);
+	plan->yterms = (KTYPE *)malloc(sizeof(KTYPE)*r*yconv);
+	for(k=0; k<r; k++)
+	{
+		for(l=0; l<xconv; l++) plan->xterms[l+xconv*k] = v[l*xconv+order[k]];
+		for(m=0; m<yconv; m++) plan->yterms[m+yconv*k] = a[m*xconv+order[k]];
+	}
+
+	free(a); free(v); free(s); free(res); free(order);
+
+	return cheap;
+}
+
+void Lowrank_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+//!! This function contains orphaned OMP directives -> to be used in a parallel region
+{
+	//shared among the threads (if any): horizontal pass of the current term, sum of the terms
+	static KTYPE *rows, *acc;
+
+	int xconv = plan->xconv, yconv = plan->yconv;
+	int sx = xconv/2, sy = yconv/2;
+	int nrows = ysize + lines_up + lines_down;
+	int i,j,k,l,m;
+
+	//private to each thread: a line of pixels, converted once
+	KTYPE *line = (KTYPE *)malloc(sizeof(KTYPE)*xsize);
+
+	#pragma omp single
+	{
+		rows = (KTYPE *)malloc(sizeof(KTYPE)*xsize*nrows);
+		acc = (KTYPE *)calloc((size_t)xsize*ysize,sizeof(KTYPE));
+	}
+
+	for(k=0; k<plan->rank; k++)
+	{
+		KTYPE *xvec = plan->xterms + xconv*k, *yvec = plan->yterms + yconv*k;
+
+		//HORIZONTAL PASS -> every line held, one tap at a time over the pixels it reaches (zero padding, vectorizable)
+
+		#pragma omp for
+		for(j=0; j<nrows; j++)
+		{
+			unsigned short int *in = image + (size_t)xsize*j;
+			KTYPE *out = rows + (size_t)xsize*j;
+
+			for(i=0; i<xsize; i++)
+			{
+				line[i] = in[i];
+				out[i] = 0;
+			}
+			for(l=0; l<xconv; l++)
+			{
+				KTYPE w = xvec[l];
+				int ilim = min(xsize,xsize+sx-l);
+
+				for(i=max(sx-l,0); i<ilim; i++) out[i] += line[i-sx+l]*w;
+			}
+		}
+
+		//VERTICAL PASS -> added to the previous terms, a whole line at a time
+
+		#pragma omp for
+		for(j=0; j<ysize; j++)
+		{
+			//same limits as in Border_blur, shifted by the lines of halo
+			int mlim = min(yconv,ysize+lines_down-j+sy);
+			KTYPE *out = acc + (size_t)xsize*j;
+
+			for(m=max(sy-lines_up-j,0); m<mlim; m++)
+			{
+				KTYPE *in = rows + (size_t)xsize*(j-sy+m+lines_up);
+				for(i=0; i<xsize; i++) out[i] += in[i]*yvec[m];
+			}
+		}
+	}
+
+	//RENORMALIZATION -> only where part of the kernel has been cut away
+
+	#pragma omp for
+	for(j=0; j<ysize; j++)
+	{
+		int m0 = max(sy-lines_up-j,0), m1 = min(yconv,ysize+lines_down-j+sy);
+
+		for(i=0; i<xsize; i++)
+		{
+			double value = acc[i+(size_t)xsize*j];
+			int l0 = max(sx-i,0), l1 = min(xconv,xsize-i+sx);
+
+			if(m0 || l0 || m1 < yconv || l1 < xconv) value /= kernel_weight(plan->ksum,xconv,l0,l1,m0,m1);
+
+			blurred[i+(size_t)xsize*j] = min(max(value+0.5,0),MAXVAL);
+		}
+	}
+
+	free(line);
+
+	#pragma omp single
+	{
+		free(rows);
+		free(acc);
+	}
+
+	return;
+}
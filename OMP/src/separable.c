@@ -0,0 +1,101 @@
+#include "ut.h"
+
+// =============================================================
+//  separable convolution engine
+//
+//  * Separable_convolve
+//
+//  A kernel which is the outer product of two vectors (mean and gaussian kernels are) can be applied as two 1D passes, a horizontal
+//  one followed by a vertical one, with xconv+yconv operations per pixel instead of xconv*yconv.
+//
+//  Border effect: the part of the kernel falling inside the image is always a rectangle, hence its weight factorizes as well into
+//  (sum of the valid xvec taps)*(sum of the valid yvec taps). Renormalizing each pass by its own valid taps gives therefore the same
+//  result as Border_blur, up to floating point rounding.
+// =============================================================
+
+void Separable_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+//!! This function contains orphaned OMP directives -> to be used in a parallel region
+{
+	//result of the horizontal pass (static -> shared among the threads, if any)
+	static KTYPE *rows;
+
+	KTYPE *xvec = plan->xvec, *yvec = plan->yvec;
+	int xconv = plan->xconv, yconv = plan->yconv;
+	int sx = xconv/2, sy = yconv/2;
+
+	//total number of lines held in image
+	int nrows = ysize + lines_up + lines_down;
+	int i,j,l,m;
+
+	#pragma omp single
+	rows = (KTYPE *)malloc(sizeof(KTYPE)*xsize*nrows);
+
+	//HORIZONTAL PASS -> every line held is needed, halo included
+
+	#pragma omp for
+	for(j=0; j<nrows; j++)
+	{
+		unsigned short int *in = image + (size_t)xsize*j;
+		KTYPE *out = rows + (size_t)xsize*j;
+
+		for(i=0; i<xsize; i++)
+		{
+			KTYPE buffer = 0;
+
+			if(i >= sx && i < xsize-sx)
+			{
+				//no checks on boundary
+				for(l=0; l<xconv; l++) buffer += in[i-sx+l]*xvec[l];
+				out[i] = buffer;
+			}
+			else
+			{
+				//same limits as in Border_blur
+				KTYPE norm = 0;
+				int llim = min(xconv,xsize-i+sx);
+
+				for(l=max(sx-i,0); l<llim; l++)
+				{
+					buffer += in[i-sx+l]*xvec[l];
+					norm += xvec[l];
+				}
+				out[i] = buffer/norm;
+			}
+		}
+	}
+
+	//VERTICAL PASS -> done a whole line at a time, to walk through rows contiguously
+
+	KTYPE *line = (KTYPE *)malloc(sizeof(KTYPE)*xsize);
+
+	#pragma omp for
+	for(j=0; j<ysize; j++)
+	{
+		//same limits as in Border_blur, shifted by the lines of halo
+		int mmin = max(sy-lines_up-j,0);
+		int mlim = min(yconv,ysize+lines_down-j+sy);
+		KTYPE norm = 0;
+
+		for(i=0; i<xsize; i++) line[i] = 0;
+
+		for(m=mmin; m<mlim; m++)
+		{
+			KTYPE *in = rows + (size_t)xsize*(j-sy+m+lines_up);
+
+			for(i=0; i<xsize; i++) line[i] += in[i]*yvec[m];
+			norm += yvec[m];
+		}
+
+		//renormalization is needed only if part of the kernel has been cut away
+		if(mmin == 0 && mlim == yconv) norm = 1;
+
+		for(i=0; i<xsize; i++) blurred[i+xsize*j] = line[i]/norm + 0.5;
+	}
+
+	free(line);
+
+	#pragma omp single
+	free(rows);
+
+	return;
+}
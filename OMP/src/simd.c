@@ -0,0 +1,624 @@
+#include "ut.h"
+#include <limits.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define SIMD_X86 1
+#	include <immintrin.h>
+#else
+#	define SIMD_X86 0
+#endif
+
+// =============================================================
+//  vectorized interior of the direct convolution
+//
+//  * simd_select
+//  * simd_name
+//  * Interior_row
+//  * Interior_rows
+//  * Sparse_row
+//
+//  In the interior of the image no renormalization is needed, and each output pixel is just the dot product of the kernel with
+//  the window of pixels below it. Interior_row does a whole row of such pixels: with AVX2 (8 lanes) or AVX-512 (16 lanes) the
+//  unsigned shorts are widened to floats in registers, multiplied by the broadcast weight and accumulated with FMA, several vectors
+//  at a time to hide its latency; the result is rounded (+0.5, truncation) and saturated to [0, MAXVAL] before being narrowed
+//  back to 16 bits. The pixels left over at the end of the row, fewer than a vector, go through the scalar loop.
+//
+//  The instruction set is chosen once per run by simd_select, through cpuid (__builtin_cpu_supports): the vector kernels are
+//  compiled with target attributes, so no special flag is needed and the binary still runs on machines lacking them. The choice
+//  can be lowered through the BLUR_SIMD environment variable ("scalar", "avx2", "avx512"), never raised above what the CPU has.
+//
+//  The row kernels are written once, as inline functions of the kernel size, and instantiated by the ROW_KERNELS macro for each
+//  instruction set both for any size and for the common sizes in UNROLLED_SIZES, keyed on width and height: there the sizes are
+//  compile-time constants, so the compiler unrolls the loops over the kernel completely where it pays (up to 11 taps per row with
+//  gcc -O3; forcing it for longer rows through #pragma GCC unroll was measured to be no faster) and drops the loop overhead, which
+//  dominates small kernels. Besides the square sizes, each common width has an entry for any height, so that non-square kernels
+//  (3x5, 7x3, 11x21, ...) get the inner loop, along x, unrolled too. simd_select looks the kernel size up in the dispatch table once
+//  per kernel plan, and stores the row kernels found in the plan: other sizes go through the generic version. Only the generic
+//  version is instantiated for every symmetry and pixel format (see below); the unrolled sizes are for the common case alone, kernels
+//  symmetric in x and y (all the generated ones) with 16bit pixels in the byte order of the file or 8bit ones (UNROLLED_SYM,
+//  UNROLLED_ORDER, PIX_BYTE), the others taking the generic version: instantiating every combination made 627 functions, a 2.5 MB
+//  binary and minutes of compilation.
+//
+//  Symmetric kernels (all the generated ones, and custom ones which happen to be) are folded: the pixels under mirrored taps share
+//  a weight, so they are added together first, exactly in 32-bit integers, and multiplied once. A kernel symmetric in x and y needs
+//  about a quarter of the multiplications and conversions to float, one symmetric along a single axis half of them. Each row kernel
+//  is instantiated for each symmetry too, the folding being resolved at compile time.
+//
+//  Neighbouring output rows read almost the same input lines, so the block row kernels do ROW_BLOCK of them in a single sweep: each
+//  input line of the block's window (yconv+ROW_BLOCK-1 of them) is loaded and converted once, and accumulated into every output row it
+//  reaches with the matching kernel row, ROW_BLOCK*ROWS_UNROLL accumulators staying in registers. Loads and conversions drop by about
+//  ROW_BLOCK times, the multiplications stay the same: as mirrored kernel rows weigh different input lines for different output rows,
+//  only the folding along x is kept (the scalar loop keeps the folding along y instead, which saves more there). Folding each output row
+//  of the block on its own pairs of lines instead shares nothing between the rows, and was measured no faster than single rows.
+//  Blocking is therefore a variant of its own, chosen by simd_select: by default Interior_rows uses it with the vector kernels, which are
+//  limited by the loads and conversions, and the folded single row kernel with the scalar loop, the environment variable BLUR_ROW_BLOCK
+//  forcing it on (1) or off (0). With AVX2 and AVX-512 the blocks were measured 1.2-1.9x faster than a row at a time for symmetric kernels
+//  too (gaussians from 5x5 to 21x21, 2000x1500 pixels, one thread), the larger kernels gaining the most.
+//
+//  The pixels can also be left in the byte order of the file (big-endian), the row kernels swapping them as they are loaded and
+//  stored (one byte shuffle per vector, see plan_byteswap): this saves the two sweeps over the image and the result which swapping
+//  them in memory costs, and leaves the input untouched. 8bit pixels (see plan_depth8) are loaded as bytes and widened to 32-bit
+//  integers in registers, and the results saturated to 255 and narrowed back to bytes as they are stored, instead of widening the
+//  whole image to 16 bits before and narrowing the result after: the row kernels then move half the bytes. The pixel format (PIX_*:
+//  16 bits in either byte order, or 8 bits) is a compile-time parameter of the row kernels as well.
+//
+//  The weights are used in single precision: if KTYPE is redefined to something else the scalar loop is always used, so as not to
+//  lose precision. FMA rounds once instead of twice, hence results may differ from the scalar ones by one grey level where the
+//  exact value is within ~1e-6 of a .5.
+// =============================================================
+
+#define SIMD_UNROLL 4  //vectors accumulated together
+#define ROWS_UNROLL 4  //vectors accumulated together for each row of a block (ROW_BLOCK*ROWS_UNROLL accumulators)
+
+//kernel sizes (X x Y) with unrolled row kernels, 0 standing for any height, for the symmetry (SYM_X | SYM_Y) and byte order (the
+//one of the file, see plan_byteswap) of most kernels and images, and for 8bit pixels: the other ones go through the generic row kernels
+#define UNROLLED_SIZES(f) f(3,3) f(5,5) f(7,7) f(11,11) f(15,15) f(21,21) f(3,0) f(5,0) f(7,0) f(11,0) f(15,0) f(21,0)
+#define UNROLLED_SYM   3                  //SYM_X | SYM_Y, as a plain number to be pasted in the names
+#define UNROLLED_ORDER I_M_LITTLE_ENDIAN  //the bswap of plan_byteswap
+
+//arguments of the row kernels (see row_kernel in ut.h)
+#define ROW_ARGS void *in, void *out, int n, int xsize, KTYPE *kernel, int xconv, int yconv
+
+static const char *simd_names[] = {"scalar", "avx2", "avx512"};
+
+//taps actually multiplied along x and y: the mirrored ones are folded onto the first half (centre included)
+#define FOLD_X(sym) (((sym) & SYM_X) ? (xconv+1)/2 : xconv)
+#define FOLD_Y(sym) (((sym) & SYM_Y) ? (yconv+1)/2 : yconv)
+
+static inline __attribute__((always_inline)) int load_scalar(void *p, size_t k, int px)
+//pixel k of p, in the format px (see PIX_*)
+{
+	return px == PIX_BYTE ? ((unsigned char *)p)[k] : pixel(((unsigned short int *)p)[k],px);
+}
+
+static inline __attribute__((always_inline)) void store_scalar(void *p, size_t k, KTYPE v, int px)
+//rounding and saturation of v, into pixel k of p in the format px
+{
+	v = min(max(v + 0.5,0),MAXVAL);
+
+	if(px == PIX_BYTE) ((unsigned char *)p)[k] = min(v,UCHAR_MAX);
+	else ((unsigned short int *)p)[k] = pixel(v,px);
+}
+
+static inline __attribute__((always_inline)) int fold_scalar(void *p, int xsize, int l, int m, int xconv, int yconv, int sym, int px)
+//pixel under the tap (l,m) of the window starting at p, plus the ones under its mirrored taps (exact, in integers), in the format px
+{
+	int lr = xconv-1-l, mr = yconv-1-m, fx = (sym & SYM_X) && lr != l;
+	int v = load_scalar(p,l+(size_t)xsize*m,px);
+
+	if(fx) v += load_scalar(p,lr+(size_t)xsize*m,px);
+	if((sym & SYM_Y) && mr != m)
+	{
+		v += load_scalar(p,l+(size_t)xsize*mr,px);
+		if(fx) v += load_scalar(p,lr+(size_t)xsize*mr,px);
+	}
+
+	return v;
+}
+
+static inline __attribute__((always_inline)) void row_scalar(ROW_ARGS, int sym, int px)
+{
+	int i,l,m;
+
+	for(i=0; i<n; i++)
+	{
+		KTYPE buffer = 0;
+
+		for(m=0; m<FOLD_Y(sym); m++)
+			for(l=0; l<FOLD_X(sym); l++)	buffer += fold_scalar(PIX_AT(in,i,px),xsize,l,m,xconv,yconv,sym,px)*kernel[l+xconv*m];
+
+		store_scalar(out,i,buffer,px);
+	}
+}
+
+
+static inline __attribute__((always_inline)) void rows_scalar(ROW_ARGS, int sym, int px)
+{
+	int i,b,l,q;
+
+	//without vectors, folding along y saves more than the block does
+	if(sym & SYM_Y)
+	{
+		for(b=0; b<ROW_BLOCK; b++) row_scalar(PIX_AT(in,(size_t)xsize*b,px),PIX_AT(out,(size_t)xsize*b,px),n,xsize,kernel,xconv,yconv,sym,px);
+		return;
+	}
+
+	for(i=0; i<n; i++)
+	{
+		KTYPE acc[ROW_BLOCK] = {0};
+
+		for(q=0; q<yconv+ROW_BLOCK-1; q++)
+			for(l=0; l<FOLD_X(sym); l++)
+			{
+				KTYPE v = fold_scalar(PIX_AT(in,i+(size_t)xsize*q,px),xsize,l,0,xconv,1,sym & SYM_X,px);
+				for(b=0; b<ROW_BLOCK; b++) if(q-b >= 0 && q-b < yconv) acc[b] += v*kernel[l+xconv*(q-b)];
+			}
+
+		for(b=0; b<ROW_BLOCK; b++) store_scalar(out,i+(size_t)xsize*b,acc[b],px);
+	}
+}
+
+#if SIMD_X86
+
+//byte shuffle swapping the two bytes of each unsigned short
+#define BSWAP16_MASK _mm_set_epi8(14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1)
+
+__attribute__((target("avx2,fma")))
+static inline __attribute__((always_inline)) __m256i load8_avx2(void *p, int px)
+//8 pixels in the format px (unsigned shorts, possibly swapped, or unsigned chars) -> 8 ints
+{
+	if(px == PIX_BYTE) return _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)p));
+
+	__m128i v = _mm_loadu_si128((__m128i *)p);
+
+	if(px == PIX_SWAPPED) v = _mm_shuffle_epi8(v,BSWAP16_MASK);
+	return _mm256_cvtepu16_epi32(v);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __attribute__((always_inline)) __m256 fold8_avx2(void *p, int xsize, int l, int m, int xconv, int yconv, int sym, int px)
+//same as fold_scalar for 8 consecutive windows, the sum is done in 32-bit integers and converted once
+{
+	int lr = xconv-1-l, mr = yconv-1-m, fx = (sym & SYM_X) && lr != l;
+	__m256i v = load8_avx2(PIX_AT(p,l+(size_t)xsize*m,px),px);
+
+	if(fx) v = _mm256_add_epi32(v,load8_avx2(PIX_AT(p,lr+(size_t)xsize*m,px),px));
+	if((sym & SYM_Y) && mr != m)
+	{
+		v = _mm256_add_epi32(v,load8_avx2(PIX_AT(p,l+(size_t)xsize*mr,px),px));
+		if(fx) v = _mm256_add_epi32(v,load8_avx2(PIX_AT(p,lr+(size_t)xsize*mr,px),px));
+	}
+
+	return _mm256_cvtepi32_ps(v);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __attribute__((always_inline)) void store8_avx2(void *p, __m256 acc, int px)
+//rounding and saturation, then 8 floats -> 8 pixels in the format px
+{
+	acc = _mm256_add_ps(acc,_mm256_set1_ps(0.5f));
+	acc = _mm256_min_ps(_mm256_max_ps(acc,_mm256_setzero_ps()),_mm256_set1_ps(MAXVAL));
+
+	__m256i v = _mm256_cvttps_epi32(acc);
+	__m128i w = _mm_packus_epi32(_mm256_castsi256_si128(v),_mm256_extracti128_si256(v,1));
+
+	if(px == PIX_BYTE) { _mm_storel_epi64((__m128i *)p,_mm_packus_epi16(w,w)); return; }
+
+	if(px == PIX_SWAPPED) w = _mm_shuffle_epi8(w,BSWAP16_MASK);
+	_mm_storeu_si128((__m128i *)p,w);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __attribute__((always_inline)) void row_avx2(ROW_ARGS, int sym, int px)
+{
+	int i=0,l,m,u;
+
+	//SIMD_UNROLL vectors at a time
+	for(; i+8*SIMD_UNROLL<=n; i+=8*SIMD_UNROLL)
+	{
+		__m256 acc[SIMD_UNROLL];
+		for(u=0; u<SIMD_UNROLL; u++) acc[u] = _mm256_setzero_ps();
+
+		for(m=0; m<FOLD_Y(sym); m++)
+			for(l=0; l<FOLD_X(sym); l++)
+			{
+				__m256 w = _mm256_set1_ps(kernel[l+xconv*m]);
+				for(u=0; u<SIMD_UNROLL; u++) acc[u] = _mm256_fmadd_ps(fold8_avx2(PIX_AT(in,i+8*u,px),xsize,l,m,xconv,yconv,sym,px),w,acc[u]);
+			}
+
+		for(u=0; u<SIMD_UNROLL; u++) store8_avx2(PIX_AT(out,i+8*u,px),acc[u],px);
+	}
+
+	//one vector at a time
+	for(; i+8<=n; i+=8)
+	{
+		__m256 acc = _mm256_setzero_ps();
+
+		for(m=0; m<FOLD_Y(sym); m++)
+			for(l=0; l<FOLD_X(sym); l++) acc = _mm256_fmadd_ps(fold8_avx2(PIX_AT(in,i,px),xsize,l,m,xconv,yconv,sym,px),_mm256_set1_ps(kernel[l+xconv*m]),acc);
+
+		store8_avx2(PIX_AT(out,i,px),acc,px);
+	}
+
+	row_scalar(PIX_AT(in,i,px),PIX_AT(out,i,px),n-i,xsize,kernel,xconv,yconv,sym,px);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __attribute__((always_inline)) void rows_avx2(ROW_ARGS, int sym, int px)
+{
+	int i=0,b,l,q,u;
+
+	for(; i+8*ROWS_UNROLL<=n; i+=8*ROWS_UNROLL)
+	{
+		__m256 acc[ROW_BLOCK][ROWS_UNROLL];
+		for(b=0; b<ROW_BLOCK; b++)
+			for(u=0; u<ROWS_UNROLL; u++) acc[b][u] = _mm256_setzero_ps();
+
+		for(q=0; q<yconv+ROW_BLOCK-1; q++)
+			for(l=0; l<FOLD_X(sym); l++)
+			{
+				__m256 v[ROWS_UNROLL];
+				for(u=0; u<ROWS_UNROLL; u++) v[u] = fold8_avx2(PIX_AT(in,i+8*u+(size_t)xsize*q,px),xsize,l,0,xconv,1,sym & SYM_X,px);
+
+				for(b=0; b<ROW_BLOCK; b++)
+					if(q-b >= 0 && q-b < yconv)
+					{
+						__m256 w = _mm256_set1_ps(kernel[l+xconv*(q-b)]);
+						for(u=0; u<ROWS_UNROLL; u++) acc[b][u] = _mm256_fmadd_ps(v[u],w,acc[b][u]);
+					}
+			}
+
+		for(b=0; b<ROW_BLOCK; b++)
+			for(u=0; u<ROWS_UNROLL; u++) store8_avx2(PIX_AT(out,i+8*u+(size_t)xsize*b,px),acc[b][u],px);
+	}
+
+	for(b=0; b<ROW_BLOCK; b++) row_avx2(PIX_AT(in,i+(size_t)xsize*b,px),PIX_AT(out,i+(size_t)xsize*b,px),n-i,xsize,kernel,xconv,yconv,sym,px);
+}
+
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) __m512i load16_avx512(void *p, int px)
+//16 pixels in the format px -> 16 ints
+{
+	if(px == PIX_BYTE) return _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *)p));
+
+	__m256i v = _mm256_loadu_si256((__m256i *)p);
+
+	if(px == PIX_SWAPPED) v = _mm256_shuffle_epi8(v,_mm256_broadcastsi128_si256(BSWAP16_MASK));
+	return _mm512_cvtepu16_epi32(v);
+}
+
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) __m512 fold16_avx512(void *p, int xsize, int l, int m, int xconv, int yconv, int sym, int px)
+//same as fold8_avx2, 16 windows
+{
+	int lr = xconv-1-l, mr = yconv-1-m, fx = (sym & SYM_X) && lr != l;
+	__m512i v = load16_avx512(PIX_AT(p,l+(size_t)xsize*m,px),px);
+
+	if(fx) v = _mm512_add_epi32(v,load16_avx512(PIX_AT(p,lr+(size_t)xsize*m,px),px));
+	if((sym & SYM_Y) && mr != m)
+	{
+		v = _mm512_add_epi32(v,load16_avx512(PIX_AT(p,l+(size_t)xsize*mr,px),px));
+		if(fx) v = _mm512_add_epi32(v,load16_avx512(PIX_AT(p,lr+(size_t)xsize*mr,px),px));
+	}
+
+	return _mm512_cvtepi32_ps(v);
+}
+
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) void store16_avx512(void *p, __m512 acc, int px)
+//rounding and saturation, then 16 floats -> 16 pixels in the format px
+{
+	acc = _mm512_add_ps(acc,_mm512_set1_ps(0.5f));
+	acc = _mm512_min_ps(_mm512_max_ps(acc,_mm512_setzero_ps()),_mm512_set1_ps(MAXVAL));
+
+	if(px == PIX_BYTE) { _mm_storeu_si128((__m128i *)p,_mm512_cvtusepi32_epi8(_mm512_cvttps_epi32(acc))); return; }
+
+	__m256i v = _mm512_cvtepi32_epi16(_mm512_cvttps_epi32(acc));
+
+	if(px == PIX_SWAPPED) v = _mm256_shuffle_epi8(v,_mm256_broadcastsi128_si256(BSWAP16_MASK));
+	_mm256_storeu_si256((__m256i *)p,v);
+}
+
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) void row_avx512(ROW_ARGS, int sym, int px)
+{
+	int i=0,l,m,u;
+
+	//SIMD_UNROLL vectors at a time
+	for(; i+16*SIMD_UNROLL<=n; i+=16*SIMD_UNROLL)
+	{
+		__m512 acc[SIMD_UNROLL];
+		for(u=0; u<SIMD_UNROLL; u++) acc[u] = _mm512_setzero_ps();
+
+		for(m=0; m<FOLD_Y(sym); m++)
+			for(l=0; l<FOLD_X(sym); l++)
+			{
+				__m512 w = _mm512_set1_ps(kernel[l+xconv*m]);
+				for(u=0; u<SIMD_UNROLL; u++) acc[u] = _mm512_fmadd_ps(fold16_avx512(PIX_AT(in,i+16*u,px),xsize,l,m,xconv,yconv,sym,px),w,acc[u]);
+			}
+
+		for(u=0; u<SIMD_UNROLL; u++) store16_avx512(PIX_AT(out,i+16*u,px),acc[u],px);
+	}
+
+	//one vector at a time
+	for(; i+16<=n; i+=16)
+	{
+		__m512 acc = _mm512_setzero_ps();
+
+		for(m=0; m<FOLD_Y(sym); m++)
+			for(l=0; l<FOLD_X(sym); l++) acc = _mm512_fmadd_ps(fold16_avx512(PIX_AT(in,i,px),xsize,l,m,xconv,yconv,sym,px),_mm512_set1_ps(kernel[l+xconv*m]),acc);
+
+		store16_avx512(PIX_AT(out,i,px),acc,px);
+	}
+
+	row_scalar(PIX_AT(in,i,px),PIX_AT(out,i,px),n-i,xsize,kernel,xconv,yconv,sym,px);
+}
+
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) void rows_avx512(ROW_ARGS, int sym, int px)
+{
+	int i=0,b,l,q,u;
+
+	for(; i+16*ROWS_UNROLL<=n; i+=16*ROWS_UNROLL)
+	{
+		__m512 acc[ROW_BLOCK][ROWS_UNROLL];
+		for(b=0; b<ROW_BLOCK; b++)
+			for(u=0; u<ROWS_UNROLL; u++) acc[b][u] = _mm512_setzero_ps();
+
+		for(q=0; q<yconv+ROW_BLOCK-1; q++)
+			for(l=0; l<FOLD_X(sym); l++)
+			{
+				__m512 v[ROWS_UNROLL];
+				for(u=0; u<ROWS_UNROLL; u++) v[u] = fold16_avx512(PIX_AT(in,i+16*u+(size_t)xsize*q,px),xsize,l,0,xconv,1,sym & SYM_X,px);
+
+				for(b=0; b<ROW_BLOCK; b++)
+					if(q-b >= 0 && q-b < yconv)
+					{
+						__m512 w = _mm512_set1_ps(kernel[l+xconv*(q-b)]);
+						for(u=0; u<ROWS_UNROLL; u++) acc[b][u] = _mm512_fmadd_ps(v[u],w,acc[b][u]);
+					}
+			}
+
+		for(b=0; b<ROW_BLOCK; b++)
+			for(u=0; u<ROWS_UNROLL; u++) store16_avx512(PIX_AT(out,i+16*u+(size_t)xsize*b,px),acc[b][u],px);
+	}
+
+	for(b=0; b<ROW_BLOCK; b++) row_avx512(PIX_AT(in,i+(size_t)xsize*b,px),PIX_AT(out,i+(size_t)xsize*b,px),n-i,xsize,kernel,xconv,yconv,sym,px);
+}
+
+#endif
+
+//instances of the row kernels: row_<set>_X_Y_S_B for X x Y kernels (X, Y > 0, sizes known at compile time, 0 for any width or height),
+//folded along the symmetries S (SYM_X | SYM_Y, 0 for none), for pixels in the format B (PIX_*: 16bit in the byte order of the machine,
+//16bit swapped, 8bit), and the same for the blocks of rows, rows_<set>_X_Y_S_B
+#define KX(X) ((X)?(X):xconv)
+#define KY(Y) ((Y)?(Y):yconv)
+#if SIMD_X86
+#define ROW_KERNELS_SYM(X,Y,S,B) \
+	static void row_scalar_##X##_##Y##_##S##_##B(ROW_ARGS) { row_scalar(in,out,n,xsize,kernel,KX(X),KY(Y),S,B); } \
+	__attribute__((target("avx2,fma"))) static void row_avx2_##X##_##Y##_##S##_##B(ROW_ARGS) { row_avx2(in,out,n,xsize,kernel,KX(X),KY(Y),S,B); } \
+	__attribute__((target("avx512f"))) static void row_avx512_##X##_##Y##_##S##_##B(ROW_ARGS) { row_avx512(in,out,n,xsize,kernel,KX(X),KY(Y),S,B); } \
+	static void rows_scalar_##X##_##Y##_##S##_##B(ROW_ARGS) { rows_scalar(in,out,n,xsize,kernel,KX(X),KY(Y),S,B); } \
+	__attribute__((target("avx2,fma"))) static void rows_avx2_##X##_##Y##_##S##_##B(ROW_ARGS) { rows_avx2(in,out,n,xsize,kernel,KX(X),KY(Y),S,B); } \
+	__attribute__((target("avx512f"))) static void rows_avx512_##X##_##Y##_##S##_##B(ROW_ARGS) { rows_avx512(in,out,n,xsize,kernel,KX(X),KY(Y),S,B); }
+#define ROW_ENTRY_SYM(X,Y,S,B) {row_scalar_##X##_##Y##_##S##_##B, row_avx2_##X##_##Y##_##S##_##B, row_avx512_##X##_##Y##_##S##_##B}
+#define ROWS_ENTRY_SYM(X,Y,S,B) {rows_scalar_##X##_##Y##_##S##_##B, rows_avx2_##X##_##Y##_##S##_##B, rows_avx512_##X##_##Y##_##S##_##B}
+#else
+#define ROW_KERNELS_SYM(X,Y,S,B) \
+	static void row_scalar_##X##_##Y##_##S##_##B(ROW_ARGS) { row_scalar(in,out,n,xsize,kernel,KX(X),KY(Y),S,B); } \
+	static void rows_scalar_##X##_##Y##_##S##_##B(ROW_ARGS) { rows_scalar(in,out,n,xsize,kernel,KX(X),KY(Y),S,B); }
+#define ROW_ENTRY_SYM(X,Y,S,B) {row_scalar_##X##_##Y##_##S##_##B, row_scalar_##X##_##Y##_##S##_##B, row_scalar_##X##_##Y##_##S##_##B}
+#define ROWS_ENTRY_SYM(X,Y,S,B) {rows_scalar_##X##_##Y##_##S##_##B, rows_scalar_##X##_##Y##_##S##_##B, rows_scalar_##X##_##Y##_##S##_##B}
+#endif
+
+//generic row kernels, for every symmetry and pixel format
+#define GENERIC_KERNELS(B) ROW_KERNELS_SYM(0,0,0,B) ROW_KERNELS_SYM(0,0,1,B) ROW_KERNELS_SYM(0,0,2,B) ROW_KERNELS_SYM(0,0,3,B)
+#define GENERIC_ENTRY(B) {ROW_ENTRY_SYM(0,0,0,B), ROW_ENTRY_SYM(0,0,1,B), ROW_ENTRY_SYM(0,0,2,B), ROW_ENTRY_SYM(0,0,3,B)}
+#define GENERIC_BLOCK_ENTRY(B) {ROWS_ENTRY_SYM(0,0,0,B), ROWS_ENTRY_SYM(0,0,1,B), ROWS_ENTRY_SYM(0,0,2,B), ROWS_ENTRY_SYM(0,0,3,B)}
+
+GENERIC_KERNELS(0)
+GENERIC_KERNELS(1)
+GENERIC_KERNELS(2)
+
+//dispatch table of the generic row kernels: pixel format, symmetry and instruction set, for single rows and blocks of rows
+static const row_kernel generic_row[PIX_BYTE+1][(SYM_X|SYM_Y)+1][SIMD_AVX512+1] = {GENERIC_ENTRY(0), GENERIC_ENTRY(1), GENERIC_ENTRY(2)};
+static const row_kernel generic_rows[PIX_BYTE+1][(SYM_X|SYM_Y)+1][SIMD_AVX512+1] = {GENERIC_BLOCK_ENTRY(0), GENERIC_BLOCK_ENTRY(1), GENERIC_BLOCK_ENTRY(2)};
+
+//unrolled row kernels, for 16bit pixels in UNROLLED_ORDER and for 8bit ones (the extra level lets UNROLLED_SYM and UNROLLED_ORDER
+//expand before being pasted)
+#define UNROLLED_KERNELS(X,Y,S,B) ROW_KERNELS_SYM(X,Y,S,B) ROW_KERNELS_SYM(X,Y,S,2)
+#define UNROLLED_ENTRY(X,Y,S,B) {X, Y, {ROW_ENTRY_SYM(X,Y,S,B), ROW_ENTRY_SYM(X,Y,S,2)}, {ROWS_ENTRY_SYM(X,Y,S,B), ROWS_ENTRY_SYM(X,Y,S,2)}},
+#define ROW_KERNELS(X,Y) UNROLLED_KERNELS(X,Y,UNROLLED_SYM,UNROLLED_ORDER)
+#define ROW_ENTRY(X,Y) UNROLLED_ENTRY(X,Y,UNROLLED_SYM,UNROLLED_ORDER)
+
+UNROLLED_SIZES(ROW_KERNELS)
+
+//dispatch table of the unrolled row kernels: kernel width and height, then 16 or 8bit pixels and instruction set, for single rows (fn)
+//and blocks of rows (block)
+static const struct { int xsize, ysize; row_kernel fn[2][SIMD_AVX512+1], block[2][SIMD_AVX512+1]; } row_kernels[] = { UNROLLED_SIZES(ROW_ENTRY) };
+#define N_ROW_KERNELS (int)(sizeof(row_kernels)/sizeof(row_kernels[0]))
+
+int simd_select(kernel_plan *plan, int bswap)
+/*
+* Chooses the row kernels of plan (row and rows, a single row and a block of rows): the best instruction set the CPU supports (possibly
+* lowered through BLUR_SIMD), unrolled for its width and height if they are among the UNROLLED_SIZES and it has the symmetry and pixel
+* format these are instantiated for (unroll_x and unroll_y are set to them, 0 where any size is taken), folded along its symmetries (see
+* kernel_symmetry), swapping the bytes of the pixels they load and store if bswap (images kept in the byte order of the file, see
+* plan_byteswap) or loading and storing 8bit pixels if plan->depth8 (see plan_depth8), and whether Interior_rows uses the block
+* (row_block, see above). Returns the instruction set. Must be called outside of parallel regions.
+*/
+{
+	int best = SIMD_SCALAR, simd_level, e;
+	char *forced = getenv("BLUR_SIMD"), *block = getenv("BLUR_ROW_BLOCK");
+	int xconv = plan->xconv, yconv = plan->yconv, symmetry = plan->symmetry;
+
+#if SIMD_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) best = SIMD_AVX2;
+	if(__builtin_cpu_supports("avx512f")) best = SIMD_AVX512;
+#endif
+
+	//vector kernels work in single precision
+	if(sizeof(KTYPE) != sizeof(float)) best = SIMD_SCALAR;
+
+	simd_level = best;
+	if(forced)
+		for(e=SIMD_SCALAR; e<=best; e++) if(!strcmp(forced,simd_names[e])) simd_level = e;
+
+	//8bit pixels are read and written as they are if the plan says so (see plan_depth8)
+	int px = plan->depth8 ? PIX_BYTE : bswap, depth8 = px == PIX_BYTE;
+
+	//unrolled kernels, for the common symmetry and pixel formats only: the one fixing both sizes is preferred, then the one fixing the
+	//width (the inner loop); the generic ones otherwise
+	int found = -1, best_fit = 0;
+	for(e=0; e<N_ROW_KERNELS && symmetry == UNROLLED_SYM && (depth8 || px == UNROLLED_ORDER); e++)
+	{
+		int fx = row_kernels[e].xsize, fy = row_kernels[e].ysize, fit = 2 + (fy != 0);
+
+		if(fx == xconv && (!fy || fy == yconv) && fit > best_fit) found = e, best_fit = fit;
+	}
+
+	plan->row = found < 0 ? generic_row[px][symmetry][simd_level] : row_kernels[found].fn[depth8][simd_level];
+	plan->rows = found < 0 ? generic_rows[px][symmetry][simd_level] : row_kernels[found].block[depth8][simd_level];
+	plan->unroll_x = found < 0 ? 0 : row_kernels[found].xsize;
+	plan->unroll_y = found < 0 ? 0 : row_kernels[found].ysize;
+	plan->row_block = block ? atoi(block) != 0 : simd_level != SIMD_SCALAR;
+
+	return simd_level;
+}
+
+const char *simd_name(int level)
+{
+	return (level >= SIMD_SCALAR && level <= SIMD_AVX512) ? simd_names[level] : "unknown";
+}
+
+void Interior_row(void *in, void *out, int n, int xsize, kernel_plan *plan)
+/*
+* n pixels of the interior: out[i] = sum over (l,m) of in[i+l+xsize*m]*matrix[l+xconv*m], rounded and saturated, with the row kernel
+* chosen for plan by simd_select. in points to the top left corner of the window of the first pixel, xsize is the row length of the image.
+* Both hold pixels in the format of plan (see PLAN_PIXELS).
+*/
+{
+	plan->row(in,out,n,xsize,plan->matrix,plan->xconv,plan->yconv);
+}
+
+void Interior_rows(void *in, void *out, int n, int xsize, kernel_plan *plan)
+/*
+* Same as Interior_row for ROW_BLOCK consecutive rows: the row j of the block goes to out+xsize*j, from the window at in+xsize*j.
+*/
+{
+	int j, px = PLAN_PIXELS(plan);
+
+	if(plan->row_block) plan->rows(in,out,n,xsize,plan->matrix,plan->xconv,plan->yconv);
+	else for(j=0; j<ROW_BLOCK; j++) plan->row(PIX_AT(in,(size_t)xsize*j,px),PIX_AT(out,(size_t)xsize*j,px),n,xsize,plan->matrix,plan->xconv,plan->yconv);
+}
+
+//row kernels of the sparse engine: the same loops over the non-zero taps only, given as lists (see sparse_taps)
+#define SPARSE_ARGS unsigned short int *in, unsigned short int *out, int n, int xsize, int yconv, int *tap_start, int *tap_l, KTYPE *tap_w
+typedef void (*sparse_kernel)(SPARSE_ARGS);
+
+static void sparse_scalar(SPARSE_ARGS)
+{
+	int i,m,t;
+
+	for(i=0; i<n; i++)
+	{
+		KTYPE buffer = 0;
+
+		for(m=0; m<yconv; m++)
+			for(t=tap_start[m]; t<tap_start[m+1]; t++) buffer += in[i+tap_l[t]+(size_t)xsize*m]*tap_w[t];
+
+		out[i] = min(max(buffer + 0.5,0),MAXVAL);
+	}
+}
+
+#if SIMD_X86
+
+__attribute__((target("avx2,fma")))
+static void sparse_avx2(SPARSE_ARGS)
+{
+	int i=0,m,t,u;
+
+	for(; i+8*SIMD_UNROLL<=n; i+=8*SIMD_UNROLL)
+	{
+		__m256 acc[SIMD_UNROLL];
+		for(u=0; u<SIMD_UNROLL; u++) acc[u] = _mm256_setzero_ps();
+
+		for(m=0; m<yconv; m++)
+		{
+			unsigned short int *p = in + i + (size_t)xsize*m;
+
+			for(t=tap_start[m]; t<tap_start[m+1]; t++)
+			{
+				__m256 w = _mm256_set1_ps(tap_w[t]);
+				for(u=0; u<SIMD_UNROLL; u++) acc[u] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(load8_avx2(p+tap_l[t]+8*u,0)),w,acc[u]);
+			}
+		}
+
+		for(u=0; u<SIMD_UNROLL; u++) store8_avx2(out+i+8*u,acc[u],0);
+	}
+
+	for(; i+8<=n; i+=8)
+	{
+		__m256 acc = _mm256_setzero_ps();
+
+		for(m=0; m<yconv; m++)
+			for(t=tap_start[m]; t<tap_start[m+1]; t++)
+				acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(load8_avx2(in+i+tap_l[t]+(size_t)xsize*m,0)),_mm256_set1_ps(tap_w[t]),acc);
+
+		store8_avx2(out+i,acc,0);
+	}
+
+	sparse_scalar(in+i,out+i,n-i,xsize,yconv,tap_start,tap_l,tap_w);
+}
+
+__attribute__((target("avx512f")))
+static void sparse_avx512(SPARSE_ARGS)
+{
+	int i=0,m,t,u;
+
+	for(; i+16*SIMD_UNROLL<=n; i+=16*SIMD_UNROLL)
+	{
+		__m512 acc[SIMD_UNROLL];
+		for(u=0; u<SIMD_UNROLL; u++) acc[u] = _mm512_setzero_ps();
+
+		for(m=0; m<yconv; m++)
+		{
+			unsigned short int *p = in + i + (size_t)xsize*m;
+
+			for(t=tap_start[m]; t<tap_start[m+1]; t++)
+			{
+				__m512 w = _mm512_set1_ps(tap_w[t]);
+				for(u=0; u<SIMD_UNROLL; u++) acc[u] = _mm512_fmadd_ps(_mm512_cvtepi32_ps(load16_avx512(p+tap_l[t]+16*u,0)),w,acc[u]);
+			}
+		}
+
+		for(u=0; u<SIMD_UNROLL; u++) store16_avx512(out+i+16*u,acc[u],0);
+	}
+
+	for(; i+16<=n; i+=16)
+	{
+		__m512 acc = _mm512_setzero_ps();
+
+		for(m=0; m<yconv; m++)
+			for(t=tap_start[m]; t<tap_start[m+1]; t++)
+				acc = _mm512_fmadd_ps(_mm512_cvtepi32_ps(load16_avx512(in+i+tap_l[t]+(size_t)xsize*m,0)),_mm512_set1_ps(tap_w[t]),acc);
+
+		store16_avx512(out+i,acc,0);
+	}
+
+	sparse_scalar(in+i,out+i,n-i,xsize,yconv,tap_start,tap_l,tap_w);
+}
+
+static const sparse_kernel sparse_kernels[] = {sparse_scalar, sparse_avx2, sparse_avx512};
+#else
+static const sparse_kernel sparse_kernels[] = {sparse_scalar, sparse_scalar, sparse_scalar};
+#endif
+
+void Sparse_row(unsigned short int *in, unsigned short int *out, int n, int xsize, kernel_plan *plan)
+/*
+* Same as Interior_row for the sparse engine, over the non-zero taps of plan only.
+*/
+{
+	sparse_kernels[plan->simd](in,out,n,xsize,plan->yconv,plan->tap_start,plan->tap_l,plan->tap_w);
+}
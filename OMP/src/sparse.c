@@ -0,0 +1,102 @@
+#include "ut.h"
+
+// =============================================================
+//  sparse convolution engine
+//
+//  * sparse_taps
+//  * Sparse_convolve
+//
+//  Custom kernels shaped as rings, crosses or lines are mostly zeros, which the direct engine multiplies all the same. Here the
+//  kernel is compiled once per run into the list of its non-zero taps, (l, weight) pairs grouped by kernel row m (tap_start[m] to
+//  tap_start[m+1]-1, in increasing l), and each output pixel costs one multiplication per non-zero tap. The interior rows are done by
+//  Sparse_row, the same vectorized loops as the direct engine (Interior_row, same instruction set) over the lists instead of the
+//  whole kernel: rows of the kernel holding no taps are skipped altogether.
+//
+//  Chosen automatically for custom kernels (type 3) with at most SPARSE_MAX_DENSITY of non-zero taps, if there are fewer of them than
+//  the FFT engine would take (FFT_MIN_TAPS or BLUR_FFT_TAPS).
+//
+//  Border effect: as in Border_blur, the sum over the taps inside the image is divided by their weight (from the prefix sums of the
+//  kernel), but only the non-zero taps are visited.
+// =============================================================
+
+int sparse_taps(kernel_plan *plan)
+/*
+* Fills ntaps, tap_start, tap_l and tap_w of plan from its matrix. Returns the number of non-zero taps.
+*/
+{
+	int xconv = plan->xconv, yconv = plan->yconv;
+	int l,m,t = 0;
+
+	plan->tap_start = (int *)malloc(sizeof(int)*(yconv+1));
+	for(m=0; m<yconv; m++)
+		for(l=0; l<xconv; l++) t += plan->matrix[l+xconv*m] != 0;
+
+	plan->ntaps = t;
+	plan->tap_l = (int *)malloc(sizeof(int)*max(t,1));
+	plan->tap_w = (KTYPE *)malloc(sizeof(KTYPE)*max(t,1));
+
+	for(t=0, m=0; m<yconv; m++)
+	{
+		plan->tap_start[m] = t;
+		for(l=0; l<xconv; l++)
+			if(plan->matrix[l+xconv*m] != 0)
+			{
+				plan->tap_l[t] = l;
+				plan->tap_w[t++] = plan->matrix[l+xconv*m];
+			}
+	}
+	plan->tap_start[yconv] = t;
+
+	return plan->ntaps;
+}
+
+static unsigned short int sparse_border(unsigned short int *image, int xsize, int i, int row, kernel_plan *plan, int l0, int l1, int m0, int m1)
+//clipped sum for the pixel (i, line row of image) over the non-zero taps with l0 <= l < l1, m0 <= m < m1, renormalized
+{
+	int sx = plan->xconv/2, sy = plan->yconv/2;
+	KTYPE buffer = 0;
+	int m,t;
+
+	for(m=m0; m<m1; m++)
+	{
+		unsigned short int *in = image + (size_t)xsize*(row-sy+m);
+
+		//taps of a row are sorted by l
+		for(t=plan->tap_start[m]; t<plan->tap_start[m+1] && plan->tap_l[t] < l0; t++);
+		for(; t<plan->tap_start[m+1] && plan->tap_l[t] < l1; t++) buffer += in[i-sx+plan->tap_l[t]]*plan->tap_w[t];
+	}
+
+	return buffer/kernel_weight(plan->ksum,plan->xconv,l0,l1,m0,m1) + 0.5;
+}
+
+void Sparse_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+//!! This function contains orphaned OMP directives -> to be used in a parallel region
+{
+	int xconv = plan->xconv, yconv = plan->yconv;
+	int sx = xconv/2, sy = yconv/2;
+	int nrows = ysize + lines_up + lines_down;
+	int c0 = plan->cols_left, c1 = xsize-plan->cols_right;  //the halo columns are skipped (see cols_left)
+	int i,j;
+
+	#pragma omp for
+	for(j=0; j<ysize; j++)
+	{
+		//line of image under the centre of the kernel, and kernel rows falling inside the lines held (same limits as in Border_blur)
+		int row = j+lines_up;
+		int m0 = max(sy-row,0), m1 = min(yconv,nrows-row+sy);
+		int i0 = sx, i1 = xsize-sx;
+
+		//the whole line is on the border if some kernel rows are cut away
+		if(m0 > 0 || m1 < yconv) i0 = i1 = xsize;
+		i0 = min(i0,xsize);
+		i1 = max(i1,i0);
+
+		for(i=c0; i<min(i0,c1); i++) blurred[i+(size_t)xsize*j] = sparse_border(image,xsize,i,row,plan,max(sx-i,0),min(xconv,xsize-i+sx),m0,m1);
+		for(i=i1; i<c1; i++) blurred[i+(size_t)xsize*j] = sparse_border(image,xsize,i,row,plan,max(sx-i,0),min(xconv,xsize-i+sx),m0,m1);
+
+		//NON BORDER PART -> vectorized, over the non-zero taps
+		if(i1 > i0) Sparse_row(image+(i0-sx)+(size_t)xsize*(row-sy),blurred+i0+(size_t)xsize*j,i1-i0,xsize,plan);
+	}
+
+	return;
+}
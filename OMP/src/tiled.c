@@ -0,0 +1,227 @@
+#include "ut.h"
+
+// =============================================================
+//  cache-blocked convolution engine
+//
+//  * Tiled_convolve
+//  * Bank_convolve
+//
+//  Same arithmetic as the direct engine, but the interior is split into tiles of output pixels, each done by a single thread
+//  ROW_BLOCK rows at a time (Interior_rows). Going down the rows of a tile, the yconv-1 input lines of the window below are reused
+//  from the previous block, hence the tile width is chosen so that those lines (xconv-1 pixels wider than the tile) and the kernel
+//  stay in cache: with big kernels the direct engine streams yconv whole image lines per output row instead, and becomes memory
+//  bound.
+//
+//  The tile size can be set through the environment variable BLUR_TILE ("WxH", or "N" for N x N); otherwise the width is the
+//  largest multiple of TILE_ALIGN fitting TILE_CACHE bytes of cache, and the height TILE_ROWS. Tiles are handed out to the threads
+//  dynamically, in row-major order or, if BLUR_TILE_ORDER is "morton", along a Z-order curve, so that tiles done at the same time
+//  are close to each other and share their input lines in the outer caches.
+//
+//  Border effect: the border pixels are done by Border_blur, exactly as in the direct engine.
+//
+//  Filter bank: Bank_convolve blurs the same image with several kernels, each into its own output, in a single traversal. Each tile
+//  is done with all the kernels in turn while its input lines are in cache (the tile size is the smallest the kernels would get on
+//  their own), so the image is streamed from memory once instead of once per kernel. All the kernels go through this engine, with
+//  the row kernels chosen for each of them by plan_kernel.
+// =============================================================
+
+#define TILE_CACHE  (256*1024)  //bytes of (per core) cache a tile should fit in
+#define TILE_ALIGN  64          //tile widths are multiples of this (a few SIMD vectors)
+#define TILE_ROWS   32          //default tile height
+
+static void tile_size(kernel_plan *plan, int width, int *tx, int *ty)
+//tile width and height for an interior width pixels wide
+{
+	int kbytes = sizeof(KTYPE)*plan->xconv*plan->yconv;
+
+	*tx = plan->tile_x;
+	*ty = plan->tile_y;
+
+	if(*tx <= 0)
+	{
+		*tx = (TILE_CACHE - kbytes)/((plan->depth8 ? 1 : (int)sizeof(unsigned short int))*plan->yconv) - (plan->xconv-1);
+		*tx = max(*tx/TILE_ALIGN*TILE_ALIGN,TILE_ALIGN);
+	}
+	if(*ty <= 0) *ty = TILE_ROWS;
+
+	*tx = max(min(*tx,width),1);
+}
+
+static int morton_x(int code)
+//even bits of code
+{
+	int k, x = 0;
+	for(k=0; k<15; k++) x |= ((code >> 2*k) & 1) << k;
+	return x;
+}
+
+void Tiled_convolve(void *image, void *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+//!! This function contains orphaned OMP directives -> to be used in a parallel region
+{
+	//order in which the tiles are done (static -> shared among the threads, if any)
+	static int *order;
+
+	KTYPE *kernel = plan->matrix;
+	int xconv = plan->xconv, yconv = plan->yconv, px = PLAN_PIXELS(plan);
+	int sx = xconv/2, sy = yconv/2;
+
+	//same bounds as in Convolve
+	int y_max = max(ysize-sy+lines_down,0), y_min = min(sy-lines_up,ysize);
+	int c0 = plan->cols_left, c1 = xsize-plan->cols_right;
+	int width = xsize-2*sx, height = y_max-y_min;
+	int i,j,t;
+
+	//BORDER CALCULATION -> MUST INCLUDE CHECKING (and BORDER EFFECT CORRECTION)
+
+	#pragma omp for collapse(2) nowait
+	for(j=0; j<y_min; j++)
+		for(i=c0; i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,kernel,plan->ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
+
+	#pragma omp for collapse(2) nowait
+	for(j=max(y_max,y_min); j<ysize; j++)
+		for(i=c0; i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,kernel,plan->ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
+
+	#pragma omp for collapse(2) nowait
+	for(j=y_min; j<y_max; j++)
+		for(i=c0; i<min(sx,xsize); i++) Border_blur(image,blurred,xsize,ysize,i,j,kernel,plan->ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
+
+	#pragma omp for collapse(2)
+	for(j=y_min; j<y_max; j++)
+		for(i=max(xsize-sx,sx); i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,kernel,plan->ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
+
+	if(width <= 0 || height <= 0) return;
+
+	//NON BORDER PART, NO CHECKS ON BOUNDARY -> tiles of rows
+
+	int tx,ty;
+	tile_size(plan,width,&tx,&ty);
+
+	int ntx = (width+tx-1)/tx, nty = (height+ty-1)/ty, ntiles = ntx*nty;
+
+	#pragma omp single
+	{
+		order = (int *)malloc(sizeof(int)*ntiles);
+
+		if(plan->morton)
+		{
+			//walk the Z-order curve, skipping the codes outside the grid of tiles
+			int code, n = 0;
+
+			for(code=0; n<ntiles; code++)
+			{
+				int x = morton_x(code), y = morton_x(code >> 1);
+				if(x < ntx && y < nty) order[n++] = x + ntx*y;
+			}
+		}
+		else
+			for(t=0; t<ntiles; t++) order[t] = t;
+	}
+
+	#pragma omp for schedule(dynamic)
+	for(t=0; t<ntiles; t++)
+	{
+		int i0 = sx + tx*(order[t]%ntx), j0 = y_min + ty*(order[t]/ntx);
+		int n = min(tx,sx+width-i0), jlim = min(j0+ty,y_max);
+
+		//image must be shifted by the amount of lines that has more than the blurring region (+lines_up)
+		for(j=j0; j+ROW_BLOCK<=jlim; j+=ROW_BLOCK) Interior_rows(PIX_AT(image,(i0-sx)+(size_t)xsize*(j-sy+lines_up),px),PIX_AT(blurred,i0+(size_t)xsize*j,px),n,xsize,plan);
+		for(; j<jlim; j++) Interior_row(PIX_AT(image,(i0-sx)+(size_t)xsize*(j-sy+lines_up),px),PIX_AT(blurred,i0+(size_t)xsize*j,px),n,xsize,plan);
+	}
+
+	#pragma omp single
+	free(order);
+
+	return;
+}
+
+void Bank_convolve(void *image, void **blurred, int xsize, int ysize, kernel_plan *plans, int nplans, int lines_up, int lines_down)
+/*
+* Blurs the image with the nplans kernels plans[k] at once, into blurred[k]. The halo must be the one of the tallest kernel (or what is left
+* of the image), and the pixels in the same format for all the plans.
+*
+* !! This function contains orphaned OMP directives -> to be used in a parallel region
+*/
+{
+	static int *order;
+
+	int i,j,k,t;
+	int tx = xsize, ty = ysize;
+
+	//BORDER CALCULATION -> MUST INCLUDE CHECKING (and BORDER EFFECT CORRECTION), each kernel with the halo lines it needs
+	for(k=0; k<nplans; k++)
+	{
+		kernel_plan *plan = plans+k;
+		int sx = plan->xconv/2, sy = plan->yconv/2, up = min(lines_up,sy), down = min(lines_down,sy), px = PLAN_PIXELS(plan);
+		int y_max = max(ysize-sy+down,0), y_min = min(sy-up,ysize);
+		void *in = PIX_AT(image,(size_t)xsize*(lines_up-up),px);
+
+		#pragma omp for collapse(2) nowait
+		for(j=0; j<y_min; j++)
+			for(i=0; i<xsize; i++) Border_blur(in,blurred[k],xsize,ysize,i,j,plan->matrix,plan->ksum,plan->xconv,plan->yconv,sx,sy,up,down,px);
+
+		#pragma omp for collapse(2) nowait
+		for(j=max(y_max,y_min); j<ysize; j++)
+			for(i=0; i<xsize; i++) Border_blur(in,blurred[k],xsize,ysize,i,j,plan->matrix,plan->ksum,plan->xconv,plan->yconv,sx,sy,up,down,px);
+
+		#pragma omp for collapse(2) nowait
+		for(j=y_min; j<y_max; j++)
+			for(i=0; i<min(sx,xsize); i++) Border_blur(in,blurred[k],xsize,ysize,i,j,plan->matrix,plan->ksum,plan->xconv,plan->yconv,sx,sy,up,down,px);
+
+		#pragma omp for collapse(2) nowait
+		for(j=y_min; j<y_max; j++)
+			for(i=max(xsize-sx,sx); i<xsize; i++) Border_blur(in,blurred[k],xsize,ysize,i,j,plan->matrix,plan->ksum,plan->xconv,plan->yconv,sx,sy,up,down,px);
+
+		//smallest tile among the kernels
+		int kx,ky;
+		tile_size(plan,xsize,&kx,&ky);
+		tx = min(tx,kx);
+		ty = min(ty,ky);
+	}
+
+	if(xsize <= 0 || ysize <= 0) return;
+
+	//NON BORDER PART, NO CHECKS ON BOUNDARY -> tiles of the whole image, each with every kernel over the part of it in the kernel's interior
+
+	int ntx = (xsize+tx-1)/tx, nty = (ysize+ty-1)/ty, ntiles = ntx*nty;
+
+	#pragma omp single
+	{
+		order = (int *)malloc(sizeof(int)*ntiles);
+
+		if(plans[0].morton)
+		{
+			int code, n = 0;
+
+			for(code=0; n<ntiles; code++)
+			{
+				int x = morton_x(code), y = morton_x(code >> 1);
+				if(x < ntx && y < nty) order[n++] = x + ntx*y;
+			}
+		}
+		else
+			for(t=0; t<ntiles; t++) order[t] = t;
+	}
+
+	#pragma omp for schedule(dynamic)
+	for(t=0; t<ntiles; t++)
+		for(k=0; k<nplans; k++)
+		{
+			kernel_plan *plan = plans+k;
+			int sx = plan->xconv/2, sy = plan->yconv/2, up = min(lines_up,sy), down = min(lines_down,sy), px = PLAN_PIXELS(plan);
+			int y_max = max(ysize-sy+down,0), y_min = min(sy-up,ysize);
+
+			//the tile, clipped to the interior of this kernel
+			int i0 = max(tx*(order[t]%ntx),sx), i1 = min(tx*(order[t]%ntx+1),xsize-sx);
+			int j0 = max(ty*(order[t]/ntx),y_min), jlim = min(ty*(order[t]/ntx+1),y_max);
+			if(i1 <= i0) continue;
+
+			//image must be shifted by the amount of lines that has more than the blurring region (+lines_up)
+			for(j=j0; j+ROW_BLOCK<=jlim; j+=ROW_BLOCK) Interior_rows(PIX_AT(image,(i0-sx)+(size_t)xsize*(j-sy+lines_up),px),PIX_AT(blurred[k],i0+(size_t)xsize*j,px),i1-i0,xsize,plan);
+			for(; j<jlim; j++) Interior_row(PIX_AT(image,(i0-sx)+(size_t)xsize*(j-sy+lines_up),px),PIX_AT(blurred[k],i0+(size_t)xsize*j,px),i1-i0,xsize,plan);
+		}
+
+	#pragma omp single
+	free(order);
+
+	return;
+}
@@ -1,10 +1,22 @@
 #include "ut.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 // =============================================================
 //  utilities for managing pgm files
 //
 //  * write_pgm_image
 //  * read_pgm_image
+//  * read_pgm_header
+//  * write_pgm_header
+//  * read_pgm_buffer
+//  * map_pgm_image
+//  * unmap_pgm_image
 //  * swap_image
+//  * widen_image
+//  * narrow_image
 //
 // =============================================================
 
@@ -71,6 +83,11 @@ void read_pgm_image( void **image, int *maxval, int *xsize, int *ysize, const ch
 
   *image = NULL;
   *xsize = *ysize = *maxval = 0;
+  if ( image_file == NULL )
+    {
+      *maxval = -4;         // this is the signal that the file could not be opened
+      return;
+    }
   
   char    MagicN[2];
   char   *line = NULL;
@@ -113,8 +130,8 @@ void read_pgm_image( void **image, int *maxval, int *xsize, int *ysize, const ch
   
   if ( fread( *image, 1, size, image_file) != size )
     {
-      free( image );
-      image   = NULL;
+      free( *image );
+      *image  = NULL;
       *maxval = -3;         // this is the signal that there was an i/o error
       *xsize  = 0;
       *ysize  = 0;
@@ -125,6 +142,168 @@ void read_pgm_image( void **image, int *maxval, int *xsize, int *ysize, const ch
 }
 
 
+FILE *read_pgm_header( int *maxval, int *xsize, int *ysize, const char *image_name)
+/*
+ * Opens the file image_name and reads its header as read_pgm_image does: the file is returned positioned at the first pixel, to be read
+ * (e.g. a few rows at a time) and closed by the caller. Returns NULL on errors, *maxval being negative as in read_pgm_buffer.
+ */
+{
+  FILE* image_file = fopen(image_name, "r");
+
+  *xsize = *ysize = 0;
+  *maxval = -4;
+  if ( image_file == NULL )
+    return NULL;
+
+  char    MagicN[3];
+  char   *line = NULL;
+  size_t  n = 0;
+  ssize_t k;
+
+  // get the Magic Number, skip all the comments
+  if ( fscanf(image_file, "%2s%*c", MagicN ) < 1 ) k = -1;
+  else
+    {
+      k = getline( &line, &n, image_file);
+      while ( (k > 0) && (line[0]=='#') )
+        k = getline( &line, &n, image_file);
+    }
+
+  *maxval = -1;
+  if ( (k <= 0) || (sscanf(line, "%d%*c%d%*c%d%*c", xsize, ysize, maxval) < 3 && fscanf(image_file, "%d%*c", maxval) < 1) || *maxval < 0 )
+    {
+      *xsize = *ysize = 0;
+      *maxval = -1;
+      fclose(image_file);
+      image_file = NULL;
+    }
+
+  free( line );
+  return image_file;
+}
+
+FILE *write_pgm_header( int maxval, int xsize, int ysize, const char *image_name)
+/*
+ * Creates the file image_name with the same header as write_pgm_image: the pixels are then to be written (e.g. a few rows at a time)
+ * and the file closed by the caller. Returns NULL if the file cannot be created.
+ */
+{
+  FILE* image_file = fopen(image_name, "w");
+
+  if ( image_file != NULL )
+    fprintf(image_file, "P5\n# generated by\n# put here your name\n%d %d\n%d\n", xsize, ysize, maxval);
+  return image_file;
+}
+
+int read_pgm_buffer( void **image, size_t *capacity, int *maxval, int *xsize, int *ysize, const char *image_name)
+/*
+ * Same as read_pgm_image, but the pixels go into *image, which holds *capacity bytes: it is reallocated (and *capacity updated) only
+ * if too small, so that many images can be read into the same few buffers. Returns 0 on success; on errors *maxval is negative as in
+ * read_pgm_image (-4 if the file cannot be opened) and the buffer is kept.
+ */
+{
+  FILE* image_file = read_pgm_header(maxval, xsize, ysize, image_name);
+
+  if ( image_file == NULL )
+    return *maxval;
+
+  size_t size = (size_t)*xsize * *ysize * (1 + ( *maxval > 255 ));
+
+  if ( size > *capacity )
+    {
+      void *bigger = realloc( *image, size );
+      if ( bigger == NULL ) *maxval = -2;
+      else *image = bigger, *capacity = size;
+    }
+
+  if ( *maxval > 0 && fread( *image, 1, size, image_file) != size )
+    *maxval = -3;
+
+  fclose(image_file);
+
+  if ( *maxval < 0 ) *xsize = *ysize = 0;
+  return *maxval < 0 ? *maxval : 0;
+}
+
+static int pgm_header_field( const unsigned char *header, size_t length, size_t *pos, int *value )
+// next number of a pgm header, skipping whitespaces and comments; returns 0 if there is none
+{
+  while ( *pos < length && (isspace(header[*pos]) || header[*pos] == '#') )
+    if ( header[(*pos)++] == '#' )
+      while ( *pos < length && header[*pos] != '\n' ) (*pos)++;
+
+  if ( *pos >= length || !isdigit(header[*pos]) )
+    return 0;
+
+  for ( *value = 0; *pos < length && isdigit(header[*pos]); (*pos)++ )
+    *value = 10 * *value + (header[*pos] - '0');
+  return 1;
+}
+
+int map_pgm_image( void **map, size_t *length, void **pixels, int *maxval, int *xsize, int *ysize, const char *image_name)
+/*
+ * Same as read_pgm_image, without reading the pixels: the file is mapped in memory (*map, *length bytes, to be released through
+ * unmap_pgm_image) and *pixels points to them inside the mapping, so that they are loaded from the page cache only when (and by the
+ * thread which) first touches them. The mapping is read only: images whose pixels are to be modified in place (e.g. swapped) must be
+ * read in a buffer instead, by read_pgm_image. Returns 0 on success, a negative *maxval on errors as read_pgm_buffer does.
+ *
+ * NOTE: the pixels start right after the header, which may have an odd length: *pixels is then not aligned to an unsigned short and
+ * cannot be used as such (the image must be read in a buffer instead, by read_pgm_image).
+ */
+{
+  int fd = open(image_name, O_RDONLY);
+  struct stat info;
+
+  *map = *pixels = NULL;
+  *length = 0;
+  *xsize = *ysize = 0;
+  *maxval = -4;
+  if ( fd < 0 )
+    return *maxval;
+
+  if ( fstat(fd, &info) || info.st_size == 0 ||
+       (*map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED )
+    {
+      close(fd);
+      *map = NULL;
+      return *maxval = -2;
+    }
+  close(fd);
+  *length = info.st_size;
+
+  // the pixels are gone through in order (by each thread)
+  madvise(*map, *length, MADV_SEQUENTIAL);
+
+  const unsigned char *header = (const unsigned char *)*map;
+  size_t pos = 2;
+
+  *maxval = -1;
+  if ( *length < 2 || header[0] != 'P' || header[1] != '5' ||
+       !pgm_header_field(header, *length, &pos, xsize) || !pgm_header_field(header, *length, &pos, ysize) ||
+       !pgm_header_field(header, *length, &pos, maxval) )
+    *maxval = -1;
+  // a single whitespace separates the header from the pixels
+  else if ( *length - ++pos < (size_t)*xsize * *ysize * (1 + ( *maxval > 255 )) )
+    *maxval = -3;
+  else
+    *pixels = (char *)*map + pos;
+
+  if ( *maxval < 0 )
+    {
+      unmap_pgm_image(*map, *length);
+      *map = *pixels = NULL;
+      *length = 0;
+      *xsize = *ysize = 0;
+    }
+  return *maxval < 0 ? *maxval : 0;
+}
+
+void unmap_pgm_image( void *map, size_t length )
+{
+  if ( map != NULL )
+    munmap(map, length);
+}
+
 void OMP_swap_image( void *image, int xsize, int ysize, int maxval )
 /*
  * This routine swaps the endianism of the memory area pointed
@@ -148,6 +327,37 @@ void OMP_swap_image( void *image, int xsize, int ysize, int maxval )
   return;
 }
 
+void OMP_widen_image( unsigned short int *wide, const unsigned char *image, int xsize, int ysize, int bswap )
+/*
+ * Copies the 8-bit image into the 16-bit buffer wide, which the engines
+ * work on: in the byte order of the file if bswap (see plan_byteswap),
+ * in the one of the machine otherwise
+ *
+ * !! This function contains orphaned OMP directives -> to be used in a parallel region
+ */
+{
+  size_t size = (size_t)xsize * ysize;
+  #pragma omp for
+  for ( size_t i = 0; i < size; i++ )
+    wide[i] = pixel(image[i], bswap);
+  return;
+}
+
+void OMP_narrow_image( unsigned char *image, const unsigned short int *wide, int xsize, int ysize, int maxval, int bswap )
+/*
+ * Inverse of OMP_widen_image: copies the 16-bit result wide back into
+ * the 8-bit image, clipped to maxval
+ *
+ * !! This function contains orphaned OMP directives -> to be used in a parallel region
+ */
+{
+  size_t size = (size_t)xsize * ysize;
+  #pragma omp for
+  for ( size_t i = 0; i < size; i++ )
+    image[i] = min(pixel(wide[i], bswap), maxval);
+  return;
+}
+
 
 
 // =============================================================
@@ -223,6 +433,9 @@ void * generate_gradient( int maxval, int xsize, int ysize )
 //	*weighted_kernel
 //	*gaussian_kernel
 //	*normalize
+//	*read_kernel_spec
+//	*plan_kernel
+//	*plan_byteswap
 //
 // =============================================================
 
@@ -274,114 +487,545 @@ void gaussian_kernel(KTYPE *mat, size_t x, size_t y, KTYPE sigma_sq)
 	return;
 }
 
-KTYPE *normalize(void *kimage,size_t x,size_t y,int maxval)
+KTYPE *normalize(void *kimage,size_t x,size_t y,int maxval,KTYPE *unit)
+/*
+* Weights of the kernel read from a pgm file (x*y values up to maxval, 16bit ones in the byte order of the file, big-endian), scaled to a
+* unit sum. *unit is set to the weight of one level of the file, the step of the quantization which the weights carry.
+*/
 {
 	KTYPE norm,*ret = (KTYPE *)malloc(sizeof(KTYPE)*x*y);
 	int i,j;
 	KTYPE sum=0;
 	for(j=0;j<y;j++)
-		for(i=0;i<x;i++) sum += maxval>255 ? ((unsigned short int *)kimage)[i+x*j] : ((char *)kimage)[i+x*j];
+		for(i=0;i<x;i++) sum += maxval>255 ? pixel(((unsigned short int *)kimage)[i+x*j],I_M_LITTLE_ENDIAN) : ((unsigned char *)kimage)[i+x*j];
 		
 	norm = 1.0/sum;
+	*unit = norm;
 	
 	for(j=0;j<y;j++)
-		for(i=0;i<x;i++) ret[i+x*j] = maxval>255 ? ((unsigned short int *)kimage)[i+x*j]*norm : ((char *)kimage)[i+x*j]*norm;
+		for(i=0;i<x;i++) ret[i+x*j] = maxval>255 ? pixel(((unsigned short int *)kimage)[i+x*j],I_M_LITTLE_ENDIAN)*norm : ((unsigned char *)kimage)[i+x*j]*norm;
 	return ret;
 }
 
+int read_kernel_spec(char **argv, int *arg, int last, KTYPE **kernel, int *xkernel, int *ykernel, KTYPE *f, int verbose)
+/*
+* Builds the kernel of one spec of a filter bank, given as on the command line for a single kernel (types 0 to 3), from argv[*arg+1]
+* on without going past argv[last], and advances *arg over it. Returns the kernel type, -1 if the spec is not valid or its kernel file
+* cannot be read (a message is printed if verbose is non zero).
+*/
+{
+	int ktype = -1, need = 0;
+
+	if(*arg < last)
+	{
+		ktype = atoi(argv[++*arg]);
+		need = (ktype == 3) ? 1 : (ktype == 1) ? 3 : 2;
+	}
+	if(ktype < 0 || ktype > 3 || *arg+need > last)
+	{
+		if(verbose) printf("Invalid kernel spec: kernel id must be 0,1,2 or 3, followed by its dimensions (and f for id 1) or by a pgm file (id 3)\n");
+		return -1;
+	}
+
+	*f = 0;
+
+	if(ktype == 3)
+	{
+		int kmaxval;
+		void *kimage;
+
+		read_pgm_image(&kimage, &kmaxval, xkernel, ykernel, argv[++*arg]);
+		if(kmaxval < 0)
+		{
+			if(verbose) printf("Could not read kernel \"%s\".\n",argv[*arg]);
+			return -1;
+		}
+		*kernel = normalize(kimage,*xkernel,*ykernel,kmaxval,f);
+		free(kimage);
+		if(verbose) printf("Using Kernel imported from \"%s\" of dimension %dx%d\n",argv[*arg],*xkernel,*ykernel);
+
+		return ktype;
+	}
+
+	*xkernel = atoi(argv[++*arg]);
+	*ykernel = atoi(argv[++*arg]);
+	if(!(*xkernel%2) || !(*ykernel%2) || *xkernel < 0 || *ykernel < 0)
+	{
+		if(verbose) printf("Kernel dimensions must be odd integers. Dimensions given were %dx%d\n",*xkernel,*ykernel);
+		return -1;
+	}
+
+	*kernel = (KTYPE *)malloc(*xkernel * *ykernel * sizeof(KTYPE));
+
+	switch(ktype)
+	{
+		case 0:
+			uniform_kernel(*kernel,*xkernel,*ykernel);
+			if(verbose) printf("Using Mean Kernel of dimension %dx%d\n",*xkernel,*ykernel);
+		break;
+
+		case 1:
+			*f = atof(argv[++*arg]);
+			weighted_kernel(*kernel,*xkernel,*ykernel,*f);
+			if(verbose) printf("Using Weighted Kernel of dimension %dx%d and f = %f\n",*xkernel,*ykernel,*f);
+		break;
+
+		case 2:
+		{
+			//same sigma as for a single kernel
+			int s = max((*xkernel/2),(*ykernel/2));
+			gaussian_kernel(*kernel,*xkernel,*ykernel,s*s);
+			if(verbose) printf("Using Gaussian Kernel of dimension %dx%d (s: %d)\n",*xkernel,*ykernel,s);
+		}
+		break;
+	}
+
+	return ktype;
+}
+
+
+/*
+* KERNEL PLANNING
+*/
+
+static const char *engine_names[] = {"direct", "separable", "box", "weighted", "fft", "iir", "tiled", "fixed", "lowrank", "sparse", "winograd"};
+#define N_ENGINES (int)(sizeof(engine_names)/sizeof(engine_names[0]))
+
+const char *engine_name(int engine)
+{
+	return (engine >= 0 && engine < N_ENGINES) ? engine_names[engine] : "unknown";
+}
+
+int separable_factors(KTYPE *mat, int x, int y, KTYPE *xvec, KTYPE *yvec)
+/*
+* Tries to write mat as the outer product xvec (x) yvec. The factors are taken to be the marginals of the kernel (sums along columns and rows) divided by the total,
+* so that each of them sums to 1: this is exact whenever the kernel is separable, and the final check tells whether it is. Returns 1 if the kernel is separable, 0 otherwise.
+* Sums are done in double precision, since with big kernels the float ones would bias the (non renormalized) interior.
+*/
+{
+	int i,j;
+	double total = 0, big = 0, *xsum = (double *)calloc(x,sizeof(double)), *ysum = (double *)calloc(y,sizeof(double));
+	
+	for(j=0;j<y;j++)
+		for(i=0;i<x;i++)
+		{
+			xsum[i] += mat[i+x*j];
+			ysum[j] += mat[i+x*j];
+			total += mat[i+x*j];
+			big = max(big,fabs(mat[i+x*j]));
+		}
+	
+	for(i=0;i<x;i++) xvec[i] = xsum[i]/total;
+	for(j=0;j<y;j++) yvec[j] = ysum[j]/total;
+	
+	free(xsum);
+	free(ysum);
+	
+	for(j=0;j<y;j++)
+		for(i=0;i<x;i++) if(fabs(xvec[i]*yvec[j]-mat[i+x*j]) > 1e-4*big) return 0;
+		
+	return 1;
+}
+
+int kernel_symmetry(KTYPE *mat, int x, int y)
+/*
+* SYM_X and/or SYM_Y if the weights of mat are (exactly) equal under reflection along x and/or y, 0 if neither.
+*/
+{
+	int i,j,sym = SYM_X|SYM_Y;
+	
+	for(j=0;j<y;j++)
+		for(i=0;i<x;i++)
+		{
+			if(mat[i+x*j] != mat[(x-1-i)+x*j]) sym &= ~SYM_X;
+			if(mat[i+x*j] != mat[i+x*(y-1-j)]) sym &= ~SYM_Y;
+		}
+	
+	return sym;
+}
+
+int plan_kernel(kernel_plan *plan, KTYPE *matrix, int xconv, int yconv, int ktype, KTYPE param)
+/*
+* Fills plan with everything the engines need and chooses the engine: the fastest one applicable to the kernel type, unless the environment variable BLUR_ENGINE
+* names a different one. Returns 0 if the requested engine (if any) has been honoured, 1 if it was unknown or not applicable to this kernel.
+* param is the additional kernel parameter (sigma for the recursive gaussian, which has no matrix and can only be done by its own engine, the
+* quantization step of the file for custom kernels, see normalize).
+*/
+{
+	int e;
+	char *forced = getenv("BLUR_ENGINE");
+	
+	plan->ktype = ktype;
+	plan->xconv = xconv;
+	plan->yconv = yconv;
+	plan->matrix = matrix;
+	plan->xvec = plan->yvec = NULL;
+	plan->ksum = NULL;
+	plan->qmatrix = NULL;
+	plan->qsum = NULL;
+	plan->xterms = plan->yterms = NULL;
+	plan->rank = 0;
+	plan->kunit = ktype == 3 ? param : 0;
+	plan->tap_start = plan->tap_l = NULL;
+	plan->tap_w = NULL;
+	plan->ntaps = 0;
+	plan->wino = NULL;
+	plan->boxlike = 0;
+	plan->symmetry = matrix ? kernel_symmetry(matrix,xconv,yconv) : 0;
+	plan->bswap = 0;
+	plan->depth8 = 0;
+	plan->cols_left = plan->cols_right = 0;
+	plan->simd = simd_select(plan,0);
+	
+	//tile size ("WxH" or "N") and order of the tiled engine
+	char *tile = getenv("BLUR_TILE"), *order = getenv("BLUR_TILE_ORDER");
+	plan->tile_x = plan->tile_y = 0;
+	if(tile && sscanf(tile,"%dx%d",&plan->tile_x,&plan->tile_y) == 1) plan->tile_y = plan->tile_x;
+	plan->morton = order && !strcmp(order,"morton");
+	
+	if(ktype == 4)
+	{
+		plan->sigma = param;
+		plan->engine = ENGINE_IIR;
+		return forced && strcmp(forced,engine_names[ENGINE_IIR]);
+	}
+	
+	//weights of the clipped kernel on the borders, and list of its non-zero taps
+	plan->ksum = kernel_prefix_sums(matrix,xconv,yconv);
+	sparse_taps(plan);
+	
+	//separable factors, kept only if the kernel really is an outer product
+	plan->xvec = (KTYPE *)malloc(xconv*sizeof(KTYPE));
+	plan->yvec = (KTYPE *)malloc(yconv*sizeof(KTYPE));
+	if(!separable_factors(matrix,xconv,yconv,plan->xvec,plan->yvec))
+	{
+		free(plan->xvec);
+		free(plan->yvec);
+		plan->xvec = plan->yvec = NULL;
+	}
+	
+	//constant weights (but possibly the central one) allow the use of box sums
+	int centre = xconv/2 + xconv*(yconv/2);
+	plan->f = matrix[centre];
+	plan->w = matrix[centre ? 0 : min(1,xconv*yconv-1)];
+	plan->boxlike = 1;
+	for(e=0; e<xconv*yconv; e++) if(e != centre && matrix[e] != plan->w) plan->boxlike = 0;
+	
+	//automatic choice: mean and gaussian kernels are outer products by construction, mean and weighted ones have constant weights,
+	//anything else is done directly, in cache-sized tiles
+	plan->engine = ENGINE_TILED;
+	if(plan->xvec && (ktype == 0 || ktype == 2)) plan->engine = ENGINE_SEPARABLE;
+	if(plan->boxlike && plan->f == plan->w && ktype == 0) plan->engine = ENGINE_BOX;
+	if(plan->boxlike && ktype == 1) plan->engine = ENGINE_WEIGHTED;
+	
+	//big custom kernels are best done in the frequency domain
+	char *fft_taps = getenv("BLUR_FFT_TAPS");
+	int min_taps = fft_taps ? atoi(fft_taps) : FFT_MIN_TAPS;
+	if(ktype == 3 && xconv*yconv >= min_taps) plan->engine = ENGINE_FFT;
+	
+	//...unless they are mostly zeros (fewer non-zero taps than the FFT threshold), or (nearly) a sum of a few separable terms which is cheaper still
+	if(ktype == 3 && plan->ntaps <= SPARSE_MAX_DENSITY*xconv*yconv && plan->ntaps < min_taps) plan->engine = ENGINE_SPARSE;
+	if(ktype == 3 && max(xconv,yconv) <= LOWRANK_MAX_SIZE && lowrank_factors(plan) == 1)
+		if(plan->engine != ENGINE_SPARSE || plan->rank*(xconv+yconv) < plan->ntaps) plan->engine = ENGINE_LOWRANK;
+	
+	//without vector units, 3x3 and 5x5 kernels with no symmetry to fold take about half the time with minimal filtering
+	if(plan->engine == ENGINE_TILED && ktype == 3 && plan->simd == SIMD_SCALAR && !plan->symmetry && winograd_kernel(plan)) plan->engine = ENGINE_WINOGRAD;
+	
+	if(!forced) return 0;
+	
+	for(e=0; e<N_ENGINES; e++) if(!strcmp(forced,engine_names[e])) break;
+	
+	switch(e)
+	{
+		case ENGINE_DIRECT: case ENGINE_FFT: case ENGINE_TILED: case ENGINE_SPARSE:
+			plan->engine = e;
+		return 0;
+		
+		case ENGINE_SEPARABLE:
+			if(!plan->xvec) return 1;
+			plan->engine = e;
+		return 0;
+		
+		case ENGINE_BOX:
+			if(!plan->boxlike || plan->f != plan->w) return 1;
+			plan->engine = e;
+		return 0;
+		
+		case ENGINE_WEIGHTED:
+			if(!plan->boxlike) return 1;
+			plan->engine = e;
+		return 0;
+		
+		//opt-in only
+		case ENGINE_FIXED:
+			quantize_kernel(plan);
+			plan->engine = e;
+		return 0;
+		
+		//3x3 and 5x5 kernels only
+		case ENGINE_WINOGRAD:
+			if(!plan->wino && !winograd_kernel(plan)) return 1;
+			plan->engine = e;
+		return 0;
+		
+		//any kernel, with the rank needed for the error threshold, if that is cheaper than the dense kernel
+		case ENGINE_LOWRANK:
+			if(!plan->xterms) lowrank_factors(plan);
+			if(plan->rank*(plan->xconv+plan->yconv) >= plan->xconv*plan->yconv) return 1;
+			plan->engine = e;
+		return 0;
+	}
+	
+	return 1;
+}
+
+int plan_byteswap(kernel_plan *plan)
+/*
+* Lets the engine of plan take the pixels in the byte order of the file (big-endian) and write the result in the same order, swapping them
+* as they are loaded and stored instead of in two sweeps over the whole image and result: the input is then left untouched. Only the direct
+* and tiled engines can (their row kernels are switched too, see simd_select). Returns 1 if the engine of plan has
+* been switched, 0 if the pixels must still be swapped in memory before and after the blurring (or the machine is big-endian already).
+*/
+{
+	if(!I_M_LITTLE_ENDIAN || (plan->engine != ENGINE_DIRECT && plan->engine != ENGINE_TILED)) return 0;
+	
+	plan->bswap = 1;
+	plan->simd = simd_select(plan,1);
+	
+	return 1;
+}
+
+int plan_depth8(kernel_plan *plan, int maxval)
+/*
+* Lets the engine of plan read and write the pixels of an 8bit image (maxval < 256) as they are, widening them to floats in the row kernels
+* as they are loaded and narrowing them as they are stored, instead of widening the whole image to 16bit before and narrowing the result
+* after. Only the direct and tiled engines can, as for plan_byteswap. Returns 1 if the engine of plan takes the 8bit pixels, 0 if they must
+* still be widened (and for 16bit images, which switch the plan back). Must be called outside of parallel regions.
+*/
+{
+	int depth8 = maxval < 256 && (plan->engine == ENGINE_DIRECT || plan->engine == ENGINE_TILED);
+	
+	if(depth8 != plan->depth8)
+	{
+		plan->depth8 = depth8;
+		plan->simd = simd_select(plan,plan->bswap);
+	}
+	
+	return depth8;
+}
+
+void free_plan(kernel_plan *plan)
+{
+	free(plan->xvec);
+	free(plan->yvec);
+	free(plan->ksum);
+	free(plan->qmatrix);
+	free(plan->qsum);
+	free(plan->xterms);
+	free(plan->yterms);
+	free(plan->tap_start);
+	free(plan->tap_l);
+	free(plan->tap_w);
+	free(plan->wino);
+	plan->xvec = plan->yvec = NULL;
+	plan->tap_start = plan->tap_l = NULL;
+	plan->tap_w = NULL;
+	plan->xterms = plan->yterms = NULL;
+	plan->ksum = NULL;
+	plan->qmatrix = NULL;
+	plan->qsum = NULL;
+	plan->wino = NULL;
+}
+
+double *kernel_prefix_sums(KTYPE *mat, int x, int y)
+/*
+* 2D prefix sums of the kernel, in double precision: ksum[l+(x+1)*m] is the sum of the taps above and on the left of (l,m), excluded. The table has (x+1)*(y+1) entries.
+*/
+{
+	int l,m;
+	double *ksum = (double *)calloc((size_t)(x+1)*(y+1),sizeof(double));
+	
+	for(m=0; m<y; m++)
+		for(l=0; l<x; l++) ksum[(l+1)+(x+1)*(m+1)] = mat[l+x*m] + ksum[l+(x+1)*(m+1)] + ksum[(l+1)+(x+1)*m] - ksum[l+(x+1)*m];
+	
+	return ksum;
+}
+
+double kernel_weight(double *ksum, int xconv, int l0, int l1, int m0, int m1)
+//sum of the kernel taps with l0 <= l < l1 and m0 <= m < m1, in constant time
+{
+	return ksum[l1+(xconv+1)*m1] - ksum[l0+(xconv+1)*m1] - ksum[l1+(xconv+1)*m0] + ksum[l0+(xconv+1)*m0];
+}
+
 
 /*
 * CONVOLUTION  - MPI
 */
 
-void Border_blur(unsigned short int *image, unsigned short int *blurred ,int xsize, int ysize, int i, int j, KTYPE *convolution_matrix, int xconv, int yconv ,int sx, int sy, int lines_up, int lines_down)
+void Border_blur(void *image, void *blurred ,int xsize, int ysize, int i, int j, KTYPE *convolution_matrix, double *ksum, int xconv, int yconv ,int sx, int sy, int lines_up, int lines_down, int px)
 /*
 * Does the blurring for points on the border, i.e. for the values of (i,j) such that the dimensions of the kernel centered here exceeds the dimensions of the image itself 
+* (pixels read and written in the format px, see PIX_*)
 */
 {
 
 	//indices representing the position wrt the kernel
 	int l,m; 
-		
-	//normalization constant (actually its inverse) -> it must be evaluated again since some parts of the kernel are not used here, hence the rest is not properly normalized anymore
-	KTYPE norm = 0;
 	
 	//stores the partial sums for the final value of the blurred image in (i,j) : here used instead of the natural choice of the blurred matrix itself to avoid lossy conversions from
 	//floating point to unsigned integer -> this loss is minimized by doing it only once at the end. 
 	KTYPE buffer = 0;
 	
-	/*here (and int the initializarion of the for loop) the limits of kernel positions are evaluated: this evaluation takes into account the presence of some additional lines of image
+	/*here the limits of kernel positions are evaluated: this evaluation takes into account the presence of some additional lines of image
 	* above and below the blurred one, to match the presence of halo layers, but at the same time makes sure that this does not yield an illegal index, in this case smaller than 0 or 
 	* bigger than the size of the image -> this could happen in the pathological case in which the halo layer is very thick (thicker than the image/chunk of image itself) or when the 
 	* image/chunk of image is very shallow (due to the presence of a lot of processors for instance).*/
 	  
-	int mlim = min(yconv,ysize+lines_down-j+sy);
-	int llim = min(xconv,xsize-i+sx);
-
-	for(m=max(sy-lines_up-j,0) ; m<mlim ; m++)
-		for(l=max(sx-i,0) ; l<llim ; l++)	
-		{	
-			//acutal convolution and renormalization	
-			//image must be shifted by the amount of lines that has more than the blurring region (+lines_up)
-			buffer += image[(i-sx+l)+xsize*(j-sy+m+lines_up)]*convolution_matrix[l+xconv*m];
-			norm+=convolution_matrix[l+xconv*m];
+	int mmin = max(sy-lines_up-j,0), mlim = min(yconv,ysize+lines_down-j+sy);
+	int lmin = max(sx-i,0), llim = min(xconv,xsize-i+sx);
+
+	for(m=mmin ; m<mlim ; m++)
+	{
+		//image must be shifted by the amount of lines that has more than the blurring region (+lines_up)
+		void *in = PIX_AT(image,(size_t)xsize*(j-sy+m+lines_up)+i-sx,px);
+		KTYPE *k = convolution_matrix + xconv*m;
+		
+		if(px == PIX_BYTE)
+		{
+			#pragma omp simd reduction(+:buffer)
+			for(l=lmin ; l<llim ; l++) buffer += ((unsigned char *)in)[l]*k[l];
+		}
+		else
+		{
+			#pragma omp simd reduction(+:buffer)
+			for(l=lmin ; l<llim ; l++) buffer += pixel(((unsigned short int *)in)[l],px)*k[l];
 		}
-				
-	blurred[i+xsize*j]=buffer/norm + 0.5;
+	}
+	
+	//normalization constant -> some parts of the kernel are not used here, hence the rest is not properly normalized anymore: its weight comes from the prefix sums of the kernel
+	double value = buffer/kernel_weight(ksum,xconv,lmin,llim,mmin,mlim) + 0.5;
+	if(px == PIX_BYTE) ((unsigned char *)blurred)[i+(size_t)xsize*j] = value;
+	else ((unsigned short int *)blurred)[i+(size_t)xsize*j] = pixel(value,px);
 }
 
 /*
 * CONVOLUTION  - OMP
 */
 
-void OMP_Convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, KTYPE *convolution_matrix, int xconv, int yconv) 
-//!! This function contains orphaned OMP directives -> to be used in a parallel region
+void OMP_Convolve(void *image, void *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+/*
+* Same as Convolve in the MPI version: image holds lines_up and lines_down extra lines above and below the ysize lines to be blurred into blurred
+* (0 for a whole image, the halo of a strip in streaming mode).
+*
+* !! This function contains orphaned OMP directives -> to be used in a parallel region
+*/
 {
-
-
-	
+	KTYPE *convolution_matrix = plan->matrix;
+	double *ksum = plan->ksum;
+	int xconv = plan->xconv, yconv = plan->yconv, px = PLAN_PIXELS(plan);
 	int sx = xconv/2, sy = yconv/2;
+	
+	//calculation of the bounds for i and j -> same as the comment in Border_blur(); the halo columns c0 and c1 on (see cols_left) are skipped
+	int y_max = max(ysize-sy+lines_down,0), y_min = min(sy-lines_up,ysize); 
+	int c0 = plan->cols_left, c1 = xsize-plan->cols_right;
 	int i,j;
 	
 	//BORDER CALCULATION -> MUST INCLUDE CHECKING (and BORDER EFFECT CORRECTION)
 	
 	#pragma omp for collapse(2) nowait 
-	for(j=0; j<sy; j++)
-		for(i=0; i<xsize; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,xconv,yconv,sx,sy,0,0);
+	for(j=0; j<y_min; j++)
+		for(i=c0; i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
 
 	
 	#pragma omp for collapse(2) nowait
-	for(j=ysize-sy; j<ysize; j++)
-		for(i=0; i<xsize; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,xconv,yconv,sx,sy,0,0);
+	for(j=max(y_max,y_min); j<ysize; j++)
+		for(i=c0; i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
 
 		
 	#pragma omp for collapse(2) nowait
-	for(j=sy; j<ysize-sy; j++)
-		for(i=0; i<sx; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,xconv,yconv,sx,sy,0,0);
+	for(j=y_min; j<y_max; j++)
+		for(i=c0; i<min(sx,xsize); i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
 	
 
 	#pragma omp for collapse(2)
-	for(j=sy; j<ysize-sy; j++)
-		for(i=xsize-sx; i<xsize; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,xconv,yconv,sx,sy,0,0);
+	for(j=y_min; j<y_max; j++)
+		for(i=max(xsize-sx,sx); i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,convolution_matrix,ksum,xconv,yconv,sx,sy,lines_up,lines_down,px);
 		
 		
-	//NON BORDER PART, NO CHECKS ON BOUNDARY
+	//NON BORDER PART, NO CHECKS ON BOUNDARY -> blocks of ROW_BLOCK rows, vectorized (see simd.c), then the rows left over one at a time
+	//image must be shifted by the amount of lines that has more than the blurring region (+lines_up)
 	
-	int l,m;
+	int nblocks = max(y_max-y_min,0)/ROW_BLOCK;
 	
-	#pragma omp for collapse(2)
-	for(j=sy;j<ysize-sy;j++)
-		for(i=sx;i<xsize-sx;i++)
-		{
-			KTYPE buffer = 0;
-
-			for(m=0; m<yconv; m++)
-				for(l=0; l<xconv; l++)	buffer += image[(i-sx+l)+xsize*(j-sy+m)]*convolution_matrix[l+xconv*m];
-				
-			blurred[i+xsize*j] = buffer + 0.5;
-		}
+	#pragma omp for
+	for(j=0;j<nblocks;j++)
+		if(xsize > 2*sx) Interior_rows(PIX_AT(image,(size_t)xsize*(y_min+ROW_BLOCK*j-sy+lines_up),px),PIX_AT(blurred,sx+(size_t)xsize*(y_min+ROW_BLOCK*j),px),xsize-2*sx,xsize,plan);
+	
+	#pragma omp for
+	for(j=y_min+ROW_BLOCK*nblocks;j<y_max;j++)
+		if(xsize > 2*sx) Interior_row(PIX_AT(image,(size_t)xsize*(j-sy+lines_up),px),PIX_AT(blurred,sx+(size_t)xsize*j,px),xsize-2*sx,xsize,plan);
 	
 	return;
 }
 
 
+/*
+* ENGINE DISPATCH - OMP
+*/
+
+void OMP_Blur(void *image, void *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+/*
+* Blurs image into blurred with the engine chosen by plan_kernel. image holds lines_up and lines_down extra lines above and below the
+* ysize lines to be blurred, as in the MPI versions (0 for a whole image).
+*
+* !! This function contains orphaned OMP directives -> to be used in a parallel region
+*/
+{
+	switch(plan->engine)
+	{
+		case ENGINE_SEPARABLE:
+			Separable_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_BOX:
+			Box_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_WEIGHTED:
+			Weighted_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_FFT:
+			FFT_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_IIR:
+			IIR_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_TILED:
+			Tiled_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_FIXED:
+			Fixed_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_LOWRANK:
+			Lowrank_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_SPARSE:
+			Sparse_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		case ENGINE_WINOGRAD:
+			Winograd_convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+		break;
+		
+		default:
+			OMP_Convolve(image,blurred,xsize,ysize,plan,lines_up,lines_down);
+	}
+	
+	return;
+}
@@ -0,0 +1,258 @@
+#include "ut.h"
+
+// =============================================================
+//  Winograd convolution engine (3x3 and 5x5 kernels)
+//
+//  * winograd_kernel
+//  * Winograd_convolve
+//
+//  Minimal filtering F(m x m, r x r): a tile of m x m output pixels is computed from the 6 x 6 input pixels below it as
+//  Y = A^T [U * (B^T d B)] A, U = G g G^T being the kernel transformed once per run and * the elementwise product, i.e. with 36
+//  multiplications instead of m*m*r*r: F(4x4, 3x3) for 3x3 kernels (2.25 per pixel instead of 9), F(2x2, 5x5) for 5x5 ones (9 instead
+//  of 25). Both use the interpolation points 0, 1, -1, 2, -2 and infinity, hence the same input transform B^T. The transforms are
+//  written as products by constant matrices, which the compiler unrolls and reduces to the few additions they amount to (most
+//  entries are 0 or +-1); a strip of tiles side by side is done at once, one tile per SIMD lane (compiled also for AVX2 and
+//  AVX-512, chosen as the row kernels by simd_select).
+//
+//  Numeric error: B^T has small integer entries, so the input transform of 16-bit pixels is exact in single precision (below 2^24);
+//  the error comes from the rounding of U and of the products, amplified by the output transform (entries up to 8): measured below
+//  0.08 grey levels with F(4x4, 3x3) and 0.03 with F(2x2, 5x5) on worst-case inputs (alternating 0 and MAXVAL), against ~0.005 for
+//  the direct engine. After rounding, the result differs from the exact one by +-1 only where that is close to a .5.
+//
+//  With a single image channel the transforms cost about as many additions as the multiplications they save, so with vector FMA
+//  the direct engine is faster (measured 2x for 3x3 and 2.5-3x for 5x5 with AVX2 and AVX-512, 2000x1500 pixels, one thread). Without
+//  (BLUR_SIMD=scalar or an older CPU) it takes about half the time of the direct and tiled engines for kernels without symmetries
+//  (17 ms against 35 for 3x3, 37 against 77 for 5x5), and is chosen automatically for such custom kernels; for symmetric ones the
+//  folded direct loop is as fast or faster.
+//
+//  Border effect: the border pixels are done by Border_blur, and the interior pixels left over by the tiles (less than m rows or
+//  columns) by Interior_row, exactly as in the direct engine.
+// =============================================================
+
+#define WINO_ALPHA 6  //input tile side, m+r-1
+
+//transforms for the interpolation points 0, 1, -1, 2, -2, infinity
+static const float BT[WINO_ALPHA][WINO_ALPHA] = {
+	{4,  0, -5,  0, 1, 0},
+	{0, -4, -4,  1, 1, 0},
+	{0,  4, -4, -1, 1, 0},
+	{0, -2, -1,  2, 1, 0},
+	{0,  2, -1, -2, 1, 0},
+	{0,  4,  0, -5, 0, 1}};
+
+//F(4,3)
+static const float AT4[4][WINO_ALPHA] = {
+	{1, 1,  1, 1,  1, 0},
+	{0, 1, -1, 2, -2, 0},
+	{0, 1,  1, 4,  4, 0},
+	{0, 1, -1, 8, -8, 1}};
+static const double G3[WINO_ALPHA][3] = {
+	{ 1.0/4,      0,      0},
+	{-1.0/6, -1.0/6, -1.0/6},
+	{-1.0/6,  1.0/6, -1.0/6},
+	{1.0/24, 1.0/12,  1.0/6},
+	{1.0/24,-1.0/12,  1.0/6},
+	{     0,      0,      1}};
+
+//F(2,5)
+static const float AT2[2][WINO_ALPHA] = {
+	{1, 1,  1, 1,  1, 0},
+	{0, 1, -1, 2, -2, 1}};
+static const double G5[WINO_ALPHA][5] = {
+	{ 1.0/4,      0,     0,      0,      0},
+	{-1.0/6, -1.0/6, -1.0/6, -1.0/6, -1.0/6},
+	{-1.0/6,  1.0/6, -1.0/6,  1.0/6, -1.0/6},
+	{1.0/24, 1.0/12,  1.0/6,  1.0/3,  2.0/3},
+	{1.0/24,-1.0/12,  1.0/6, -1.0/3,  2.0/3},
+	{     0,      0,      0,      0,      1}};
+
+int winograd_kernel(kernel_plan *plan)
+/*
+* Fills wino (U = G g G^T, WINO_ALPHA x WINO_ALPHA) of plan from its matrix. Returns 0 if the kernel is not 3x3 or 5x5, 1 otherwise.
+*/
+{
+	int r = plan->xconv, a,b,k,l;
+
+	if(r != plan->yconv || (r != 3 && r != 5)) return 0;
+
+	const double *G = r == 3 ? &G3[0][0] : &G5[0][0];
+	plan->wino = (KTYPE *)malloc(sizeof(KTYPE)*WINO_ALPHA*WINO_ALPHA);
+
+	for(a=0; a<WINO_ALPHA; a++)
+		for(b=0; b<WINO_ALPHA; b++)
+		{
+			double u = 0;
+			for(k=0; k<r; k++)
+				for(l=0; l<r; l++) u += G[a*r+k]*plan->matrix[l+r*k]*G[b*r+l];
+			plan->wino[a+WINO_ALPHA*b] = u;
+		}
+
+	return 1;
+}
+
+static inline __attribute__((always_inline)) void wino_strip(unsigned short int *in, unsigned short int *out, int ntiles, int xsize, KTYPE *U, float *H, int m, const float *AT)
+/*
+* ntiles tiles side by side: in points to the top left corner of the input of the first one, out to its first output pixel, H is a
+* buffer of WINO_ALPHA*WINO_ALPHA*ntiles floats. m and AT are compile-time constants in the instances below.
+*/
+{
+	int a,b,j,k,i,o,t;
+
+	//INPUT TRANSFORM, ALONG X -> H[a][k] = sum_b d[a][b] BT[k][b], for each input row a
+	for(a=0; a<WINO_ALPHA; a++)
+	{
+		unsigned short int *row = in + (size_t)xsize*a;
+
+		#pragma omp simd
+		for(t=0; t<ntiles; t++)
+		{
+			float d[WINO_ALPHA];
+			#pragma GCC unroll 6
+			for(b=0; b<WINO_ALPHA; b++) d[b] = row[m*t+b];
+
+			#pragma GCC unroll 6
+			for(k=0; k<WINO_ALPHA; k++)
+			{
+				float s = 0;
+				#pragma GCC unroll 6
+				for(b=0; b<WINO_ALPHA; b++) s += BT[k][b]*d[b];
+				H[(a*WINO_ALPHA+k)*ntiles+t] = s;
+			}
+		}
+	}
+
+	//INPUT TRANSFORM ALONG Y, PRODUCT BY U, OUTPUT TRANSFORM
+	#pragma omp simd
+	for(t=0; t<ntiles; t++)
+	{
+		float P[4][WINO_ALPHA];
+
+		#pragma GCC unroll 6
+		for(k=0; k<WINO_ALPHA; k++)
+		{
+			float v[WINO_ALPHA];
+
+			#pragma GCC unroll 6
+			for(j=0; j<WINO_ALPHA; j++)
+			{
+				float s = 0;
+				#pragma GCC unroll 6
+				for(a=0; a<WINO_ALPHA; a++) s += BT[j][a]*H[(a*WINO_ALPHA+k)*ntiles+t];
+				v[j] = s*U[j+WINO_ALPHA*k];
+			}
+
+			#pragma GCC unroll 6
+			for(i=0; i<m; i++)
+			{
+				float s = 0;
+				#pragma GCC unroll 6
+				for(j=0; j<WINO_ALPHA; j++) s += AT[i*WINO_ALPHA+j]*v[j];
+				P[i][k] = s;
+			}
+		}
+
+		#pragma GCC unroll 6
+		for(i=0; i<m; i++)
+			#pragma GCC unroll 6
+			for(o=0; o<m; o++)
+			{
+				float y = 0;
+				#pragma GCC unroll 6
+				for(k=0; k<WINO_ALPHA; k++) y += AT[o*WINO_ALPHA+k]*P[i][k];
+				out[(size_t)xsize*i+m*t+o] = min(max(y + 0.5f,0),MAXVAL);
+			}
+	}
+}
+
+//one instance per kernel size and instruction set, chosen through the simd level of the plan (see simd_select) as the row kernels
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define WINO_TARGET(t) __attribute__((target(t)))
+#	define WINO_LEVELS(f,m,AT) {f##_scalar, f##_avx2, f##_avx512}
+#else
+#	define WINO_TARGET(t)
+#	define WINO_LEVELS(f,m,AT) {f##_scalar, f##_scalar, f##_scalar}
+#endif
+
+#define WINO_STRIP(f,m,AT,suffix,target) \
+	target static void f##suffix(unsigned short int *in, unsigned short int *out, int ntiles, int xsize, KTYPE *U, float *H) \
+	{ wino_strip(in,out,ntiles,xsize,U,H,m,&AT[0][0]); }
+
+typedef void (*wino_kernel)(unsigned short int *in, unsigned short int *out, int ntiles, int xsize, KTYPE *U, float *H);
+
+WINO_STRIP(wino_strip_3,4,AT4,_scalar,)
+WINO_STRIP(wino_strip_5,2,AT2,_scalar,)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+WINO_STRIP(wino_strip_3,4,AT4,_avx2,WINO_TARGET("avx2,fma"))
+WINO_STRIP(wino_strip_5,2,AT2,_avx2,WINO_TARGET("avx2,fma"))
+WINO_STRIP(wino_strip_3,4,AT4,_avx512,WINO_TARGET("avx512f"))
+WINO_STRIP(wino_strip_5,2,AT2,_avx512,WINO_TARGET("avx512f"))
+#endif
+
+//[0] for 3x3 kernels, [1] for 5x5 ones
+static const wino_kernel wino_kernels[2][SIMD_AVX512+1] = {WINO_LEVELS(wino_strip_3,4,AT4), WINO_LEVELS(wino_strip_5,2,AT2)};
+
+void Winograd_convolve(unsigned short int *image, unsigned short int *blurred, int xsize, int ysize, kernel_plan *plan, int lines_up, int lines_down)
+//!! This function contains orphaned OMP directives -> to be used in a parallel region
+{
+	KTYPE *kernel = plan->matrix;
+	int xconv = plan->xconv, yconv = plan->yconv;
+	int sx = xconv/2, sy = yconv/2, m = WINO_ALPHA-xconv+1;
+
+	//same bounds as in Convolve
+	int y_max = max(ysize-sy+lines_down,0), y_min = min(sy-lines_up,ysize);
+	int c0 = plan->cols_left, c1 = xsize-plan->cols_right;
+	int width = xsize-2*sx, height = y_max-y_min;
+	int i,j,s;
+
+	//BORDER CALCULATION -> MUST INCLUDE CHECKING (and BORDER EFFECT CORRECTION)
+
+	#pragma omp for collapse(2) nowait
+	for(j=0; j<y_min; j++)
+		for(i=c0; i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,kernel,plan->ksum,xconv,yconv,sx,sy,lines_up,lines_down,plan->bswap);
+
+	#pragma omp for collapse(2) nowait
+	for(j=max(y_max,y_min); j<ysize; j++)
+		for(i=c0; i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,kernel,plan->ksum,xconv,yconv,sx,sy,lines_up,lines_down,plan->bswap);
+
+	#pragma omp for collapse(2) nowait
+	for(j=y_min; j<y_max; j++)
+		for(i=c0; i<min(sx,xsize); i++) Border_blur(image,blurred,xsize,ysize,i,j,kernel,plan->ksum,xconv,yconv,sx,sy,lines_up,lines_down,plan->bswap);
+
+	#pragma omp for collapse(2)
+	for(j=y_min; j<y_max; j++)
+		for(i=max(xsize-sx,sx); i<c1; i++) Border_blur(image,blurred,xsize,ysize,i,j,kernel,plan->ksum,xconv,yconv,sx,sy,lines_up,lines_down,plan->bswap);
+
+	if(width <= 0 || height <= 0) return;
+
+	//NON BORDER PART -> strips of m rows of tiles, the leftover columns and rows done directly
+
+	int ntiles = width/m, nstrips = height/m;
+
+	//private to each thread
+	float *H = (float *)malloc(sizeof(float)*WINO_ALPHA*WINO_ALPHA*max(ntiles,1));
+
+	#pragma omp for
+	for(s=0; s<nstrips; s++)
+	{
+		j = y_min + m*s;
+
+		//image must be shifted by the amount of lines that has more than the blurring region (+lines_up)
+		unsigned short int *in = image + (size_t)xsize*(j-sy+lines_up);
+
+		if(ntiles)
+		{
+			wino_kernels[xconv == 5][plan->simd](in,blurred+sx+(size_t)xsize*j,ntiles,xsize,plan->wino,H);
+		}
+
+		for(i=0; i<m && m*ntiles<width; i++)
+			Interior_row(in+m*ntiles+(size_t)xsize*i,blurred+sx+m*ntiles+(size_t)xsize*(j+i),width-m*ntiles,xsize,plan);
+	}
+
+	#pragma omp for
+	for(j=y_min+m*nstrips; j<y_max; j++)
+		Interior_row(image+(size_t)xsize*(j-sy+lines_up),blurred+sx+(size_t)xsize*j,width,xsize,plan);
+
+	free(H);
+
+	return;
+}